@@ -0,0 +1,429 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Little benchmarks for the Little Sheens C API.
+
+   Usage: bench BENCHMARK [N] [M]
+
+   Benchmarks:
+
+     sandbox: Actions per second with and without the sandbox pool.
+
+     match: Matches per second for the ECMAScript matcher (jsMatch)
+     and the native one (match).
+
+     arrays: Native matches per second for array patterns against a
+     message with a 200-element array, which is the worst case for the
+     matchers, without and with the index of the message's strings
+     that lets a literal string skip elements that can't equal it.
+
+     open: mach_open (well, machx_open) calls per second when
+     compiling the driver's source and when loading its bytecode.
+
+     batch: Crew messages per second one at a time (mach_crew_process
+     and mach_crew_update) and in batches of 100
+     (mach_crew_process_batch) for a crew of 100 'double' machines.
+
+     workers: Crew messages per second for a crew of 1000 'double'
+     machines with 1, 2, 4, ... worker heaps, up to M (default: the
+     number of processors online).
+
+     preload: Milliseconds for the first message to a crew of 100
+     'double' machines in a new context without and with
+     mach_preload_specs (of everything in specs/) first.
+
+     cbor: Crews parsed and serialized (mach_crew_open_buf and
+     mach_crew_export_buf) per second as JSON and as CBOR (see
+     mach_set_format) for a crew of 1000 'double' machines.
+
+   Run from the top-level directory so that specs/double.js can be
+   found. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "machines.h"
+#include "util.h"
+
+/* quietProvider is like util.c's specProvider except it doesn't talk,
+   and it doesn't reread a spec that's already cached. */
+char * quietProvider(void *this, const char *specname, const char *cached) {
+  if (cached != NULL && cached[0]) {
+    return NULL;
+  }
+  char file_name[4096];
+  snprintf(file_name, sizeof(file_name), "specs/%s.js", specname);
+  return readFile(file_name);
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void checkrc(int rc, const char *what) {
+  if (rc != MACH_OKAY) {
+    fprintf(stderr, "%s error %d\n", what, rc);
+    exit(rc);
+  }
+}
+
+/* statsCalls extracts the number of sandbox calls from the pool
+   stats. */
+unsigned long statsCalls() {
+  char stats[1024];
+  checkrc(mach_sandbox_pool_stats(stats, sizeof(stats)), "mach_sandbox_pool_stats");
+  char *p = strstr(stats, "\"calls\":");
+  return p == NULL ? 0 : strtoul(p + strlen("\"calls\":"), NULL, 10);
+}
+
+/* benchSandbox sends n messages to a 'double' machine, which runs a
+   guard and two actions for each message. */
+double benchSandbox(int poolSize, int n) {
+  size_t dst_limit = 16*1024;
+  char *dst = (char*) malloc(dst_limit);
+  char msg[64];
+
+  checkrc(mach_set_sandbox_pool_size(poolSize), "mach_set_sandbox_pool_size");
+  unsigned long calls = statsCalls();
+  double then = now();
+  int i;
+  for (i = 0; i < n; i++) {
+    snprintf(msg, sizeof(msg), "{\"double\":%d}", i);
+    checkrc(mach_process("{\"spec\":\"double\",\"node\":\"listen\",\"bs\":{\"count\":0}}",
+			 msg, dst, dst_limit), "mach_process");
+  }
+  double elapsed = now() - then;
+  calls = statsCalls() - calls;
+  free(dst);
+
+  double rate = calls / elapsed;
+  printf("sandbox pool %2d: %lu actions in %.3fs (%.0f actions/sec)\n",
+	 poolSize, calls, elapsed, rate);
+  return rate;
+}
+
+/* benchMatch times n rounds of a few matches with the given matcher
+   (in ECMAScript). */
+double benchMatch(char *matcher, int n) {
+  size_t dst_limit = 16*1024;
+  char *dst = (char*) malloc(dst_limit);
+  char *src = (char*) malloc(dst_limit);
+
+  snprintf(src, dst_limit,
+	   "(function() {\n"
+	   "  var cases = [\n"
+	   "    [{\"input\":\"coin\"}, {\"input\":\"coin\"}],\n"
+	   "    [{\"double\":\"?x\"}, {\"double\":42,\"to\":\"doubler\"}],\n"
+	   "    [{\"n\":\"?<n\"}, {\"n\":3}, {\"?<n\":10}],\n"
+	   "    [{\"a\":{\"b\":[\"?x\",\"c\"]},\"?k\":\"v\"}, {\"a\":{\"b\":[\"c\",\"d\",\"e\"]},\"k\":\"v\",\"z\":1}]\n"
+	   "  ];\n"
+	   "  for (var i = 0; i < %d; i++) {\n"
+	   "    for (var j = 0; j < cases.length; j++) {\n"
+	   "      %s(null, cases[j][0], cases[j][1], cases[j][2] || {});\n"
+	   "    }\n"
+	   "  }\n"
+	   "  return JSON.stringify(4 * %d);\n"
+	   "})()", n, matcher, n);
+
+  double then = now();
+  checkrc(mach_eval(src, dst, dst_limit), "mach_eval");
+  double elapsed = now() - then;
+  double rate = atof(dst) / elapsed;
+  printf("%-8s: %s matches in %.3fs (%.0f matches/sec)\n", matcher, dst, elapsed, rate);
+
+  free(src);
+  free(dst);
+  return rate;
+}
+
+/* benchArrays times n matches of a few array patterns against an
+   array of 200 devices with the native matcher, with or without its
+   index of the message's strings. */
+double benchArrays(int literals, int n) {
+  size_t dst_limit = 16*1024;
+  char *dst = (char*) malloc(dst_limit);
+  char *src = (char*) malloc(dst_limit);
+
+  snprintf(src, dst_limit,
+	   "(function() {\n"
+	   "  var ids = [], devices = [];\n"
+	   "  for (var i = 0; i < 200; i++) {\n"
+	   "    ids.push(\"d\" + i);\n"
+	   "    devices.push({id: \"d\" + i, type: i %% 7 == 0 ? \"lamp\" : \"plug\"});\n"
+	   "  }\n"
+	   "  var cases = [\n"
+	   "    [{\"ids\":[\"d150\",\"d199\",\"d3\",\"?x\"]}, {\"ids\":ids}],\n"
+	   "    [{\"ids\":[\"d150\",\"d1000\"]}, {\"ids\":ids}],\n"
+	   "    [{\"ds\":[{\"type\":\"lamp\",\"id\":\"?a\"},{\"id\":\"d199\"}]}, {\"ds\":devices}]\n"
+	   "  ];\n"
+	   "  var opts = {literals: %s};\n"
+	   "  for (var i = 0; i < %d; i++) {\n"
+	   "    for (var j = 0; j < cases.length; j++) {\n"
+	   "      nativeMatch(null, cases[j][0], cases[j][1], {}, undefined, opts);\n"
+	   "    }\n"
+	   "  }\n"
+	   "  return JSON.stringify(3 * %d);\n"
+	   "})()", literals ? "true" : "false", n, n);
+
+  double then = now();
+  checkrc(mach_eval(src, dst, dst_limit), "mach_eval");
+  double elapsed = now() - then;
+  double rate = atof(dst) / elapsed;
+  printf("literals %d: %s array matches in %.3fs (%.0f matches/sec)\n", literals, dst, elapsed, rate);
+
+  free(src);
+  free(dst);
+  return rate;
+}
+
+/* benchOpen times n opens (and closes) of new contexts. */
+double benchOpen(int bytecode, int n) {
+  double then = now();
+  int i;
+  for (i = 0; i < n; i++) {
+    void *ctx = mach_make_ctx();
+    checkrc(machx_set_bytecode(ctx, bytecode), "machx_set_bytecode");
+    checkrc(machx_open(ctx), "machx_open");
+    machx_close(ctx);
+    free(ctx);
+  }
+  double elapsed = now() - then;
+
+  double rate = n / elapsed;
+  printf("%-8s: %d opens in %.3fs (%.1f opens/sec, %.2fms each)\n",
+	 bytecode ? "bytecode" : "source", n, elapsed, rate, 1000 * elapsed / n);
+  return rate;
+}
+
+/* makeCrew writes a crew of 'double' machines. */
+char *makeCrew(int machines) {
+  size_t crew_limit = 128*machines + 64;
+  char *crew = (char*) malloc(crew_limit);
+  size_t at = snprintf(crew, crew_limit, "{\"id\":\"bench\",\"machines\":{");
+  int i;
+  for (i = 0; i < machines; i++) {
+    at += snprintf(crew + at, crew_limit - at,
+		   "%s\"m%d\":{\"spec\":\"double\",\"node\":\"listen\",\"bs\":{\"count\":0}}",
+		   i == 0 ? "" : ",", i);
+  }
+  snprintf(crew + at, crew_limit - at, "}}");
+  return crew;
+}
+
+/* benchBatch sends n messages to a crew of 'double' machines either
+   one at a time or in batches.  Each batch starts with the same
+   crew. */
+double benchBatch(int batched, int n) {
+  int machines = 100, batch = 100;
+  char *crew = makeCrew(machines);
+  size_t dst_limit = 1024*1024;
+  char *dst = (char*) malloc(dst_limit);
+  char *steppeds = (char*) malloc(dst_limit);
+  char *current = (char*) malloc(dst_limit);
+  char *msgs[batch];
+  int i, j;
+  for (j = 0; j < batch; j++) {
+    msgs[j] = (char*) malloc(64);
+  }
+
+  double then = now();
+  for (i = 0; i < n; i += batch) {
+    for (j = 0; j < batch; j++) {
+      snprintf(msgs[j], 64, "{\"double\":%d}", i + j);
+    }
+    if (batched) {
+      checkrc(mach_crew_process_batch(crew, msgs, batch, dst, dst_limit, NULL), "mach_crew_process_batch");
+    } else {
+      strcpy(current, crew);
+      for (j = 0; j < batch; j++) {
+	checkrc(mach_crew_process(current, msgs[j], steppeds, dst_limit), "mach_crew_process");
+	checkrc(mach_crew_update(current, steppeds, dst, dst_limit), "mach_crew_update");
+	strcpy(current, dst);
+      }
+    }
+  }
+  double elapsed = now() - then;
+  for (j = 0; j < batch; j++) {
+    free(msgs[j]);
+  }
+  free(crew);
+  free(current);
+  free(steppeds);
+  free(dst);
+
+  int sent = (n + batch - 1) / batch * batch;
+  double rate = sent / elapsed;
+  printf("%-9s: %d messages to %d machines in %.3fs (%.1f messages/sec)\n",
+	 batched ? "batched" : "unbatched", sent, machines, elapsed, rate);
+  return rate;
+}
+
+/* benchWorkers sends n messages to a crew of 'double' machines using
+   the given number of workers. */
+double benchWorkers(int workers, int n) {
+  int machines = 1000;
+  char *crew = makeCrew(machines);
+  size_t dst_limit = 1024*1024;
+  char *dst = (char*) malloc(dst_limit);
+  char msg[64];
+  int i;
+
+  checkrc(mach_set_workers(workers), "mach_set_workers");
+  double then = now();
+  for (i = 0; i < n; i++) {
+    snprintf(msg, sizeof(msg), "{\"double\":%d}", i);
+    checkrc(mach_crew_process(crew, msg, dst, dst_limit), "mach_crew_process");
+  }
+  double elapsed = now() - then;
+  free(crew);
+  free(dst);
+
+  double rate = n / elapsed;
+  printf("workers %3d: %d messages to %d machines in %.3fs (%.1f messages/sec)\n",
+	 workers, n, machines, elapsed, rate);
+  return rate;
+}
+
+/* benchPreload times the first message to a crew in each of n new
+   contexts, which are (or aren't) preloaded first. */
+double benchPreload(int preload, int n) {
+  char *crew = makeCrew(100);
+  size_t dst_limit = 1024*1024;
+  char *dst = (char*) malloc(dst_limit);
+  void *saved = mach_get_ctx();
+  double elapsed = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    mach_set_ctx(mach_make_ctx());
+    checkrc(mach_open(), "mach_open");
+    mach_set_spec_provider(NULL, quietProvider, MACH_FREE_FOR_PROVIDER);
+    checkrc(mach_enable_spec_cache(1), "mach_enable_spec_cache");
+    if (preload) {
+      checkrc(preloadSpecDir("specs", dst, dst_limit), "preloadSpecDir");
+      if (i == 0) {
+	printf("%s\n", dst);
+      }
+    }
+    double then = now();
+    checkrc(mach_crew_process(crew, "{\"double\":1}", dst, dst_limit), "mach_crew_process");
+    elapsed += now() - then;
+    mach_close();
+    free(mach_get_ctx());
+  }
+  mach_set_ctx(saved);
+  free(crew);
+  free(dst);
+
+  double ms = 1000 * elapsed / n;
+  printf("%-10s: first message %.3fms (average of %d)\n",
+	 preload ? "preloaded" : "cold", ms, n);
+  return ms;
+}
+
+/* benchFormat opens (parses) and exports (serializes) the crew n
+   times in the given format.  The crew is given as JSON and converted
+   first. */
+double benchFormat(int format, int n, char *crew_js) {
+  mach_buf json = {crew_js, strlen(crew_js), 0};
+  mach_buf crew = MACH_BUF_INIT;
+  mach_buf out = MACH_BUF_INIT;
+  int h, i;
+
+  checkrc(mach_set_format(MACH_FORMAT_JSON), "mach_set_format");
+  checkrc(mach_crew_open_buf(&json, &h), "mach_crew_open_buf");
+  checkrc(mach_set_format(format), "mach_set_format");
+  checkrc(mach_crew_export_buf(h, &crew), "mach_crew_export_buf");
+  checkrc(mach_crew_close(h), "mach_crew_close");
+
+  double then = now();
+  for (i = 0; i < n; i++) {
+    checkrc(mach_crew_open_buf(&crew, &h), "mach_crew_open_buf");
+    checkrc(mach_crew_export_buf(h, &out), "mach_crew_export_buf");
+    checkrc(mach_crew_close(h), "mach_crew_close");
+  }
+  double elapsed = now() - then;
+  checkrc(mach_set_format(MACH_FORMAT_JSON), "mach_set_format");
+
+  double rate = n / elapsed;
+  printf("%-4s: %zu-byte crew parsed and serialized %d times in %.3fs (%.1f/sec)\n",
+	 format == MACH_FORMAT_CBOR ? "cbor" : "json", crew.len, n, elapsed, rate);
+  mach_buf_free(&crew);
+  mach_buf_free(&out);
+  return rate;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s sandbox|match|arrays|open|batch|workers|preload|cbor [N] [M]\n", argv[0]);
+    exit(1);
+  }
+  char *benchmark = argv[1];
+  int n = argc < 3 ? 1000 : atoi(argv[2]);
+
+  mach_set_ctx(mach_make_ctx());
+  checkrc(mach_open(), "mach_open");
+  mach_set_spec_provider(NULL, quietProvider, MACH_FREE_FOR_PROVIDER);
+  checkrc(mach_enable_spec_cache(1), "mach_enable_spec_cache");
+
+  if (strcmp(benchmark, "sandbox") == 0) {
+    double before = benchSandbox(0, n);
+    double after = benchSandbox(MACH_DEFAULT_SANDBOX_POOL_SIZE, n);
+    printf("speedup %.2fx\n", after / before);
+  } else if (strcmp(benchmark, "match") == 0) {
+    double before = benchMatch("jsMatch", n);
+    double after = benchMatch("match", n);
+    printf("speedup %.2fx\n", after / before);
+  } else if (strcmp(benchmark, "arrays") == 0) {
+    double before = benchArrays(0, n);
+    double after = benchArrays(1, n);
+    printf("speedup %.2fx\n", after / before);
+  } else if (strcmp(benchmark, "open") == 0) {
+    double before = benchOpen(0, n);
+    double after = benchOpen(1, n);
+    printf("speedup %.2fx\n", after / before);
+  } else if (strcmp(benchmark, "batch") == 0) {
+    double before = benchBatch(0, n);
+    double after = benchBatch(1, n);
+    printf("speedup %.2fx\n", after / before);
+  } else if (strcmp(benchmark, "workers") == 0) {
+    int m = argc < 4 ? (int) sysconf(_SC_NPROCESSORS_ONLN) : atoi(argv[3]);
+    double before = benchWorkers(1, n);
+    int w;
+    for (w = 2; w <= m; w *= 2) {
+      double after = benchWorkers(w, n);
+      printf("speedup %.2fx\n", after / before);
+    }
+  } else if (strcmp(benchmark, "preload") == 0) {
+    double before = benchPreload(0, n);
+    double after = benchPreload(1, n);
+    printf("speedup %.2fx\n", before / after);
+  } else if (strcmp(benchmark, "cbor") == 0) {
+    char *crew = makeCrew(1000);
+    double before = benchFormat(MACH_FORMAT_JSON, n, crew);
+    double after = benchFormat(MACH_FORMAT_CBOR, n, crew);
+    printf("speedup %.2fx\n", after / before);
+    free(crew);
+  } else {
+    fprintf(stderr, "unknown benchmark '%s'\n", benchmark);
+    exit(1);
+  }
+
+  mach_close();
+  free(mach_get_ctx());
+}
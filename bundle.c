@@ -0,0 +1,171 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A spec bundle is a single file of specs, which mkbundle writes,
+   that mach_bundle_open maps into memory.  The layout:
+
+     "SHEENSB1"                         8-byte magic
+     count                              4 bytes
+     index[count]                       16 bytes each, sorted by name:
+       name offset, name length,
+       spec offset, spec length
+     names and specs                    each followed by a null
+
+   All numbers are unsigned 32-bit little-endian, and offsets are from
+   the start of the file. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "machines.h"
+
+#define BUNDLE_MAGIC "SHEENSB1"
+#define BUNDLE_HEADER (8 + 4)
+#define BUNDLE_ENTRY (4 * 4)
+
+typedef struct {
+   const unsigned char *map;
+   size_t size;
+   uint32_t n;
+} Bundle;
+
+static uint32_t get32(const unsigned char *p) {
+   return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* bundle_field returns the string that the i-th index entry's field
+   (0 for the name and 2 for the spec) refers to. */
+static const char *bundle_field(const Bundle *b, uint32_t i, int field, size_t *len) {
+   const unsigned char *e = b->map + BUNDLE_HEADER + (size_t)i * BUNDLE_ENTRY;
+   if (len != NULL) {
+      *len = get32(e + 4 * (field + 1));
+   }
+   return (const char *)b->map + get32(e + 4 * field);
+}
+
+/* bundle_check makes sure every index entry refers to a
+   null-terminated string within the bundle. */
+static int bundle_check(const Bundle *b) {
+   uint32_t i;
+   int field;
+
+   if (b->size < BUNDLE_HEADER || memcmp(b->map, BUNDLE_MAGIC, 8) != 0) {
+      return MACH_SAD;
+   }
+   if ((b->size - BUNDLE_HEADER) / BUNDLE_ENTRY < b->n) {
+      return MACH_SAD;
+   }
+   for (i = 0; i < b->n; i++) {
+      const unsigned char *e = b->map + BUNDLE_HEADER + (size_t)i * BUNDLE_ENTRY;
+      for (field = 0; field < 4; field += 2) {
+         size_t off = get32(e + 4 * field);
+         size_t len = get32(e + 4 * (field + 1));
+         if (b->size <= off || b->size - off <= len || b->map[off + len] != '\0') {
+            return MACH_SAD;
+         }
+      }
+   }
+   return MACH_OKAY;
+}
+
+void *mach_bundle_open(const char *filename) {
+   struct stat st;
+   Bundle *b;
+   void *map;
+   int fd = open(filename, O_RDONLY);
+
+   if (fd < 0) {
+      return NULL;
+   }
+   if (fstat(fd, &st) != 0 || st.st_size < BUNDLE_HEADER) {
+      close(fd);
+      return NULL;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return NULL;
+   }
+
+   b = malloc(sizeof(Bundle));
+   if (b == NULL) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   b->map = map;
+   b->size = st.st_size;
+   b->n = get32(b->map + 8);
+   if (bundle_check(b) != MACH_OKAY) {
+      mach_bundle_close(b);
+      return NULL;
+   }
+
+   return b;
+}
+
+void mach_bundle_close(void *bundle) {
+   Bundle *b = bundle;
+   if (b == NULL) {
+      return;
+   }
+   munmap((void *)b->map, b->size);
+   free(b);
+}
+
+int mach_bundle_count(void *bundle) {
+   Bundle *b = bundle;
+   return (int)b->n;
+}
+
+const char *mach_bundle_name(void *bundle, int i) {
+   Bundle *b = bundle;
+   if (i < 0 || b->n <= (uint32_t)i) {
+      return NULL;
+   }
+   return bundle_field(b, i, 0, NULL);
+}
+
+const char *mach_bundle_get(void *bundle, const char *name, size_t *len) {
+   Bundle *b = bundle;
+   uint32_t lo = 0, hi = b->n;
+
+   /* The index is sorted by name. */
+   while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      int cmp = strcmp(name, bundle_field(b, mid, 0, NULL));
+      if (cmp == 0) {
+         return bundle_field(b, mid, 2, len);
+      }
+      if (cmp < 0) {
+         hi = mid;
+      } else {
+         lo = mid + 1;
+      }
+   }
+   return NULL;
+}
+
+char *mach_bundle_provider(void *bundle, const char *name, const char *cached) {
+   /* A bundle doesn't change, so a cached spec is current. */
+   if (cached != NULL && cached[0]) {
+      return NULL;
+   }
+   return (char *)mach_bundle_get(bundle, name, NULL);
+}
@@ -221,39 +221,95 @@ int main(int argc, char **argv) {
   
   {
     /* Let's run a bunch of messages through our sophisticated
-       'double' machine. */
+       'double' machine.  This time we'll use mach_bufs, which grow
+       as needed, so we don't have to guess how big the crew and the
+       steppeds might get. */
     
     int iterations = 10;
     int i;
     
-    char * msg = (char *) malloc(dst_limit);
+    char msg[64];
+    mach_buf crew_buf = MACH_BUF_INIT;
+    mach_buf steppeds_buf = MACH_BUF_INIT;
+    mach_buf updated_buf = MACH_BUF_INIT;
+    checkrc(mach_buf_set(&crew_buf, crew, strlen(crew)));
     
     for (i = 0; i < iterations; i++) {
-      snprintf(msg, dst_limit, "{\"double\": %d}", 100*i);
-      rc = mach_crew_process(crew, msg, steppeds, dst_limit);
+      int n = snprintf(msg, sizeof(msg), "{\"double\": %d}", 100*i);
+      mach_buf msg_buf = {msg, n, 0};
+      rc = mach_crew_process_buf(&crew_buf, &msg_buf, &steppeds_buf);
       if (rc == MACH_OKAY) {
-	printf("%d processed %s\n", i, steppeds);
+	printf("%d processed %s\n", i, steppeds_buf.data);
       } else {
 	printf("%d processed error rc %d\n", i, rc);
       }
       
       /* Show the messages we generated. */
-      if ((rc = mach_do_emitted(steppeds, printer)) == MACH_OKAY) {
+      if ((rc = mach_do_emitted(steppeds_buf.data, printer)) == MACH_OKAY) {
       } else {
 	printf("%d emitted error rc %d\n", i, rc);
       }
       
       /* Update our crew state. */
-      rc = mach_crew_update(crew, steppeds, dst, dst_limit);
+      rc = mach_crew_update_buf(&crew_buf, &steppeds_buf, &updated_buf);
       if (rc == MACH_OKAY) {
-	printf("%d updated %s\n", i, dst);
+	printf("%d updated %s\n", i, updated_buf.data);
+	/* Swap the buffers rather than copying. */
+	mach_buf tmp = crew_buf;
+	crew_buf = updated_buf;
+	updated_buf = tmp;
       } else {
 	printf("rc %d\n", rc);
       }
-      strcpy(crew, dst);
     }
     
-    free(msg);
+    /* The rest of the demo uses plain strings. */
+    if (dst_limit <= crew_buf.len) {
+      rcprintf(MACH_TOO_BIG, "crew\n");
+    } else {
+      strcpy(crew, crew_buf.data);
+    }
+    mach_buf_free(&crew_buf);
+    mach_buf_free(&steppeds_buf);
+    mach_buf_free(&updated_buf);
+  }
+
+  {
+    /* A resident crew stays parsed in the runtime, and processing a
+       message updates it in place.  We only serialize it when we
+       want to save it somewhere. */
+
+    int h;
+    rc = mach_crew_open(crew, &h);
+    checkrc(rc);
+
+    rc = mach_crew_handle_set_machine(h, "turnstile", "turnstile", "{}", "locked");
+    checkrc(rc);
+
+    char *msgs[] = {"{\"double\": 7}", "{\"input\":\"coin\"}", "{\"input\":\"push\"}", NULL};
+    for (i = 0; msgs[i] != NULL; i++) {
+      rc = mach_crew_handle_process(h, msgs[i], steppeds, dst_limit);
+      rcprintf(rc, "resident processed %s\n", steppeds);
+    }
+
+    rc = mach_crew_export(h, dst, dst_limit);
+    rcprintf(rc, "resident exported %s\n", dst);
+
+    rc = mach_crew_close(h);
+    checkrc(rc);
+  }
+
+  {
+    /* A batch of messages goes through the crew in one call, which
+       parses and serializes the crew just once. */
+
+    char *msgs[] = {"{\"double\": 1}", "{\"double\": 2}", "not json", "{\"double\": 3}"};
+    int statuses[4];
+    rc = mach_crew_process_batch(crew, msgs, 4, dst, dst_limit, statuses);
+    rcprintf(rc, "batch processed %s\n", dst);
+    for (i = 0; rc == MACH_OKAY && i < 4; i++) {
+      printf("batch message %d status %d\n", i, statuses[i]);
+    }
   }
   
   for (i = 0; i < 16; i++) {
@@ -1,5 +1,7 @@
 var Cfg = {
-    MaxSteps: 100
+    MaxSteps: 100,
+    // Steppeds is "full" or "changed".  See crewProcess.
+    Steppeds: "full"
 };
 
 var Stats = {
@@ -9,24 +11,65 @@ var Stats = {
     CrewProcess: 0,
     CrewUpdate: 0,
     SpecCacheHits: 0,
-    SpecCacheMisses: 0
+    SpecCacheMisses: 0,
+    // Machines that a crew index spared a broadcast message.
+    CrewIndexPruned: 0,
+    // Machines that a crew index gave a broadcast message.
+    CrewIndexCandidates: 0
 };
 
 var DefaultSpecCacheLimit = 128;
 
+// SpecCache is a least-recently-used cache of parsed and compiled
+// specs.  Entries are on a doubly linked list, most recently used
+// first, so get, add, and eviction are all O(1).
+//
+// The cache has two limits: the number of entries ('limit') and,
+// optionally, the number of bytes ('byteLimit', with zero meaning no
+// limit).  An entry's bytes are an estimate: the length of the spec's
+// source plus the length of its compiled actions and guards (see
+// specBytes).
+//
+// A cached spec is used without asking the provider until it's stale:
+// when its time to live ('ttl' milliseconds, with zero meaning
+// forever) is up, or after it's invalidated.  Then GetSpec asks the
+// provider to revalidate it.
 var SpecCache = function() {
     var enabled = false;
-    var entries = {};
+    var entries = Object.create(null);
     var limit = DefaultSpecCacheLimit;
+    var byteLimit = 0;
+    var ttl = 0;
     var size = 0;
-    var hits = 0, misses = 0;
-    var makeRoom = function(n) {
-	var keys = Object.keys(entries);
-	var evict = (size + n) - limit;
-	for (var i = 0; 0 < evict && i < keys.length; i++) {
-	    delete entries[keys[i]];
-	    size--;
-	    evict--;
+    var bytes = 0;
+    var hits = 0, misses = 0, evictions = 0;
+
+    // The list's sentinel: head.next is the most recently used entry,
+    // and head.prev is the least.
+    var head = {};
+    head.next = head.prev = head;
+
+    var unlink = function(e) {
+	e.prev.next = e.next;
+	e.next.prev = e.prev;
+    };
+    var pushFront = function(e) {
+	e.next = head.next;
+	e.prev = head;
+	head.next.prev = e;
+	head.next = e;
+    };
+    var remove = function(e) {
+	unlink(e);
+	delete entries[e.key];
+	size--;
+	bytes -= e.bytes;
+    };
+    var makeRoom = function(n, b) {
+	while (head.prev !== head &&
+	       (limit < size + n || (0 < byteLimit && byteLimit < bytes + b))) {
+	    remove(head.prev);
+	    evictions++;
 	}
     };
     return {
@@ -36,15 +79,60 @@ var SpecCache = function() {
 	disable: function() {
 	    enabled = false;
 	},
+	isEnabled: function() {
+	    return enabled;
+	},
 	clear: function() {
-	    entries = {};
+	    entries = Object.create(null);
+	    head.next = head.prev = head;
 	    size = 0;
+	    bytes = 0;
 	    hits = 0;
 	    misses = 0;
+	    evictions = 0;
 	},
 	setLimit: function(n) {
 	    limit = n;
-	    makeRoom(0);
+	    makeRoom(0, 0);
+	},
+	setByteLimit: function(n) {
+	    byteLimit = n;
+	    makeRoom(0, 0);
+	},
+	setTTL: function(ms) {
+	    ttl = ms;
+	},
+	// isFresh reports whether the cached value can be used without
+	// asking the provider.
+	isFresh: function(v) {
+	    return !v.stale && (ttl <= 0 || Date.now() - v.checked < ttl);
+	},
+	// revalidated notes that the provider said the cached value is
+	// current.
+	revalidated: function(v, version) {
+	    v.stale = false;
+	    v.checked = 0 < ttl ? Date.now() : 0;
+	    if (version) {
+		v.version = version;
+	    }
+	},
+	// invalidate makes the named entry (or every entry if there's no
+	// name) stale.  Returns the number of entries invalidated.
+	invalidate: function(k) {
+	    if (k != null) {
+		var e = entries[k];
+		if (!e) {
+		    return 0;
+		}
+		e.value.stale = true;
+		return 1;
+	    }
+	    var n = 0;
+	    for (var e = head.next; e !== head; e = e.next) {
+		e.value.stale = true;
+		n++;
+	    }
+	    return n;
 	},
 	add: function(k,v) {
 	    if (!enabled) {
@@ -53,65 +141,131 @@ var SpecCache = function() {
 	    if (limit <= 0) {
 		return;
 	    }
-	    var existing = entries[k];
-	    var haveKey = false;
-	    if (existing) {
-		haveKey = true;
-	    }
-
-	    if (!haveKey) {
-		makeRoom(1);
+	    var b = specBytes(v);
+	    if (0 < byteLimit && byteLimit < b) {
+		// Would never fit.
+		return;
 	    }
-	    if (!haveKey) {
-		size++;
+	    var e = entries[k];
+	    if (e) {
+		remove(e);
 	    }
-	    entries[k] = v;
+	    makeRoom(1, b);
+	    v.stale = false;
+	    v.checked = 0 < ttl ? Date.now() : 0;
+	    e = {key: k, value: v, bytes: b, hits: 0};
+	    entries[k] = e;
+	    pushFront(e);
+	    size++;
+	    bytes += b;
 	},
 	get: function(k) {
 	    if (!enabled) {
 		return null;
 	    }
-	    var v = entries[k];
-	    if (v) {
+	    var e = entries[k];
+	    if (e) {
 		hits++;
+		e.hits++;
 		Stats.SpecCacheHits++;
-	    } else {
-		misses++;
-		Stats.SpecCacheMisses++;
+		unlink(e);
+		pushFront(e);
+		return e.value;
 	    }
-	    return v;
+	    misses++;
+	    Stats.SpecCacheMisses++;
+	    return undefined;
 	},
 	summary: function() {
 	    return {
 		size: size,
-		numberOfEntries: Object.keys(entries).length,
+		numberOfEntries: size,
 		limit: limit,
+		bytes: bytes,
+		byteLimit: byteLimit,
+		ttl: ttl,
 		hits: hits,
 		enabled: enabled,
-		misses: misses
+		misses: misses,
+		evictions: evictions
 	    };
+	},
+	// entries returns {name, bytes, hits} for each entry, most
+	// recently used first.
+	entries: function() {
+	    var acc = [];
+	    for (var e = head.next; e !== head; e = e.next) {
+		acc.push({name: e.key, bytes: e.bytes, hits: e.hits});
+	    }
+	    return acc;
 	}
     };
 }();
 
+// specBytes estimates the memory that a SpecCache entry costs: the
+// length of the spec's source plus the length of the bytecode for its
+// compiled actions and guards.
+function specBytes(entry) {
+    var n = entry.string ? entry.string.length : 0;
+    var nodes = entry.compiled && entry.compiled.nodes;
+    for (var name in nodes) {
+	var cnode = nodes[name];
+	var actions = cnode.actions || [];
+	for (var i = 0; i < actions.length; i++) {
+	    if (actions[i] && actions[i].code) {
+		n += actions[i].code.length;
+	    }
+	}
+	var branches = cnode.branches || [];
+	for (var i = 0; i < branches.length; i++) {
+	    var guard = branches[i].guard;
+	    if (guard && guard.code) {
+		n += guard.code.length;
+	    }
+	}
+    }
+    return n;
+}
+
+// SpecCacheStats returns the SpecCache's summary and its entries as
+// JSON.  mach_spec_cache_stats calls this function.
+function SpecCacheStats() {
+    var stats = SpecCache.summary();
+    stats.entries = SpecCache.entries();
+    return JSON.stringify(stats);
+}
+
 function GetSpec(filename) {
     Stats.GetSpec++;
     
     // print("GetSpec " + filename + " (cache size " + SpecCacheLimit + ")");
     
-    var cached = SpecCache.get(filename);;
+    var cached = SpecCache.get(filename);
+    if (cached && SpecCache.isFresh(cached)) {
+	return cached.spec;
+    }
 
     var cachedString = "";
+    var cachedVersion = null;
     if (cached) {
-	// print("GetSpec " + filename + " in cache");
+	// print("GetSpec " + filename + " is stale");
 	cachedString = cached.string;
+	cachedVersion = cached.version;
     }
-    var js = provider(filename, cachedString);
+    var js = provider(filename, cachedString, cachedVersion);
     // js can be null, the same as the given cachedString, or a new
-    // string.
+    // string.  A versioned provider (see
+    // mach_set_versioned_spec_provider) gives {js: JS, version:
+    // VERSION} instead, where JS can be null.
+    var version = null;
+    if (js && typeof js == 'object') {
+	version = js.version;
+	js = js.js;
+    }
     
     if (!js) {
 	if (cached) {
+	    SpecCache.revalidated(cached, version);
 	    return cached.spec;
 	}
 	var err = {filename: filename, error: "not provided"};
@@ -119,24 +273,167 @@ function GetSpec(filename) {
     }
 
     if (js == cachedString) {
+	SpecCache.revalidated(cached, version);
 	return cached.spec;
     }
     
+    var spec = installSpec(filename, js, version);
+
+    // Resident crews' indexes might be from other content (even if
+    // this spec wasn't cached, since it might have been evicted).
+    reindexSpec(filename);
+
+    return spec;
+}
+
+// SpecInstalls counts the installs of each spec.  An index entry (see
+// indexMachine) remembers the count when it was made, so
+// reindexSpec can find the entries that came from earlier content.
+var SpecInstalls = Object.create(null);
+
+// installSpec parses the given spec source and adds the spec to the
+// spec cache (if it's enabled).
+function installSpec(filename, js, version) {
     var spec = JSON.parse(js);
     Stats.ParseSpec++;
+    SpecInstalls[filename] = (SpecInstalls[filename] || 0) + 1;
+    // Compile everything now if the spec will be cached.  Otherwise
+    // the spec is parsed again for the next step, so compiling would
+    // be wasted, and sealing the spec without a compiled form makes
+    // step interpret it as it is.
+    var compiled = null;
+    if (SpecCache.isEnabled()) {
+	compiled = compileSpec(spec, true);
+    }
     Object.seal(spec);
     SpecCache.add(filename, {
 	    spec: spec,
-	    string: js
+	    string: js,
+	    compiled: compiled,
+	    version: version
     });
-
     return spec;
 }
 
-function Process(state_js, message_js) {
+// PreloadSpecs installs specs that have already been fetched (see
+// mach_preload_specs) in the spec cache, which must be enabled.  Each
+// item is {name, js, version, fetchMs}.  Returns a report (as JSON)
+// that gives each spec's fetch and compile times in milliseconds.
+function PreloadSpecs(items) {
+    if (!SpecCache.isEnabled()) {
+	throw "spec cache is not enabled";
+    }
+    var then = Date.now();
+    var report = {specs: []};
+    for (var i = 0; i < items.length; i++) {
+	var item = items[i];
+	var r = {name: item.name, fetchMs: item.fetchMs};
+	if (!item.js) {
+	    r.error = "not provided";
+	} else {
+	    var start = Date.now();
+	    try {
+		installSpec(item.name, item.js, item.version);
+		r.compileMs = Date.now() - start;
+		// The spec might replace one that resident crews use.
+		reindexSpec(item.name);
+	    } catch (e) {
+		r.error = String(e);
+	    }
+	}
+	report.specs.push(r);
+    }
+    report.ms = Date.now() - then;
+    return JSON.stringify(report);
+}
+
+// SpecUsers maps a spec's name to the indexed machines in resident
+// crews that use it: {HANDLE: {MID: true}}.  indexMachine maintains
+// it, so reindexSpec only visits the machines that use the spec.
+var SpecUsers = Object.create(null);
+
+// specUser adds (or, if not 'using', removes) the machine in the
+// resident crew h to (from) the spec's SpecUsers.
+function specUser(filename, h, mid, using) {
+    var users = SpecUsers[filename];
+    if (using) {
+	users = users || (SpecUsers[filename] = Object.create(null));
+	(users[h] || (users[h] = Object.create(null)))[mid] = true;
+	return;
+    }
+    if (!users || !users[h]) {
+	return;
+    }
+    delete users[h][mid];
+    for (var k in users[h]) {
+	return;
+    }
+    delete users[h];
+    for (var k in users) {
+	return;
+    }
+    delete SpecUsers[filename];
+}
+
+// reindexSpec reindexes the machines in resident crews that use the
+// given spec and were indexed before its latest install.
+function reindexSpec(filename) {
+    if (!SpecCache.isEnabled()) {
+	// Indexes aren't used.
+	return;
+    }
+    var installs = SpecInstalls[filename];
+    var users = SpecUsers[filename];
+    for (var h in users) {
+	var crew = Crews[h];
+	// indexMachine changes users[h].
+	var mids = [];
+	for (var mid in users[h]) {
+	    mids.push(mid);
+	}
+	for (var i = 0; i < mids.length; i++) {
+	    var entry = crew.index.entries[mids[i]];
+	    if (entry && entry.installs !== installs) {
+		indexMachine(crew, mids[i]);
+	    }
+	}
+    }
+}
+
+// InvalidateSpec makes the named cached spec (or all of them if the
+// name is null) stale, so the next GetSpec asks the provider about
+// it.  mach_invalidate_spec calls this function.
+function InvalidateSpec(filename) {
+    return SpecCache.invalidate(filename);
+}
+
+// Emit streams emitted messages to the C emit handler (see
+// mach_set_emit_handler), which 'emitNative' calls, as walk produces
+// them.  A worker's 'emitNative' keeps them for the main thread.
+var Emit = {
+    enabled: false,
+    // The id of the machine that's walking.
+    mid: "",
+    emit: function(message) {
+	emitNative(Emit.mid, JSON.stringify(message));
+    }
+};
+
+// decodeWire parses what came in through the C API, which is JSON
+// or, if 'binary' (see mach_set_format), a CBOR buffer.
+function decodeWire(x, binary) {
+    return binary ? CBOR.decode(x) : JSON.parse(x);
+}
+
+// encodeWire is the inverse of decodeWire.
+function encodeWire(x, binary) {
+    return binary ? CBOR.encode(x) : JSON.stringify(x);
+}
+
+function Process(state_js, message_js, binary) {
     Stats.Process++;
     try {
-	var state = JSON.parse(state_js);
+	var state = decodeWire(state_js, binary);
 
 	// Don't do anything to the name of the spec that will be
 	// handed to the spec provider.  Let the spec provider do
@@ -145,11 +442,12 @@ function Process(state_js, message_js) {
 	
 	var spec = GetSpec(state.spec);
 	delete state.spec;
-	var message = JSON.parse(message_js);
+	var message = decodeWire(message_js, binary);
 	
-	var stepped = walk(Cfg, spec, state, message);
+	Emit.mid = "";
+	var stepped = walk(Cfg, spec, state, message, Emit.enabled && Emit.emit);
 	
-	return JSON.stringify(stepped);
+	return encodeWire(stepped, binary);
     } catch (err) {
 	print("driver Process error", err, JSON.stringify(err));
 	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
@@ -207,77 +505,584 @@ function RemMachine(crew_js, id) {
     }
 }
 
-function CrewProcess(crew_js, message_js) {
-    Stats.CrewProcess++;
+// bindingsDiff returns the key-level changes from the bindings 'from'
+// to the bindings 'to':
+//
+//   {set: {KEY: VALUE}, del: [KEY]}
+//
+// where either property is absent if empty.  Returns null if there
+// are no changes.
+function bindingsDiff(from, to) {
+    if (from === to) {
+	return null;
+    }
+    from = from || {};
+    to = to || {};
+    var diff = null;
+    for (var k in to) {
+	var v = to[k];
+	var was = from[k];
+	if (v === was || (was !== undefined && JSON.stringify(v) === JSON.stringify(was))) {
+	    continue;
+	}
+	diff = diff || {};
+	diff.set = diff.set || {};
+	diff.set[k] = v;
+    }
+    for (var k in from) {
+	if (to[k] === undefined) {
+	    diff = diff || {};
+	    diff.del = diff.del || [];
+	    diff.del.push(k);
+	}
+    }
+    return diff;
+}
+
+// changedStepped returns the compact form of the stepped for the
+// machine:
+//
+//   {diff: {node: NODE, set: {KEY: VALUE}, del: [KEY]}, emitted: MESSAGES}
+//
+// where every property is absent if there's nothing to report.
+// Returns null if the machine didn't change and didn't emit
+// anything.
+function changedStepped(machine, stepped) {
+    var acc = {};
+    var diff = bindingsDiff(machine.bs, stepped.to.bs) || {};
+    if (stepped.to.node !== machine.node) {
+	diff.node = stepped.to.node;
+    }
+    for (var k in diff) {
+	acc.diff = diff;
+	break;
+    }
+    if (stepped.emitted && 0 < stepped.emitted.length) {
+	acc.emitted = stepped.emitted;
+    }
+    if (stepped.stoppedBecause) {
+	acc.stoppedBecause = stepped.stoppedBecause;
+    }
+    for (var k in acc) {
+	return acc;
+    }
+    return null;
+}
+
+// Crew indexes: A resident crew has an index (its non-enumerable
+// 'index' property) from message properties to the machines whose
+// current nodes require them (see requiredKeys in js/compile.js).  A
+// broadcast message only goes to machines that require one of the
+// message's properties and to machines that the index can't rule
+// out.
+//
+// Since the index comes from compiled specs, it's only used when the
+// spec cache is enabled.  A machine's entry reflects its spec when
+// the machine last changed or the spec was last installed.
+
+// indexCrew indexes the crew, which is the resident crew h if h is
+// given.
+function indexCrew(crew, h) {
+    var index = {
+	byKey: Object.create(null),
+	always: Object.create(null),
+	entries: Object.create(null),
+	handle: h,
+	size: 0,
+	seq: 0
+    };
+    Object.defineProperty(crew, "index", {value: index, configurable: true});
+    for (var mid in crew.machines) {
+	indexMachine(crew, mid);
+    }
+}
+
+// unindexCrew forgets the resident crew's machines in SpecUsers.
+function unindexCrew(crew) {
+    var index = crew.index;
+    if (!index || index.handle === undefined) {
+	return;
+    }
+    for (var mid in index.entries) {
+	specUser(index.entries[mid].spec, index.handle, mid, false);
+    }
+}
 
+// machineRequires returns the requiredKeys for the machine's current
+// node (or null if it can't tell).
+function machineRequires(machine) {
+    if (!SpecCache.isEnabled()) {
+	return null;
+    }
     try {
-	
-	var crew = JSON.parse(crew_js);
-	var message = JSON.parse(message_js);
-
-	// Optionally direct the message to a single machine as
-	// specified in the message's (optional) "to" property.  For
-	// example, if the message has the form {"to":"m42",...}, then
-	// that message will be sent to machine m42 only.  Generalize
-	// to accept an array: "to":["m42","m43"].
-
-	var targets = message.to;
-	if (targets) {
-	    // Routing to specific machine(s).
-	    if (typeof targets == 'string') {
-		targets = [targets];
+	var cnode = compiledNode(GetSpec(machine.spec), machine.node);
+	return cnode ? cnode.requires : null;
+    } catch (err) {
+	// Let crewProcess report the problem.
+	return null;
+    }
+}
+
+// indexMachine updates the crew's index for the given machine, which
+// might have been removed.
+function indexMachine(crew, mid) {
+    var index = crew.index;
+    if (!index) {
+	return;
+    }
+    var machine = crew.machines[mid];
+    // Get the keys first, since GetSpec can reindex this machine.
+    var keys = machine ? machineRequires(machine) : null;
+    var entry = index.entries[mid];
+    var resident = index.handle !== undefined;
+    if (entry) {
+	if (resident) {
+	    specUser(entry.spec, index.handle, mid, false);
+	}
+	if (entry.keys) {
+	    for (var i = 0; i < entry.keys.length; i++) {
+		delete index.byKey[entry.keys[i]][mid];
+	    }
+	} else {
+	    delete index.always[mid];
+	}
+    }
+    if (!machine) {
+	if (entry) {
+	    delete index.entries[mid];
+	    index.size--;
+	}
+	return;
+    }
+    if (!entry) {
+	index.size++;
+    }
+    index.entries[mid] = {
+	keys: keys,
+	spec: machine.spec,
+	installs: SpecInstalls[machine.spec],
+	// Preserves the order of the crew's machines.
+	seq: entry ? entry.seq : index.seq++
+    };
+    if (resident) {
+	specUser(machine.spec, index.handle, mid, true);
+    }
+    if (keys) {
+	for (var i = 0; i < keys.length; i++) {
+	    var k = keys[i];
+	    (index.byKey[k] || (index.byKey[k] = Object.create(null)))[mid] = true;
+	}
+    } else {
+	index.always[mid] = true;
+    }
+}
+
+// crewCandidates returns the set of the machines in the indexed crew
+// that the message might interest.
+function crewCandidates(crew, message) {
+    var index = crew.index;
+    var acc = Object.create(null);
+    for (var mid in index.always) {
+	acc[mid] = true;
+    }
+    for (var k in message) {
+	if (message[k] === undefined) {
+	    continue;
+	}
+	var mids = index.byKey[k];
+	for (var mid in mids) {
+	    acc[mid] = true;
+	}
+    }
+    return acc;
+}
+
+// crewOrder sorts machine ids in the order that 'for (mid in
+// crew.machines)' would visit them: array indexes first, then
+// insertion order.
+function crewOrder(crew, mids) {
+    var entries = crew.index.entries;
+    var arrayIndex = function(s) {
+	var n = Number(s);
+	return String(n >>> 0) === s && n !== 4294967295 ? n : -1;
+    };
+    return mids.sort(function(a, b) {
+	var x = arrayIndex(a), y = arrayIndex(b);
+	if (0 <= x || 0 <= y) {
+	    if (x < 0) {
+		return 1;
+	    }
+	    if (y < 0) {
+		return -1;
 	    }
+	    return x - y;
+	}
+	return entries[a].seq - entries[b].seq;
+    });
+}
+
+// crewProcess gives the message to the (parsed) crew and returns the
+// steppeds (without updating the crew).
+//
+// If Cfg.Steppeds is "changed", the steppeds only include machines
+// that changed or emitted something, and each stepped is in the
+// compact form that changedStepped returns.
+//
+// If 'shard' is given, the crew is a worker's shard of a crew (see
+// crew_split in machines.c).
+function crewProcess(crew, message, shard) {
+    var changedOnly = Cfg.Steppeds == "changed";
+    var candidates = null;
+
+    // Optionally direct the message to a single machine as
+    // specified in the message's (optional) "to" property.  For
+    // example, if the message has the form {"to":"m42",...}, then
+    // that message will be sent to machine m42 only.  Generalize
+    // to accept an array: "to":["m42","m43"].
+
+    var targets = message.to;
+    if (targets) {
+	// Routing to specific machine(s).
+	if (typeof targets == 'string') {
+	    targets = [targets];
+	}
+	if (!shard || shard.i == 0) {
 	    print("driver CrewProcess routing", JSON.stringify(targets));
+	}
+    } else if (crew.index && SpecCache.isEnabled()) {
+	// The machines that the message might interest will see it.
+	// Others stay put.
+	candidates = crewCandidates(crew, message);
+	targets = [];
+	if (changedOnly) {
+	    for (var mid in candidates) {
+		targets.push(mid);
+	    }
+	    crewOrder(crew, targets);
+	    Stats.CrewIndexPruned += crew.index.size - targets.length;
 	} else {
-	    // The entire crew will see this message.
-	    targets = [];
 	    for (var mid in crew.machines) {
 		targets.push(mid);
 	    }
 	}
+    } else {
+	// The entire crew will see this message.
+	targets = [];
+	for (var mid in crew.machines) {
+	    targets.push(mid);
+	}
+    }
+
+    var steppeds = {};
+    for (var i = 0; i < targets.length; i++) {
+	var mid = targets[i];
+	var machine = crew.machines[mid];
+	if (machine && candidates && !candidates[mid]) {
+	    // What walk would say for a machine that doesn't move.
+	    Stats.CrewIndexPruned++;
+	    steppeds[mid] = {
+		to: {node: machine.node, bs: machine.bs},
+		consumed: false,
+		emitted: []
+	    };
+	} else if (machine) {
+	    if (candidates) {
+		Stats.CrewIndexCandidates++;
+	    }
+	    var spec = GetSpec(machine.spec);
+	    
+	    var state = {
+		node: machine.node,
+		bs: machine.bs
+	    };
+	    
+	    Emit.mid = mid;
+	    var stepped = walk(Cfg, spec, state, message, Emit.enabled && Emit.emit);
+	    if (changedOnly) {
+		stepped = changedStepped(machine, stepped);
+		if (!stepped) {
+		    continue;
+		}
+	    }
+	    steppeds[mid] = stepped;
+	} // Otherwise just move on.
+    }
+
+    return steppeds;
+}
 
-	var steppeds = {};
-	for (var i = 0; i < targets.length; i++) {
-	    var mid = targets[i];
-	    var machine = crew.machines[mid];
-	    if (machine) {
-		var spec = GetSpec(machine.spec);
-		
-		var state = {
-		    node: machine.node,
-		    bs: machine.bs
-		};
-		
-		steppeds[mid] = walk(Cfg, spec, state, message);
-	    } // Otherwise just move on.
+// crewUpdate updates the (parsed) crew in place to reflect the given
+// steppeds, which can be full or compact (see changedStepped).
+//
+// Returns the ids of the machines that moved to a different node.
+function crewUpdate(crew, steppeds) {
+    var moved = [];
+    for (var mid in steppeds) {
+	var stepped = steppeds[mid];
+	var machine = crew.machines[mid];
+	if (stepped.to) {
+	    if (machine.node !== stepped.to.node) {
+		moved.push(mid);
+	    }
+	    machine.node = stepped.to.node;
+	    machine.bs = stepped.to.bs;
+	    continue;
+	}
+	var diff = stepped.diff;
+	if (!diff) {
+	    continue;
+	}
+	if (diff.node !== undefined) {
+	    moved.push(mid);
+	    machine.node = diff.node;
 	}
+	if (diff.set || diff.del) {
+	    // Don't modify bindings that something else might share.
+	    var bs = {};
+	    for (var k in machine.bs) {
+		bs[k] = machine.bs[k];
+	    }
+	    for (var k in diff.set) {
+		bs[k] = diff.set[k];
+	    }
+	    var del = diff.del || [];
+	    for (var i = 0; i < del.length; i++) {
+		delete bs[del[i]];
+	    }
+	    machine.bs = bs;
+	}
+    }
+    return moved;
+}
+
+function CrewProcess(crew_js, message_js, binary) {
+    Stats.CrewProcess++;
+
+    try {
 	
-	return JSON.stringify(steppeds);
+	var crew = decodeWire(crew_js, binary);
+	var message = decodeWire(message_js, binary);
+	
+	return encodeWire(crewProcess(crew, message), binary);
     } catch (err) {
 	print("driver CrewProcess error", err, JSON.stringify(err));
 	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
     }
 }
 
-function CrewUpdate(crew_js, steppeds_js) {
+// CrewProcessBatch processes the given messages (JSON strings or, if
+// binary, CBOR buffers), in order, with the crew, which is updated
+// after each message.  The crew is parsed and serialized once for the
+// whole batch.
+//
+// Returns {result: JSON, statuses: [...]}, where result is the
+// final crew and all emitted messages (in order), and statuses has
+// one MACH_* code per message.  A message that can't be processed
+// leaves the crew alone.
+function CrewProcessBatch(crew_js, messages, binary) {
+    try {
+	var crew = decodeWire(crew_js, binary);
+	if (!crew.machines) {
+	    crew.machines = {};
+	}
+	indexCrew(crew);
+	var emitted = [];
+	var statuses = [];
+	for (var i = 0; i < messages.length; i++) {
+	    Stats.CrewProcess++;
+	    try {
+		var message = decodeWire(messages[i], binary);
+		var steppeds = crewProcess(crew, message);
+	    } catch (err) {
+		print("driver CrewProcessBatch error", i, err, JSON.stringify(err));
+		statuses.push(1); // MACH_SAD
+		continue;
+	    }
+	    Stats.CrewUpdate++;
+	    var moved = crewUpdate(crew, steppeds);
+	    for (var j = 0; j < moved.length; j++) {
+		indexMachine(crew, moved[j]);
+	    }
+	    for (var mid in steppeds) {
+		var msgs = steppeds[mid].emitted || [];
+		for (var j = 0; j < msgs.length; j++) {
+		    emitted.push(msgs[j]);
+		}
+	    }
+	    statuses.push(0); // MACH_OKAY
+	}
+	return {
+	    result: encodeWire({crew: crew, emitted: emitted}, binary),
+	    statuses: statuses
+	};
+    } catch (err) {
+	print("driver CrewProcessBatch error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+// CrewProcessShard is CrewProcess for shard i of n of a crew, which
+// has only the machines in that shard (see crew_split in
+// machines.c).  A worker (see mach_set_workers) calls this function.
+// The steppeds are always JSON, since the C side merges the shards'
+// steppeds.
+function CrewProcessShard(crew_js, message_js, i, n, binary) {
+    Stats.CrewProcess++;
+
+    try {
+	var crew = decodeWire(crew_js, binary);
+	var message = decodeWire(message_js, binary);
+	
+	return JSON.stringify(crewProcess(crew, message, {i: i, n: n}));
+    } catch (err) {
+	print("driver CrewProcessShard error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+// ConfigScript returns ECMAScript that gives another runtime (a
+// worker's) this runtime's configuration.
+function ConfigScript() {
+    var cache = SpecCache.summary();
+    return "Cfg = " + JSON.stringify(Cfg) + ";" +
+	"SpecCache.setLimit(" + cache.limit + ");" +
+	"SpecCache.setByteLimit(" + cache.byteLimit + ");" +
+	"SpecCache.setTTL(" + cache.ttl + ");" +
+	"SpecCache." + (cache.enabled ? "enable" : "disable") + "();" +
+	"Times." + (Times.isEnabled() ? "enable" : "disable") + "();" +
+	"Emit.enabled = " + Emit.enabled + ";" +
+	"'';";
+}
+
+function CrewUpdate(crew_js, steppeds_js, binary) {
     Stats.CrewUpdate++;
     try {
 	
-	var crew = JSON.parse(crew_js);
-	var steppeds = JSON.parse(steppeds_js);
-	for (var mid in steppeds) {
-	    var stepped = steppeds[mid];
-	    crew.machines[mid].node = stepped.to.node;
-	    crew.machines[mid].bs = stepped.to.bs;
-	}
+	var crew = decodeWire(crew_js, binary);
+	var steppeds = decodeWire(steppeds_js, binary);
+	crewUpdate(crew, steppeds);
 	
-	return JSON.stringify(crew);
+	return encodeWire(crew, binary);
     } catch (err) {
 	print("driver CrewUpdate error", err, JSON.stringify(err));
 	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
     }
 }
 
+// Resident crews: Crews that stay parsed in the heap between calls.
+// Each one has a numeric handle.
+
+var Crews = {};
+var NextCrewHandle = 1;
+
+function residentCrew(h) {
+    var crew = Crews[h];
+    if (!crew) {
+	throw {error: "no crew", handle: h};
+    }
+    return crew;
+}
+
+// CrewOpen makes a resident crew from the given crew JSON and returns
+// its handle.
+function CrewOpen(crew_js, binary) {
+    try {
+	var crew = decodeWire(crew_js, binary);
+	if (!crew.machines) {
+	    crew.machines = {};
+	}
+	var h = NextCrewHandle++;
+	Crews[h] = crew;
+	indexCrew(crew, h);
+	return h;
+    } catch (err) {
+	print("driver CrewOpen error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+function CrewClose(h) {
+    unindexCrew(residentCrew(h));
+    delete Crews[h];
+}
+
+// CrewHandleProcess is CrewProcess followed by CrewUpdate for a
+// resident crew.  Returns the steppeds.
+function CrewHandleProcess(h, message_js, binary) {
+    Stats.CrewProcess++;
+    try {
+	var crew = residentCrew(h);
+	var message = decodeWire(message_js, binary);
+	var steppeds = crewProcess(crew, message);
+	var steppeds_js = encodeWire(steppeds, binary);
+	Stats.CrewUpdate++;
+	var moved = crewUpdate(crew, steppeds);
+	for (var i = 0; i < moved.length; i++) {
+	    indexMachine(crew, moved[i]);
+	}
+	return steppeds_js;
+    } catch (err) {
+	print("driver CrewHandleProcess error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+// CrewHandleUpdate applies steppeds (from some earlier processing of
+// the crew) to a resident crew.  Recovery from a log of steppeds uses
+// this function.
+function CrewHandleUpdate(h, steppeds_js, binary) {
+    Stats.CrewUpdate++;
+    try {
+	var crew = residentCrew(h);
+	var steppeds = decodeWire(steppeds_js, binary);
+	var moved = crewUpdate(crew, steppeds);
+	for (var i = 0; i < moved.length; i++) {
+	    indexMachine(crew, moved[i]);
+	}
+    } catch (err) {
+	print("driver CrewHandleUpdate error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+function CrewHandleSetMachine(h, id, specRef, bindings_js, nodeName) {
+    try {
+	var crew = residentCrew(h);
+	crew.machines[id] = {
+	    spec: specRef,
+	    node: nodeName,
+	    bs: JSON.parse(bindings_js)
+	};
+	indexMachine(crew, id);
+    } catch (err) {
+	print("driver CrewHandleSetMachine error", err, JSON.stringify(err));
+	throw JSON.stringify({err: err, errstr: JSON.stringify(err)});
+    }
+}
+
+function CrewHandleRemMachine(h, id) {
+    var crew = residentCrew(h);
+    delete crew.machines[id];
+    indexMachine(crew, id);
+}
+
+// CrewExport serializes a resident crew.
+function CrewExport(h, binary) {
+    return encodeWire(residentCrew(h), binary);
+}
+
+// CrewImport replaces a resident crew with the given crew JSON.
+function CrewImport(h, crew_js, binary) {
+    var old = residentCrew(h);
+    var crew = decodeWire(crew_js, binary);
+    if (!crew.machines) {
+	crew.machines = {};
+    }
+    unindexCrew(old);
+    Crews[h] = crew;
+    indexCrew(crew, h);
+}
+
 function GetEmitted(steppeds_js) {
     try {
 	
@@ -285,7 +1090,7 @@ function GetEmitted(steppeds_js) {
 	var emitted = [];
 	for (var mid in steppeds) {
 	    var stepped = steppeds[mid];
-	    var msgs = stepped.emitted;
+	    var msgs = stepped.emitted || [];
 	    for (var i = 0; i < msgs.length; i++) {
 		emitted.push(JSON.stringify(msgs[i]));
 	    }
@@ -0,0 +1,82 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Build tool that compiles ECMAScript (machines.js) to Duktape
+   bytecode, which mach_open loads instead of compiling the source.
+
+   Usage: dumpjs IN.js OUT.jsbc
+
+   The bytecode is only good for the Duktape version and configuration
+   that dumpjs was built with, so build dumpjs with the same
+   duktape.c as libmachines. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "duktape.h"
+
+/* compile compiles the source (at index 0) as a program and dumps
+   it. */
+static duk_ret_t compile(duk_context *ctx, void *udata) {
+  duk_push_string(ctx, "machines.js");
+  duk_compile(ctx, 0);
+  duk_dump_function(ctx);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s IN.js OUT.jsbc\n", argv[0]);
+    exit(1);
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    fprintf(stderr, "couldn't read '%s'\n", argv[1]);
+    exit(1);
+  }
+  fseek(in, 0, SEEK_END);
+  long length = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  char *src = malloc(length);
+  if (src == NULL || fread(src, 1, length, in) != length) {
+    fprintf(stderr, "couldn't read '%s'\n", argv[1]);
+    exit(1);
+  }
+  fclose(in);
+
+  /* Like mach_machines_js, ignore a terminating null. */
+  while (0 < length && src[length-1] == '\0') {
+    length--;
+  }
+
+  duk_context *ctx = duk_create_heap_default();
+  duk_push_lstring(ctx, src, length);
+  free(src);
+  if (duk_safe_call(ctx, compile, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "compile error %s\n", duk_safe_to_string(ctx, -1));
+    exit(1);
+  }
+
+  duk_size_t n;
+  void *bc = duk_get_buffer(ctx, -1, &n);
+
+  FILE *out = fopen(argv[2], "wb");
+  if (out == NULL || fwrite(bc, 1, n, out) != n || fclose(out) != 0) {
+    fprintf(stderr, "couldn't write '%s'\n", argv[2]);
+    exit(1);
+  }
+
+  duk_destroy_heap(ctx);
+  return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Usage: VARNAME INFILENAME OUTFILENAME
+#
+# Writes OUTFILE that is a C file that defines unsigned char*
+# VARNAME(), which returns the contents of INFILENAME, and unsigned
+# int VARNAME_len(), which returns its length.
+
+set -e
+
+VARNAME="$1"
+INFILENAME="$2"
+OUTFILENAME="$3"
+
+[ ! -e "$VARNAME" ] || (echo "File $VARNAME exists" >&2; exit 1)
+
+cp "$INFILENAME" "$VARNAME"bin
+xxd -i "$VARNAME"bin "$OUTFILENAME"
+rm "$VARNAME"bin
+
+echo "unsigned char* $VARNAME() { return $VARNAME"bin"; } " >> $OUTFILENAME
+echo "unsigned int $VARNAME"_len"() { return $VARNAME"bin_len"; } " >> $OUTFILENAME
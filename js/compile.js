@@ -0,0 +1,274 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Spec compilation: Work that only depends on a spec, done once
+// instead of on every step.
+//
+// The compiled form of a spec is the spec's non-enumerable 'compiled'
+// property, so it lives and dies with the spec (and therefore with
+// the spec's cache entry).
+
+// compileSpec attaches an empty compiled form to the given spec.  If
+// 'eager', every node is compiled now.  Otherwise nodes are compiled
+// the first time they are stepped.
+//
+// Call before sealing the spec.
+function compileSpec(spec, eager) {
+   if (!spec.compiled) {
+      Object.defineProperty(spec, "compiled", {value: {nodes: {}}});
+   }
+   if (eager && spec.nodes) {
+      for (var name in spec.nodes) {
+         compiledNode(spec, name);
+      }
+   }
+   return spec.compiled;
+}
+
+// compiledNode returns the compiled form of the named node:
+//
+//   {actions: [COMPILED], branches: [{pattern: PATTERN, guard: COMPILED}],
+//    dispatch: DISPATCH, requires: KEYS}
+//
+// where each COMPILED is what compileAction returned for the source
+// at that position, and each PATTERN is the branch's CompiledPattern
+// (or null if the branch has no pattern or its pattern didn't
+// parse).  DISPATCH is the node's dispatchIndex (or null), and KEYS
+// are the node's requiredKeys.
+//
+// Returns null if the spec has no compiled form and can't be given
+// one.
+function compiledNode(spec, name) {
+   var compiled = spec.compiled;
+   if (!compiled) {
+      if (Object.isSealed(spec)) {
+         return null;
+      }
+      compiled = compileSpec(spec);
+   }
+
+   var cnode = compiled.nodes[name];
+   if (cnode) {
+      return cnode;
+   }
+
+   var node = spec.nodes[name];
+   if (!node) {
+      return null;
+   }
+
+   cnode = {actions: [], branches: []};
+
+   var actions = node.actions;
+   if (!actions) {
+      actions = [node.action];
+   }
+   for (var i = 0; i < actions.length; i++) {
+      var action = actions[i];
+      if (action && action.interpreter) {
+         cnode.actions.push(compileAction(action.source));
+      } else {
+         cnode.actions.push(null);
+      }
+   }
+
+   var branching = node.branching;
+   var branches = (branching && branching.branches) || [];
+   for (var i = 0; i < branches.length; i++) {
+      var branch = branches[i];
+      var cbranch = {pattern: null, guard: null};
+      if (branch.pattern) {
+         try {
+            cbranch.pattern = compilePattern(branch.pattern,
+                                             spec.parsepatterns || spec.patternsyntax == "json");
+         } catch (e) {
+            // Leave it to step to report the bad pattern.
+         }
+      }
+      if (branch.guard) {
+         cbranch.guard = compileAction(branch.guard.source);
+      }
+      cnode.branches.push(cbranch);
+   }
+
+   cnode.dispatch = dispatchIndex(cnode.branches);
+   cnode.requires = requiredKeys(node, cnode);
+
+   compiled.nodes[name] = cnode;
+
+   return cnode;
+}
+
+// indexable reports whether the pattern P is an object pattern that
+// can be skipped without changing what step does, which isn't the
+// case if matching P could throw (more than one variable in an array
+// or in property names) or otherwise surprise.
+function indexable(p) {
+   var risky = function(p) {
+      if (Array.isArray(p)) {
+         var vars = 0;
+         for (var i = 0; i < p.length; i++) {
+            if ((typeof p[i] == 'string' && p[i].charAt(0) == '?' && 1 < ++vars) || risky(p[i])) {
+               return true;
+            }
+         }
+      } else if (p && typeof p == 'object') {
+         var vars = 0;
+         for (var k in p) {
+            if ((k.charAt(0) == '?' && 1 < ++vars) || risky(p[k])) {
+               return true;
+            }
+         }
+      }
+      return false;
+   };
+
+   // The matcher treats an object pattern with a 'length' of 0 (or
+   // "") as empty, so leave such patterns alone.
+   return p && typeof p == 'object' && !Array.isArray(p) && p.length === undefined && !risky(p);
+}
+
+// literalKeys returns the top-level properties of the pattern P that
+// have literal string values, which a message must have (with the
+// same value) to match P.
+//
+// Returns null if P isn't indexable.
+function literalKeys(p) {
+   if (!indexable(p)) {
+      return null;
+   }
+   var acc = {};
+   for (var k in p) {
+      var v = p[k];
+      if (k.charAt(0) != '?' && typeof v == 'string' && v.charAt(0) != '?') {
+         acc[k] = v;
+      }
+   }
+   return acc;
+}
+
+// requiredKeys returns message properties such that a message can
+// only match one of the node's branches if it has at least one of
+// them.  An empty array means no message can move a machine at the
+// node.
+//
+// Returns null if any message might.
+function requiredKeys(node, cnode) {
+   if (node.action || (node.actions && 0 < node.actions.length)) {
+      return null;
+   }
+   var branching = node.branching;
+   if (!branching || !branching.branches) {
+      return [];
+   }
+   if (branching.type != "message") {
+      return null;
+   }
+   var acc = [];
+   for (var i = 0; i < cnode.branches.length; i++) {
+      var cp = cnode.branches[i].pattern;
+      if (!cp || !indexable(cp.pattern)) {
+         return null;
+      }
+      // Any property that isn't a variable and whose value isn't an
+      // optional variable.  (The matcher checks for 'undefined', so
+      // properties that every object inherits don't count.)
+      var key = null;
+      for (var k in cp.pattern) {
+         var v = cp.pattern[k];
+         if (k.charAt(0) != '?' && !(k in Object.prototype) &&
+             !(typeof v == 'string' && v.substring(0,2) == '??')) {
+            key = k;
+            break;
+         }
+      }
+      if (key === null) {
+         return null;
+      }
+      if (acc.indexOf(key) < 0) {
+         acc.push(key);
+      }
+   }
+   return acc;
+}
+
+// dispatchIndex builds an index of the given compiled branches on
+// the literal value of a single top-level property:
+//
+//   {key: KEY, values: {VALUE: [I]}, rest: [I]}
+//
+// where 'rest' are the indexes of the branches that don't require a
+// literal value for KEY, and each 'values' entry lists (in order) the
+// branches that could match a message with that value, which is
+// that value's branches merged with 'rest'.  KEY is the property
+// that the most branches require.
+//
+// Only string values are indexed because the matcher compares
+// literals with '=='.
+//
+// Returns null if fewer than two branches would be indexed.
+function dispatchIndex(cbranches) {
+   var literals = [];
+   var counts = {};
+   var key = null;
+   for (var i = 0; i < cbranches.length; i++) {
+      var cp = cbranches[i].pattern;
+      var ks = cp ? literalKeys(cp.pattern) : null;
+      literals.push(ks);
+      for (var k in ks) {
+         counts[k] = (counts[k] || 0) + 1;
+         if (key === null || counts[key] < counts[k]) {
+            key = k;
+         }
+      }
+   }
+   if (key === null || counts[key] < 2) {
+      return null;
+   }
+
+   var index = {key: key, values: Object.create(null), rest: []};
+   for (var i = 0; i < cbranches.length; i++) {
+      var ks = literals[i];
+      if (ks && ks[key] !== undefined) {
+         var v = ks[key];
+         if (!index.values[v]) {
+            index.values[v] = index.rest.slice();
+         }
+         index.values[v].push(i);
+      } else {
+         index.rest.push(i);
+         for (var v in index.values) {
+            index.values[v].push(i);
+         }
+      }
+   }
+
+   return index;
+}
+
+// candidateBranches returns the indexes (in order) of the branches
+// of the compiled node that could match the given message (or
+// bindings).  Returns null if every branch is a candidate.
+function candidateBranches(cnode, against) {
+   var index = cnode.dispatch;
+   if (!index || !against || typeof against != 'object') {
+      return null;
+   }
+   var v = against[index.key];
+   if (v === undefined) {
+      return index.rest;
+   }
+   if (typeof v != 'string') {
+      return null;
+   }
+   return index.values[v] || index.rest;
+}
@@ -14,8 +14,73 @@
 //
 // Status: Frequently compiles.
 
+// classifyVar returns the classification of the pattern variable V:
+//
+//   {opt: BOOL, anon: BOOL, ieq: OP, base: VAR}
+//
+// where OP is one of "<=", ">=", "!=", ">", "<" (or null), and VAR
+// is the variable that V binds ("?<=n" binds "?n").
+function classifyVar(v) {
+   var info = {opt: v.substring(0,2) == "??", anon: v === "?", ieq: null, base: v};
+   var ieqs = ["<=",">=","!=",">","<"];
+   for (var i = 0; i < ieqs.length; i++) {
+      var ieq = ieqs[i];
+      if (v.substring(1, 1+ieq.length) == ieq) {
+         info.ieq = ieq;
+         info.base = "?" + v.substring(1+ieq.length);
+         break;
+      }
+   }
+   return info;
+}
+
+// CompiledPattern is a pattern along with the classifications (see
+// classifyVar) of all of its variables.  The matchers accept one
+// anywhere they accept a pattern.
+//
+// 'ieqs' has the classifications of just the inequality variables
+// (or is null if there aren't any), which is all that nativeMatch
+// needs.
+function CompiledPattern(pattern) {
+   this.pattern = pattern;
+   this.vars = {};
+   this.ieqs = null;
+   this.classify(pattern);
+}
+
+CompiledPattern.prototype.classify = function(p) {
+   if (typeof p == 'string') {
+      if (p.charAt(0) == '?' && !this.vars[p]) {
+         var info = classifyVar(p);
+         this.vars[p] = info;
+         if (info.ieq) {
+            (this.ieqs || (this.ieqs = {}))[p] = info;
+         }
+      }
+   } else if (Array.isArray(p)) {
+      for (var i = 0; i < p.length; i++) {
+         this.classify(p[i]);
+      }
+   } else if (p && typeof p == 'object') {
+      for (var k in p) {
+         this.classify(k);
+         this.classify(p[k]);
+      }
+   }
+};
+
+// compilePattern returns a CompiledPattern for P, which is first
+// parsed as JSON if 'parse' is true.
+function compilePattern(p, parse) {
+   if (parse) {
+      p = JSON.parse(p);
+   }
+   return new CompiledPattern(p);
+}
+
 // function(CTX,P,M,BS), where CTX is an unused context, P is a
-// pattern, M is a message, and BS are input bindings.
+// pattern (or a CompiledPattern), M is a message, and BS are input
+// bindings.
 //
 // Returns null or a set of sets of bindings.
 var match = function() {
@@ -25,7 +90,7 @@ var match = function() {
    };
 
    var isOptVar = function(s) {
-      return typeof s == 'string' && s.substring(0,2) == '??';
+      return isVar(s) && varInfo(s).opt;
    };
 
    var copyMap = function(m) {
@@ -36,17 +101,53 @@ var match = function() {
       return acc;
    };
 
-   var copyArray = function(xs) {
-      return xs.slice();
-   }
+   // The variable classifications of the compiled pattern being
+   // matched (if any).
+   var vars = null;
 
-   var isAnonymous = function(s) {
-      return s === "?";
-   }
+   var varInfo = function(v) {
+      return (vars && vars[v]) || classifyVar(v);
+   };
+
+   // Sets of bindings share structure: extend returns a Frame that
+   // adds one binding to its parent (another Frame or the original
+   // bindings).  The public matcher flattens the sets it returns.
+   var Frame = function(parent, key, value) {
+      this.parent = parent;
+      this.key = key;
+      this.value = value;
+   };
+
+   // How many objects and arrays the current match has allocated.
+   var allocs = 0;
 
    var extend = function(bs, b, v) {
+      allocs++;
+      return new Frame(bs, b, v);
+   };
+
+   var lookup = function(bs, k) {
+      for (; bs instanceof Frame; bs = bs.parent) {
+         if (bs.key === k) {
+            return bs.value;
+         }
+      }
+      return bs[k];
+   };
+
+   var flatten = function(bs) {
+      if (!(bs instanceof Frame)) {
+         return bs;
+      }
+      var frames = [];
+      for (; bs instanceof Frame; bs = bs.parent) {
+         frames.push(bs);
+      }
       var acc = copyMap(bs);
-      acc[b] = v;
+      for (var i = frames.length - 1; 0 <= i; i--) {
+         acc[frames[i].key] = frames[i].value;
+      }
+      allocs++;
       return acc;
    };
 
@@ -54,18 +155,26 @@ var match = function() {
 
    var matchWithBindings = function(ctx, bss, v, mv) {
       var acc = [];
+      allocs++;
       for (var i = 0; i < bss.length; i++) {
-         var bs = bss[i];
-         acc = acc.concat(match(ctx, v, mv, bs));
+         var bss_ = match(ctx, v, mv, bss[i]);
+         for (var j = 0; j < bss_.length; j++) {
+            acc.push(bss_[j]);
+         }
       }
       return acc;
    };
 
-   var arraycatMatch = function(ctx, bss, p, m, varCount) {
-      if (varCount === undefined) {
-         varCount = 0;
-      }
-
+   // arraycatMatch matches the array pattern p against the array m.
+   // Both are treated as sets: Each element of p has to match a
+   // different element of m (except that an optional variable can
+   // match nothing).
+   //
+   // Instead of copying m for every candidate element, the search
+   // marks the elements of m that earlier pattern elements matched.
+   // A literal string element of p only considers the elements of m
+   // that could be equal to it (see literalCandidates).
+   var arraycatMatch = function(ctx, bss, p, m) {
       // The pattern should be an array.
       if (!Array.isArray(p)) {
          throw "internal error: pattern " + JSON.stringify(p) + " isn't an array";
@@ -75,13 +184,63 @@ var match = function() {
          return [];
       }
 
-      if (p.length == 0) {
+      var used = [];
+      allocs++;
+      return arraycat(ctx, bss, p, 0, m, used, literalCandidates(p, m), 0);
+   };
+
+   // literalCandidates returns an array that has, for each literal
+   // string in p, the (ordered) indexes of the elements of m that
+   // could equal that string, which are the elements that are that
+   // string or that aren't strings at all ('==' at work).  Other
+   // positions are undefined, meaning every element is a candidate.
+   var literalCandidates = function(p, m) {
+      var cands = [];
+      var index = null;
+      for (var k = 0; k < p.length; k++) {
+         var y = p[k];
+         if (typeof y != 'string' || isVar(y)) {
+            continue;
+         }
+         if (!index) {
+            // Positions of each string in m, and the positions of
+            // everything else.
+            index = {strings: Object.create(null), others: []};
+            for (var j = 0; j < m.length; j++) {
+               var x = m[j];
+               if (typeof x == 'string') {
+                  (index.strings[x] || (index.strings[x] = [])).push(j);
+               } else {
+                  index.others.push(j);
+               }
+            }
+            allocs++;
+         }
+         var js = index.strings[y] || [];
+         var os = index.others;
+         var acc = [];
+         for (var a = 0, b = 0; a < js.length || b < os.length; ) {
+            if (b == os.length || (a < js.length && js[a] < os[b])) {
+               acc.push(js[a++]);
+            } else {
+               acc.push(os[b++]);
+            }
+         }
+         cands[k] = acc;
+         allocs++;
+      }
+      return cands;
+   };
+
+   // arraycat matches p starting at position pi against the elements
+   // of m that aren't used.
+   var arraycat = function(ctx, bss, p, pi, m, used, cands, varCount) {
+      if (p.length <= pi) {
          // An empty pattern array matches any array.
          return bss;
       }
 
-      // Recursive implementation
-      var y = p[0];
+      var y = p[pi];
       if (isVar(y)) {
          if (0 < varCount) {
             throw "can't have more than one variable in array";
@@ -90,21 +249,36 @@ var match = function() {
       }
 
       var acc = []; // Accumulate sets of output bindings.
+      allocs++;
       for (var i = 0; i < bss.length; i++) {
          var bs = bss[i];
+         // The rest of the pattern.  (That's p.slice(i+1), which
+         // isn't what you'd expect when there are several sets of
+         // bindings, but that's how this matcher has always
+         // worked.)
+         var pi_ = pi + i + 1;
+         // Skipping an element of m skips the check for a second
+         // variable that the rest of the pattern would make, so
+         // only skip when that check wouldn't throw.
+         var js = cands[pi];
+         if (js && 0 < varCount && isVar(p[pi_])) {
+            js = null;
+         }
          // How many ways can we match y? An array is a *set*, not
          // a list.
          var some = false;
-         for (var j = 0; j < m.length; j++) {
-            var x = m[j];
-            var bss_ = match(ctx, y, x, bs);
-            // Filter bindings based on remaining pattern and the
-            // message with the current element removed.  This
-            // approach is probably not optimal, but it's easier
-            // to understand.
-            var p_ = p.slice(i+1);
-            var m_ = copyArray(m); m_.splice(j,1);
-            bss_ = arraycatMatch(ctx, bss_, p_, m_, varCount);
+         var n = js ? js.length : m.length;
+         for (var c = 0; c < n; c++) {
+            var j = js ? js[c] : c;
+            if (used[j]) {
+               continue;
+            }
+            var bss_ = match(ctx, y, m[j], bs);
+            // Filter bindings based on the rest of the pattern and
+            // the message without the current element.
+            used[j] = true;
+            bss_ = arraycat(ctx, bss_, p, pi_, m, used, cands, varCount);
+            used[j] = false;
             for (var k = 0; k < bss_.length; k++) {
                acc.push(bss_[k]);
                some = true;
@@ -128,17 +302,17 @@ var match = function() {
             }
             varCount++;
             var acc = [];
+            allocs++;
             for (var mk in m) {
                var mv = m[mk];
-               var ext = matchWithBindings(ctx, copyArray(bss), k, mk);
+               var ext = matchWithBindings(ctx, bss, k, mk);
                if (ext.length == 0) {
                   continue;
                }
                ext = matchWithBindings(ctx, ext, v, mv);
-               if (ext.length == 0) {
-                  continue;
+               for (var i = 0; i < ext.length; i++) {
+                  acc.push(ext[i]);
                }
-               acc = acc.concat(ext); 
             }
             bss = acc;
          } else {
@@ -163,7 +337,7 @@ var match = function() {
       if (!isVar(v)) {
          return {applied: false};
       }
-      var x = bs[v];
+      var x = lookup(bs, v);
       if (x === undefined) {
          return {applied: false};
       }
@@ -174,17 +348,8 @@ var match = function() {
          return {applied: false};
       }
 
-      var ieq, vv;
-      var ieqs = ["<=",">=","!=",">","<"];
-      for (var i = 0; i < ieqs.length; i++) {
-         ieq = ieqs[i];
-         if (v.substring(1, 1+ieq.length) == ieq) {
-            vv = "?" + v.substring(1+ieq.length);
-            break;
-         } else {
-            ieq = null;
-         }
-      }
+      var info = varInfo(v);
+      var ieq = info.ieq, vv = info.base;
       if (!ieq) {
          return {applied: false};
       }
@@ -214,7 +379,7 @@ var match = function() {
          return {applied: true, bss: []};
       }
 
-      var vvx = bs[vv];
+      var vvx = lookup(bs, vv);
       if (vvx !== undefined) {
          if ((typeof vvx) !== 'number') {
             return {applied: false};
@@ -225,9 +390,7 @@ var match = function() {
          return {applied: true, bss: [bs]};
       }
 
-      bs[vv] = m;
-
-      return {applied: true, bss: [bs]};
+      return {applied: true, bss: [extend(bs, vv, m)]};
    };
 
    match = function(ctx,p,m,bs) {
@@ -235,14 +398,14 @@ var match = function() {
          bs = [];
       }
       if (isVar(p)) {
-         if (isAnonymous(p)) {
+         if (varInfo(p).anon) {
             return [bs];
          }
          var ieq = inequal(ctx, m, bs, p);
          if (ieq.applied) {
             return ieq.bss;
          }
-         var binding = bs[p];
+         var binding = lookup(bs, p);
          if (binding) {
             return match(ctx, binding, m, bs);
          } else {
@@ -281,11 +444,55 @@ var match = function() {
 
    return function(ctx,p,m,bs) {
       Times.tick("match");
+      var outer = vars;
       try {
-         return match(ctx,p,m,bs);
+         vars = null;
+         if (p instanceof CompiledPattern) {
+            vars = p.vars;
+            p = p.pattern;
+         }
+         allocs = 0;
+         var bss = match(ctx,p,m,bs);
+         for (var i = 0; i < bss.length; i++) {
+            bss[i] = flatten(bss[i]);
+         }
+         Times.count("match", "allocs", allocs);
+         return bss;
       } finally {
+         vars = outer;
          Times.tock("match");
       }
    };
 }();
 
+// jsMatch is the ECMAScript matcher above.  If 'nativeMatch' (a port
+// of this code to C in 'match.c') is available, then 'match' uses
+// that instead.
+var jsMatch = match;
+
+if (typeof nativeMatch !== 'undefined') {
+   match = function() {
+      // nativeMatch reports its allocations here when we're timing.
+      var counts = {allocs: 0};
+
+      return function(ctx,p,m,bs) {
+         Times.tick("match");
+         try {
+            var ieqs = undefined;
+            if (p instanceof CompiledPattern) {
+               ieqs = p.ieqs;
+               p = p.pattern;
+            }
+            if (!Times.isEnabled()) {
+               return nativeMatch(ctx,p,m,bs,ieqs);
+            }
+            var bss = nativeMatch(ctx,p,m,bs,ieqs,counts);
+            Times.count("match", "allocs", counts.allocs);
+            return bss;
+         } finally {
+            Times.tock("match");
+         }
+      };
+   }();
+}
+
@@ -22,6 +22,9 @@ var Times = function() {
 	disable: function() {
 	    enabled = false;
 	},
+	isEnabled: function() {
+	    return enabled;
+	},
 	tick: function(what) {
 	    if (!enabled) return;
 	    clocks[what] = new Date().getTime();
@@ -37,6 +40,16 @@ var Times = function() {
 	    entry.ms += elapsed;
 	    entry.n++;
 	},
+	// count adds n to the named counter of the entry for 'what'.
+	count: function(what, counter, n) {
+	    if (!enabled) return;
+	    var entry = totals[what];
+	    if (!entry) {
+		entry = {ms: 0, n: 0};
+		totals[what] = entry;
+	    }
+	    entry[counter] = (entry[counter] || 0) + n;
+	},
 	summary: function() {
 	    return totals;
 	},
@@ -10,11 +10,52 @@
  * limitations under the License.
  */
 
+// actionWrapper returns the source for a function that runs the
+// given action (or guard) source against the bindings that are passed
+// to it.
+//
+// That function returns {bs: BS, emitted: MESSAGES}.
+function actionWrapper(src) {
+   return "function(bindings) {\n" +
+      "var emitting = [];\n" + 
+      "var env = {\n" + 
+      "  bindings: bindings,\n" +
+      "  target: function(x) { console.log(x); },\n" + 
+      "  out: function(x) { emitting.push(x); }\n" + 
+      "};\n" + 
+      "var bs = (function(_) {\n" + src + "\n})(env);\n" +
+      "return {bs: bs, emitted: emitting};\n" +
+      "}";
+}
+
+// compileAction compiles the given action (or guard) source to
+// bytecode via the (presumably primitive) 'sandboxCompile' function.
+//
+// Returns {code: BYTECODE}, {error: ERR} if the source didn't
+// compile, or null if there's no 'sandboxCompile'.
+function compileAction(src) {
+   if (typeof sandboxCompile === 'undefined') {
+      return null;
+   }
+   Times.tick("compile");
+   try {
+      return {code: sandboxCompile(actionWrapper(src))};
+   } catch (e) {
+      print("walk action compile error", e);
+      return {error: e};
+   } finally {
+      Times.tock("compile");
+   }
+}
+
 // sandboxedAction wishes to be a function that can evaluate
 // ECMAScript source in a fresh, pristine, sandboxed environment.
 //
+// If 'compiled' (from compileAction) is given, its bytecode is run
+// instead of 'src'.
+//
 // Returns {bs: BS, emitted: MESSAGES}.
-function sandboxedAction(ctx, bs, src) {
+function sandboxedAction(ctx, bs, src, compiled) {
    // This function calls a (presumably primitive) 'sandbox' function
    // to do the actual work.  That function is probably in
    // 'machines.c'.
@@ -26,6 +67,50 @@ function sandboxedAction(ctx, bs, src) {
       bs = {};
    }
 
+   try {
+      if (compiled && compiled.error) {
+         throw compiled.error;
+      }
+
+      if (compiled) {
+         // The bindings and the result are copied between heaps
+         // directly.
+         return sandboxRun(compiled.code, bs);
+      }
+
+      var result_js = sandbox(sandboxSource(src, bs));
+      try {
+         return JSON.parse(result_js);
+      } catch (e) {
+         throw e + " on result parsing of '" + result_js + "'";
+      }
+   } catch (e) {
+      print("walk action sandbox error", e);
+      // Make a binding for the error so that branches could deal
+      // with the error.
+      //
+      // ToDo: Do not overwrite?
+      //
+      // ToDo: Implement the spec switch that enabled
+      // branching-based action error-handling.
+      //
+      // The given bindings can be the machine's own (when a
+      // pattern bound nothing), which a changed stepped is diffed
+      // against, so add the binding to a copy.
+      var acc = {};
+      for (var p in bs) {
+         acc[p] = bs[p];
+      }
+      acc.error = e;
+      return {bs: acc, error: e};
+   } finally {
+      Times.tock("sandbox");
+   }
+}
+
+// sandboxSource returns the code that the 'sandbox' function
+// evaluates when the action hasn't been compiled.
+function sandboxSource(src, bs) {
    var bs_js = JSON.stringify(bs);
 
    var code = "\n" +
@@ -50,26 +135,5 @@ function sandboxedAction(ctx, bs, src) {
          "}();\n";
    }
 
-   try {
-      var result_js = sandbox(code);
-      try {
-         return JSON.parse(result_js);
-      } catch (e) {
-         throw e + " on result parsing of '" + result_js + "'";
-      }
-   } catch (e) {
-      print("walk action sandbox error", e);
-      // Make a binding for the error so that branches could deal
-      // with the error.
-      //
-      // ToDo: Do not overwrite?
-      //
-      // ToDo: Implement the spec switch that enabled
-      // branching-based action error-handling.
-      bs.error = e;
-      return {bs: bs, error: e};
-   } finally {
-      Times.tock("sandbox");
-   }
+   return code;
 }
-
@@ -34,6 +34,7 @@ function step(ctx,spec,state,message) {
       if (!node) {
          throw {error: "node not found", node: state.node};
       }
+      var cnode = compiledNode(spec, state.node);
 
       //
       // Actions
@@ -50,7 +51,7 @@ function step(ctx,spec,state,message) {
                if (interpreterAliases.indexOf(action.interpreter) < 0) {
                   throw {error: "bad interpreter", interpreter: action.interpreter};
                }
-               var evaled = sandboxedAction(ctx, bs, action.source);
+               var evaled = sandboxedAction(ctx, bs, action.source, cnode && cnode.actions[i]);
                bs = evaled.bs;
                emitted = evaled.emitted;
             } else if(action.type == 'log') {
@@ -77,11 +78,18 @@ function step(ctx,spec,state,message) {
          against = message;
       }
       var branches = branching.branches;
-      for (var i = 0; i < branches.length; i++) {
+      // Only try the branches that the node's dispatch index says
+      // could match.
+      var candidates = cnode && candidateBranches(cnode, against);
+      var n = candidates ? candidates.length : branches.length;
+      for (var c = 0; c < n; c++) {
+         var i = candidates ? candidates[c] : c;
          var branch = branches[i];
          var pattern = branch.pattern;
          if (pattern) {
-            if (spec.parsepatterns || spec.patternsyntax == "json") {
+            if (cnode && cnode.branches[i].pattern) {
+               pattern = cnode.branches[i].pattern;
+            } else if (spec.parsepatterns || spec.patternsyntax == "json") {
                pattern = JSON.parse(pattern);
             }
             var bss = match(ctx, pattern, against, bs);
@@ -100,7 +108,7 @@ function step(ctx,spec,state,message) {
             if (interpreterAliases.indexOf(branch.guard.interpreter) < 0) {
                throw {error: "bad guard interpreter", interpreter: branch.guard.interpreter};
             }
-            var evaled = sandboxedAction(ctx, bs, branch.guard.source);
+            var evaled = sandboxedAction(ctx, bs, branch.guard.source, cnode && cnode.branches[i].guard);
             if (!evaled.bs) {
                continue;
             }
@@ -121,7 +129,10 @@ function step(ctx,spec,state,message) {
 // Returns {to: STATE, consumed: BOOL, emitted: MESSAGES}.
 //
 // For an description of the returned value, see doc for 'step'.
-function walk(ctx,spec,state,message) {
+//
+// If given, 'emit' is called with each emitted message as soon as
+// the step that emitted it is done.
+function walk(ctx,spec,state,message,emit) {
 
    var maxSteps = 32;
    if (ctx && ctx.MaxSteps) {
@@ -171,6 +182,11 @@ function walk(ctx,spec,state,message) {
       if (stepped && 0 < stepped.emitted.length) {
          // Accumulated emitted messages.
          emitted = emitted.concat(stepped.emitted);
+         if (emit) {
+            for (var j = 0; j < stepped.emitted.length; j++) {
+               emit(stepped.emitted[j]);
+            }
+         }
       }
    }
 
@@ -10,8 +10,11 @@
  * limitations under the License.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <duk_print_alert.h>
 #if OSX
 #include <sys/errno.h>
@@ -21,32 +24,89 @@
 #include <errno.h>
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <dirent.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 #include "duktape.h"
 #include "duk_module_duktape.h"
 #include "register.h"
 #include "machines.h"
 #include "machines_js.h"
+#include "match.h"
+
+/* MACH_SANDBOX_MAX_USES is the number of actions a pooled sandbox
+   heap will run before it's retired, which bounds whatever garbage
+   an action might manage to leave behind. */
+#define MACH_SANDBOX_MAX_USES (1024)
+
+/* SandboxHeap is a sandbox heap and the number of times it has been
+   used. */
+typedef struct {
+   duk_context *dctx;
+   unsigned int uses;
+} SandboxHeap;
+
+/* SandboxPool holds idle, pre-initialized sandbox heaps so that
+   actions and guards don't each pay for a new Duktape heap. */
+typedef struct {
+   SandboxHeap idle[MACH_MAX_SANDBOX_POOL_SIZE];
+   int count;
+   int size;
+   unsigned long calls;
+   unsigned long created;
+   unsigned long reused;
+   unsigned long retired;
+} SandboxPool;
 
 typedef struct {
    duk_context *dctx;
    mach_provider provider;
+   /* vprovider, if set, is used instead of provider. */
+   mach_versioned_provider vprovider;
    mach_mode provider_mode;
    void *provider_ctx;
    void *func_handle;
+   SandboxPool pool;
+   struct WorkerPool *workers;
+   mach_emit_handler emit_handler;
+   void *emit_arg;
+   /* no_bytecode makes ctx_open compile the driver's source even if
+      there's bytecode. */
+   int no_bytecode;
+   /* format is the MACH_FORMAT_* of the mach_buf functions' crews,
+      states, messages, and steppeds. */
+   int format;
 } Ctx;
 
 /* ctx is a global, shared context object. */
 static Ctx *ctx = NULL;
 
+/* heap_ctx returns the Ctx that owns the given heap, which is the
+   heap's user data (see ctx_open).  Functions that ECMAScript calls
+   use it instead of the global ctx. */
+static Ctx *heap_ctx(duk_context *d) {
+   duk_memory_functions funcs;
+   duk_get_memory_functions(d, &funcs);
+   return (Ctx *)funcs.udata;
+}
+
 static int register_c_funcs(Ctx *ctx);
+static int ctx_open(Ctx *c);
+static void ctx_close(Ctx *c);
+static int ctx_eval(Ctx *c, char *src, JSON dst, int limit);
+static void workers_stop(Ctx *c);
+static int workers_eval(Ctx *c, char *src);
+static void workers_set_provider(Ctx *c);
+static int workers_invalidate(Ctx *c, S name);
+static int workers_crew_process(Ctx *c, const mach_buf *crew, const mach_buf *message, mach_buf *dst, int binary);
 
 void *mach_make_ctx() {
    void *ret = malloc(sizeof(Ctx));
 
    memset(ret, 0, sizeof(Ctx));
+   ((Ctx *)ret)->pool.size = MACH_DEFAULT_SANDBOX_POOL_SIZE;
 
    return ret;
 }
@@ -59,31 +119,108 @@ void *mach_get_ctx() {
    return ctx;
 }
 
+void machx_dump_stack(void *cx, FILE *out, char *tag) {
+   Ctx *c = cx;
+   duk_push_context_dump(c->dctx);
+   fprintf(out, "stack_dump %s\n%s\n", tag, duk_safe_to_string(c->dctx, -1));
+   duk_pop(c->dctx);
+}
+
 void mach_dump_stack(FILE *out, char *tag) {
-   duk_push_context_dump(ctx->dctx);
-   fprintf(out, "stack_dump %s\n%s\n", tag, duk_safe_to_string(ctx->dctx, -1));
-   duk_pop(ctx->dctx);
+   machx_dump_stack(ctx, out, tag);
 }
 
 
+void machx_set_spec_provider(void *cx, void *pctx, mach_provider f, mach_mode m) {
+   Ctx *c = cx;
+   c->provider_ctx = pctx;
+   c->provider = f;
+   c->vprovider = NULL;
+   c->provider_mode = m;
+   workers_set_provider(c);
+}
+
 void mach_set_spec_provider(void *pctx, mach_provider f, mach_mode m) {
-   ctx->provider_ctx = pctx;
-   ctx->provider = f;
-   ctx->provider_mode = m;
+   machx_set_spec_provider(ctx, pctx, f, m);
+}
+
+void machx_set_versioned_spec_provider(void *cx, void *pctx, mach_versioned_provider f, mach_mode m) {
+   Ctx *c = cx;
+   c->provider_ctx = pctx;
+   c->provider = NULL;
+   c->vprovider = f;
+   c->provider_mode = m;
+   workers_set_provider(c);
+}
+
+void mach_set_versioned_spec_provider(void *pctx, mach_versioned_provider f, mach_mode m) {
+   machx_set_versioned_spec_provider(ctx, pctx, f, m);
+}
+
+int machx_set_emit_handler(void *cx, void *arg, mach_emit_handler f) {
+   Ctx *c = cx;
+   char out[16];
+   char *src = f ? "Emit.enabled = true; ''" : "Emit.enabled = false; ''";
+   c->emit_handler = f;
+   c->emit_arg = arg;
+   /* Workers keep what their heaps emit for workers_crew_process to
+      pass to the handler. */
+   if (ctx_eval(c, src, out, sizeof(out)) != MACH_OKAY) {
+      return MACH_SAD;
+   }
+   return workers_eval(c, src);
+}
+
+int mach_set_emit_handler(void *arg, mach_emit_handler f) {
+   return machx_set_emit_handler(ctx, arg, f);
+}
+
+/* emitter is a bridge function that is exposed in the ECMAScript
+   environment as the value of 'emitNative'.  Calls the context's emit
+   handler (if any) with the machine id and the emitted message. */
+static duk_ret_t emitter(duk_context *dctx) {
+   Ctx *c = heap_ctx(dctx);
+   if (c->emit_handler) {
+      duk_size_t n;
+      const char *mid = duk_safe_to_string(dctx, 0);
+      const char *message = duk_get_lstring(dctx, 1, &n);
+      if (message != NULL) {
+         c->emit_handler(c->emit_arg, mid, message, n);
+      }
+   }
+   return 0;
 }
 
 /* providerer is a bridge function that is exposed in the ECMAScript
    environment as the value of 'provider'.  When ECMAScript code calls
    'provider', the C function that's stored at _provider is
-   invoked. */
+   invoked.  A versioned provider's result is returned as {js:JS,
+   version:VERSION}. */
 static duk_ret_t providerer(duk_context *dctx) {
+   Ctx *c = heap_ctx(dctx);
    const char *name = duk_to_string(dctx, 0);
    const char *cached = duk_to_string(dctx, 1);
+   const char *result;
    /* printf("bridge provider %s\n", s); */
-   const char *result = ctx->provider(ctx->provider_ctx, name, cached);
-   duk_push_string(dctx, result);
 
-   if (result != NULL && ctx->provider_mode & MACH_FREE_FOR_PROVIDER) {
+   if (c->vprovider != NULL) {
+      const char *version = duk_get_string(dctx, 2);
+      char *new_version = NULL;
+      result = c->vprovider(c->provider_ctx, name, version, &new_version);
+      duk_push_object(dctx);
+      duk_push_string(dctx, result);
+      duk_put_prop_string(dctx, -2, "js");
+      duk_push_string(dctx, new_version);
+      duk_put_prop_string(dctx, -2, "version");
+      if (new_version != NULL && c->provider_mode & MACH_FREE_FOR_PROVIDER) {
+         free(new_version);
+      }
+   } else {
+      result = c->provider(c->provider_ctx, name, cached);
+      duk_push_string(dctx, result);
+   }
+
+   if (result != NULL && c->provider_mode & MACH_FREE_FOR_PROVIDER) {
       free((char *)result);
    }
 
@@ -117,48 +254,481 @@ int copystr(char *dst, int limit, char *src) {
    }
 }
 
+int mach_buf_reserve(mach_buf *b, size_t n) {
+   if (n < b->cap) {
+      return MACH_OKAY;
+   }
+   size_t cap = b->cap < 256 ? 256 : b->cap;
+   while (cap <= n) {
+      cap *= 2;
+   }
+   char *data = realloc(b->data, cap);
+   if (data == NULL) {
+      return MACH_SAD;
+   }
+   b->data = data;
+   b->cap = cap;
+   return MACH_OKAY;
+}
+
+int mach_buf_set(mach_buf *b, const char *s, size_t n) {
+   if (mach_buf_reserve(b, n) != MACH_OKAY) {
+      return MACH_SAD;
+   }
+   memcpy(b->data, s, n);
+   b->data[n] = '\0';
+   b->len = n;
+   return MACH_OKAY;
+}
+
+void mach_buf_free(mach_buf *b) {
+   free(b->data);
+   b->data = NULL;
+   b->len = 0;
+   b->cap = 0;
+}
+
+/* sandbox_init_js prepares a sandbox heap for the pool.  It records
+   everything reachable from the global object (JSON, Math, Object,
+   print, ..., their prototypes and methods, and objects like
+   Duktape.Pointer.prototype): each object's prototype, whether it's
+   extensible, and its own properties and writable values.  Those
+   properties are made unconfigurable but otherwise left alone, so an
+   action can reassign built-ins and give its own objects a toString
+   as it could in a brand new heap, but it can't delete a built-in or
+   turn one into an accessor.  The function that's returned deletes
+   what an action added to those objects and puts back what it
+   changed.  That function is the heap's reset.  It throws if it
+   can't undo something (a property the action made unconfigurable or
+   read-only, or an object it made inextensible), in which case the
+   heap is retired. */
+static const char *sandbox_init_js =
+   "(function(g) {\n"
+   "  var gopn = Object.getOwnPropertyNames, gops = Object.getOwnPropertySymbols;\n"
+   "  var gopd = Object.getOwnPropertyDescriptor;\n"
+   "  var define = Object.defineProperty, create = Object.create;\n"
+   "  var protoOf = Object.getPrototypeOf, setProto = Object.setPrototypeOf;\n"
+   "  var extensible = Object.isExtensible;\n"
+   "  var objs = [], protos = [], exts = [], have = [], names = [], values = [];\n"
+   "  var todo = [g, Object.prototype];\n"
+   "  var i, j, k, x, d, ps;\n"
+   "  while (todo.length) {\n"
+   "    x = todo.pop();\n"
+   "    if (!x || (typeof x != 'object' && typeof x != 'function')) continue;\n"
+   "    for (j = 0; j < objs.length && objs[j] !== x; j++);\n"
+   "    if (j < objs.length) continue;\n"
+   "    k = objs.length;\n"
+   "    objs.push(x);\n"
+   "    protos.push(protoOf(x));\n"
+   "    exts.push(extensible(x));\n"
+   "    have.push(create(null));\n"
+   "    names.push([]);\n"
+   "    values.push([]);\n"
+   "    todo.push(protoOf(x));\n"
+   "    ps = gops ? gopn(x).concat(gops(x)) : gopn(x);\n"
+   "    for (i = 0; i < ps.length; i++) {\n"
+   "      d = gopd(x, ps[i]);\n"
+   "      todo.push(d.value, d.get, d.set);\n"
+   "      have[k][ps[i]] = true;\n"
+   "      if (d.writable) {\n"
+   "        names[k].push(ps[i]);\n"
+   "        values[k].push(d.value);\n"
+   "      }\n"
+   "      if (d.configurable) {\n"
+   "        d.configurable = false;\n"
+   "        define(x, ps[i], d);\n"
+   "      }\n"
+   "    }\n"
+   "  }\n"
+   "  // The reset only calls what it saved here, since an action could\n"
+   "  // have replaced Object.getOwnPropertyNames and the like.\n"
+   "  return function() {\n"
+   "    'use strict';\n"
+   "    for (k = 0; k < objs.length; k++) {\n"
+   "      x = objs[k];\n"
+   "      if (protoOf(x) !== protos[k]) setProto(x, protos[k]);\n"
+   "      if (exts[k] && !extensible(x)) throw new Error('built-in made inextensible');\n"
+   "      ps = gopn(x);\n"
+   "      for (i = 0; i < ps.length; i++) {\n"
+   "        if (!have[k][ps[i]]) delete x[ps[i]];\n"
+   "      }\n"
+   "      ps = gops ? gops(x) : [];\n"
+   "      for (i = 0; i < ps.length; i++) {\n"
+   "        if (!have[k][ps[i]]) delete x[ps[i]];\n"
+   "      }\n"
+   "      ps = names[k];\n"
+   "      for (i = 0; i < ps.length; i++) {\n"
+   "        x[ps[i]] = values[k][i];\n"
+   "      }\n"
+   "    }\n"
+   "  };\n"
+   "})(this)";
+
+/* sandbox_acquire returns an idle heap from the pool or a new one.
+   When the pool is disabled, the new heap is pristine. */
+static SandboxHeap sandbox_acquire(Ctx *c) {
+   SandboxPool *pool = &c->pool;
+   SandboxHeap box;
+
+   pool->calls++;
+   if (0 < pool->count) {
+      pool->reused++;
+      return pool->idle[--pool->count];
+   }
+
+   box.uses = 0;
+   box.dctx = duk_create_heap_default();
+   pool->created++;
+   if (0 < pool->size) {
+      if (duk_peval_string(box.dctx, sandbox_init_js) == DUK_EXEC_SUCCESS) {
+         duk_push_heap_stash(box.dctx);
+         duk_swap_top(box.dctx, -2);
+         duk_put_prop_string(box.dctx, -2, "reset");
+      } else {
+         fprintf(stderr, "warning: sandbox init error %s\n", duk_safe_to_string(box.dctx, -1));
+      }
+      duk_set_top(box.dctx, 0);
+   }
+
+   return box;
+}
+
+/* sandbox_release resets the given heap and returns it to the pool.
+   The heap is destroyed instead if the pool is full, if the heap is
+   worn out, or if the reset didn't work. */
+static void sandbox_release(Ctx *c, SandboxHeap box) {
+   SandboxPool *pool = &c->pool;
+   int keep = pool->count < pool->size && ++box.uses < MACH_SANDBOX_MAX_USES;
+
+   duk_set_top(box.dctx, 0);
+   if (keep) {
+      duk_push_heap_stash(box.dctx);
+      keep = duk_get_prop_string(box.dctx, -1, "reset") &&
+         duk_pcall(box.dctx, 0) == DUK_EXEC_SUCCESS;
+      duk_set_top(box.dctx, 0);
+   }
+
+   if (keep) {
+      pool->idle[pool->count++] = box;
+   } else {
+      duk_destroy_heap(box.dctx);
+      pool->retired++;
+   }
+}
+
+/* sandbox_drain destroys all idle sandbox heaps. */
+static void sandbox_drain(Ctx *c) {
+   SandboxPool *pool = &c->pool;
+   while (0 < pool->count) {
+      duk_destroy_heap(pool->idle[--pool->count].dctx);
+      pool->retired++;
+   }
+}
+
 /* sandbox is a minimal EMCAscript evaluation sandbox in an empty
    environment.  The given source code better return a string.  Needs
    a little work ...
 
    Like various explicit/known limits and ...
 
+   The heap comes from the context's sandbox pool.  Between uses, a
+   pooled heap's globals and built-ins are reset.
+
    Also see https://github.com/svaarala/duktape/blob/master/doc/sandboxing.rst
 */
 
-static duk_ret_t sandbox(duk_context *ctx) {
-   const char *src = duk_to_string(ctx, 0);
+static duk_ret_t sandbox(duk_context *dctx) {
+   const char *src = duk_to_string(dctx, 0);
+   Ctx *c = heap_ctx(dctx);
 
-   duk_context *box = duk_create_heap_default();
-   duk_push_string(box, src);
+   SandboxHeap box = sandbox_acquire(c);
+   duk_push_string(box.dctx, src);
 
-   duk_ret_t rc = duk_peval(box);
+   duk_ret_t rc = duk_peval(box.dctx);
    /* If we ran into an error, it's on the stack. */
-   const char *result = duk_safe_to_string(box, -1);
-   result = strdup(result);
+   const char *result = duk_safe_to_string(box.dctx, -1);
    if (rc != DUK_EXEC_SUCCESS) {
       fprintf(stderr, "warning: sandbox returned non-zero rc=%d result=%s code:\n%s\n", rc, result, src);
    }
 
-   duk_destroy_heap(box);
-   duk_push_string(ctx, result);
-   free((char *)result); /* result was interned! */
+   /* The result string belongs to the sandbox heap, so copy it before
+      that heap goes anywhere. */
+   duk_push_string(dctx, result);
+   sandbox_release(c, box);
 
    return 1; /* If non-zero, caller will see 'undefined'. */
 }
 
+/* sandboxCompile compiles the given function expression in a sandbox
+   heap and returns that function's bytecode (as a buffer) for
+   sandboxRun.  Throws the error string if the source doesn't
+   compile. */
+static duk_ret_t sandboxCompile(duk_context *dctx) {
+   duk_size_t n;
+   const char *src = duk_to_lstring(dctx, 0, &n);
+   Ctx *c = heap_ctx(dctx);
+
+   SandboxHeap box = sandbox_acquire(c);
+   if (duk_pcompile_lstring(box.dctx, DUK_COMPILE_FUNCTION, src, n) != DUK_EXEC_SUCCESS) {
+      duk_push_string(dctx, duk_safe_to_string(box.dctx, -1));
+      sandbox_release(c, box);
+      return duk_throw(dctx);
+   }
 
-/* API: mach_open, which is an exposed library function, creates the
-   duktape heap, sets the binding for 'router' function, and maybe
-   does some other initialization. */
-int mach_open() {
-   static const size_t dst_limit = 16 * 1024;
-   char *dst, *src;
-   int rc;
+   duk_dump_function(box.dctx);
+   void *code = duk_get_buffer_data(box.dctx, -1, &n);
+   memcpy(duk_push_fixed_buffer(dctx, n), code, n);
+   sandbox_release(c, box);
+
+   return 1;
+}
+
+/* MACH_COPY_MAX_DEPTH limits the nesting of values that are copied
+   between heaps.  Deeper values (including cyclic ones) are errors,
+   just like they are for JSON.stringify. */
+#define MACH_COPY_MAX_DEPTH (1000)
+
+/* copy_value pushes onto 'to' a copy of the value at 'idx' in 'from'.
+   The copy follows JSON.stringify semantics: toJSON is honored,
+   non-finite numbers become null, and functions and undefined
+   values are dropped from objects (and become null in arrays).  At
+   the top level, such values are copied as undefined.
+
+   Reading 'from' can throw (toJSON and getters can, for example), so
+   'from' must be running the current duk_safe_call, and errors are
+   thrown there.  Otherwise an error would unwind past whatever the
+   other heap was doing.  Pushes onto 'to' can only fail for lack of
+   memory. */
+static void copy_value(duk_context *from, duk_idx_t idx, duk_context *to, int depth) {
+   idx = duk_require_normalize_index(from, idx);
+   if (MACH_COPY_MAX_DEPTH < depth) {
+      duk_error(from, DUK_ERR_RANGE_ERROR, "value too deep (or cyclic)");
+   }
+   if (!duk_check_stack(from, 4) || !duk_check_stack(to, 4)) {
+      duk_error(from, DUK_ERR_RANGE_ERROR, "value stack exhausted");
+   }
+
+   switch (duk_get_type(from, idx)) {
+   case DUK_TYPE_NULL:
+      duk_push_null(to);
+      return;
+   case DUK_TYPE_BOOLEAN:
+      duk_push_boolean(to, duk_get_boolean(from, idx));
+      return;
+   case DUK_TYPE_NUMBER: {
+      duk_double_t x = duk_get_number(from, idx);
+      if (x != x || x - x != 0) {
+         duk_push_null(to);
+      } else {
+         duk_push_number(to, x);
+      }
+      return;
+   }
+   case DUK_TYPE_STRING: {
+      duk_size_t n;
+      const char *str = duk_get_lstring(from, idx, &n);
+      duk_push_lstring(to, str, n);
+      return;
+   }
+   case DUK_TYPE_OBJECT:
+      if (duk_is_function(from, idx)) {
+         break;
+      }
+      if (duk_get_prop_string(from, idx, "toJSON") && duk_is_function(from, -1)) {
+         duk_dup(from, idx);
+         duk_push_string(from, "");
+         duk_call_method(from, 1);
+         copy_value(from, -1, to, depth + 1);
+         duk_pop(from);
+         return;
+      }
+      duk_pop(from);
+
+      if (duk_is_array(from, idx)) {
+         duk_size_t i, n = duk_get_length(from, idx);
+         duk_idx_t acc = duk_push_array(to);
+         for (i = 0; i < n; i++) {
+            duk_get_prop_index(from, idx, (duk_uarridx_t)i);
+            copy_value(from, -1, to, depth + 1);
+            if (duk_is_undefined(to, -1)) {
+               duk_pop(to);
+               duk_push_null(to);
+            }
+            duk_put_prop_index(to, acc, (duk_uarridx_t)i);
+            duk_pop(from);
+         }
+         return;
+      }
+
+      duk_idx_t acc = duk_push_object(to);
+      duk_enum(from, idx, DUK_ENUM_OWN_PROPERTIES_ONLY);
+      while (duk_next(from, -1, 1)) {
+         copy_value(from, -1, to, depth + 1);
+         if (duk_is_undefined(to, -1)) {
+            duk_pop(to);
+         } else {
+            duk_size_t n;
+            const char *key = duk_get_lstring(from, -2, &n);
+            duk_push_lstring(to, key, n);
+            duk_insert(to, -2);
+            /* Define rather than put so that a key like "__proto__"
+               is just data (as it would be with JSON.parse). */
+            duk_def_prop(to, acc, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+         }
+         duk_pop_2(from);
+      }
+      duk_pop(from);
+      return;
+   default:
+      break;
+   }
+
+   /* undefined, functions, buffers, and pointers */
+   duk_push_undefined(to);
+}
+
+/* copy_in copies the bindings (at index 'bs' in the calling heap) to
+   the sandbox heap.  Run via duk_safe_call on the calling heap, so
+   that errors reading the bindings stay in that heap. */
+typedef struct {
+   duk_context *box;
+   duk_idx_t bs;
+} CopyIn;
+
+static duk_ret_t copy_in(duk_context *dctx, void *udata) {
+   CopyIn *ci = (CopyIn *)udata;
+   copy_value(dctx, ci->bs, ci->box, 0);
+   return 0;
+}
+
+/* sandbox_run loads the bytecode, calls the function with the
+   bindings, and copies the result back to the calling heap.  Run via
+   duk_safe_call, so that errors (including bad bytecode) stay in the
+   sandbox.
+
+   Stack: [ code bs ] -> [ ] with the result pushed onto the calling
+   heap. */
+static duk_ret_t sandbox_run(duk_context *box, void *udata) {
+   duk_context *dctx = (duk_context *)udata;
+   duk_swap(box, 0, 1);
+   duk_load_function(box);
+   duk_swap(box, 0, 1);
+   duk_call(box, 1);
+   copy_value(box, -1, dctx, 0);
+   return 0;
+}
+
+/* sandboxRun calls the bytecode from sandboxCompile with the given
+   bindings in a sandbox heap.  The bindings and the function's result
+   are copied directly between the heaps (see copy_value) rather than
+   going through JSON.  Throws the error string if the call
+   failed. */
+static duk_ret_t sandboxRun(duk_context *dctx) {
+   duk_size_t n;
+   void *code = duk_require_buffer_data(dctx, 0, &n);
+   duk_idx_t top = duk_get_top(dctx);
+   Ctx *c = heap_ctx(dctx);
+   const char *err = NULL;
+
+   SandboxHeap box = sandbox_acquire(c);
+   /* The bytecode stays put (in our heap) during the call, so the
+      sandbox can just borrow it. */
+   duk_push_external_buffer(box.dctx);
+   duk_config_buffer(box.dctx, -1, code, n);
+
+   CopyIn ci = { box.dctx, 1 };
+   duk_int_t rc = duk_safe_call(dctx, copy_in, &ci, 0, 1);
+   if (rc != DUK_EXEC_SUCCESS) {
+      /* The error is on our stack. */
+      err = duk_safe_to_string(dctx, -1);
+   } else {
+      duk_pop(dctx);
+      rc = duk_safe_call(box.dctx, sandbox_run, dctx, 2, 1);
+      if (rc != DUK_EXEC_SUCCESS) {
+         duk_push_string(dctx, duk_safe_to_string(box.dctx, -1));
+         err = duk_get_string(dctx, -1);
+      }
+   }
+   if (rc != DUK_EXEC_SUCCESS) {
+      fprintf(stderr, "warning: sandbox returned non-zero rc=%d result=%s\n", rc, err);
+      duk_push_string(dctx, err);
+      duk_replace(dctx, top);
+      duk_set_top(dctx, top + 1);
+   }
+   sandbox_release(c, box);
+
+   if (rc != DUK_EXEC_SUCCESS) {
+      return duk_throw(dctx);
+   }
+   return 1;
+}
 
-   if (ctx == NULL) {
+/* API: mach_set_sandbox_pool_size sets the number of idle sandbox
+   heaps that are kept for reuse.  Zero disables the pool. */
+int machx_set_sandbox_pool_size(void *cx, int n) {
+   Ctx *c = cx;
+   if (n < 0 || MACH_MAX_SANDBOX_POOL_SIZE < n) {
       return MACH_SAD;
    }
+   c->pool.size = n;
+   while (n < c->pool.count) {
+      duk_destroy_heap(c->pool.idle[--c->pool.count].dctx);
+      c->pool.retired++;
+   }
+   return MACH_OKAY;
+}
+
+int mach_set_sandbox_pool_size(int n) {
+   return machx_set_sandbox_pool_size(ctx, n);
+}
+
+/* API: mach_sandbox_pool_stats writes the sandbox pool statistics as
+   JSON to dst. */
+int machx_sandbox_pool_stats(void *cx, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   SandboxPool *pool = &c->pool;
+   int n = snprintf(dst, limit,
+                    "{\"size\":%d,\"idle\":%d,\"calls\":%lu,\"created\":%lu,\"reused\":%lu,\"retired\":%lu}",
+                    pool->size, pool->count, pool->calls, pool->created, pool->reused, pool->retired);
+   if (limit <= n) {
+      return MACH_TOO_BIG;
+   }
+   return MACH_OKAY;
+}
+
+int mach_sandbox_pool_stats(JSON dst, size_t limit) {
+   return machx_sandbox_pool_stats(ctx, dst, limit);
+}
+
+
+/* load_bytecode loads and runs the driver's bytecode (see
+   dumpjs.c), which saves compiling the driver's source. */
+static duk_ret_t load_bytecode(duk_context *dctx, void *udata) {
+   duk_size_t n = mach_machines_jsbc_len();
+   void *bc = duk_push_fixed_buffer(dctx, n);
+   memcpy(bc, mach_machines_jsbc(), n);
+   duk_load_function(dctx);
+   duk_call(dctx, 0);
+   return 1;
+}
+
+int machx_set_bytecode(void *cx, int enable) {
+   Ctx *c = cx;
+   c->no_bytecode = !enable;
+   return MACH_OKAY;
+}
+
+int mach_set_bytecode(int enable) {
+   return machx_set_bytecode(ctx, enable);
+}
+
+/* ctx_open creates the given context's heap (with the context as the
+   heap's user data), sets the bindings for the C functions that
+   ECMAScript calls, and evaluates the driver. */
+static int ctx_open(Ctx *c) {
+   static const size_t dst_limit = 16 * 1024;
+   char *dst, *src;
+   int rc;
 
    //
    //
@@ -176,13 +746,13 @@ int mach_open() {
       return MACH_SAD;
    }
 
-   if (ctx->dctx) {
-      mach_close();
+   if (c->dctx) {
+      ctx_close(c);
    }
 
-   ctx->dctx = duk_create_heap_default();
+   c->dctx = duk_create_heap(NULL, NULL, NULL, c, NULL);
 
-   duk_print_alert_init(ctx->dctx, 0);
+   duk_print_alert_init(c->dctx, 0);
 
    //
    //
@@ -190,66 +760,127 @@ int mach_open() {
    //
    //
    // push util c functions into js vm
-   duk_push_c_function(ctx->dctx, providerer, 2);
-   duk_put_global_string(ctx->dctx, "provider");
+   duk_push_c_function(c->dctx, providerer, 3);
+   duk_put_global_string(c->dctx, "provider");
+
+   duk_push_c_function(c->dctx, sandbox, 1);
+   duk_put_global_string(c->dctx, "sandbox");
 
-   duk_push_c_function(ctx->dctx, sandbox, 1);
-   duk_put_global_string(ctx->dctx, "sandbox");
+   duk_push_c_function(c->dctx, sandboxCompile, 1);
+   duk_put_global_string(c->dctx, "sandboxCompile");
+
+   duk_push_c_function(c->dctx, sandboxRun, 2);
+   duk_put_global_string(c->dctx, "sandboxRun");
+
+   duk_push_c_function(c->dctx, mach_native_match, 6);
+   duk_put_global_string(c->dctx, "nativeMatch");
+
+   duk_push_c_function(c->dctx, emitter, 2);
+   duk_put_global_string(c->dctx, "emitNative");
 
    //
    //
    // Register otherexported C methods
    //
    //
-   register_c_funcs(ctx);
+   register_c_funcs(c);
 
    // Enable module loading support (require)
-   duk_module_duktape_init(ctx->dctx);
+   duk_module_duktape_init(c->dctx);
 
    // eval default js libraries
    //printf("eval default js libraries\n");
-   rc = mach_eval(src, dst, (int)dst_limit);
+   rc = MACH_SAD;
+   if (!c->no_bytecode && 0 < mach_machines_jsbc_len()) {
+      if (duk_safe_call(c->dctx, load_bytecode, NULL, 0, 1) == DUK_EXEC_SUCCESS) {
+         rc = MACH_OKAY;
+      } else {
+         fprintf(stderr, "bytecode error %s (using source)\n", duk_safe_to_string(c->dctx, -1));
+      }
+      duk_pop(c->dctx);
+   }
+   if (rc != MACH_OKAY) {
+      rc = ctx_eval(c, src, dst, (int)dst_limit);
+   }
    free(dst);
 
    if (rc != MACH_OKAY) {
-      mach_close();
+      ctx_close(c);
    }
 
    return rc;
 }
 
-/* API: mach_close, which is an exposed library function, releases the
-   ECMAScript heap. */
-void mach_close() {
-   if (ctx && ctx->dctx) {
-      duk_destroy_heap(ctx->dctx);
-      ctx->dctx = NULL;
+/* ctx_close releases the given context's heaps. */
+static void ctx_close(Ctx *c) {
+   sandbox_drain(c);
+   if (c->dctx) {
+      duk_destroy_heap(c->dctx);
+      c->dctx = NULL;
    }
-   if (ctx && ctx->func_handle) {
-      dlclose(ctx->func_handle);
-      ctx->func_handle = NULL;
+   if (c->func_handle) {
+      dlclose(c->func_handle);
+      c->func_handle = NULL;
    }
 }
 
-/* API: mach_eval, which is an exposed library function, evaluates the
-   given string as ECMAScript in the global duktape heap. */
-int mach_eval(char *src, JSON dst, int limit) {
-   int rc = duk_peval_string(ctx->dctx, src);
+/* ctx_eval evaluates the given string as ECMAScript in the given
+   context's heap. */
+static int ctx_eval(Ctx *c, char *src, JSON dst, int limit) {
+   int rc = duk_peval_string(c->dctx, src);
    if (rc != 0) {
-      const char *err = duk_safe_to_string(ctx->dctx, -1);
+      const char *err = duk_safe_to_string(c->dctx, -1);
       fprintf(stderr, "mach_eval error %s\n", err);
       return MACH_SAD;
    }
-   rc = copystr(dst, limit, (char *)duk_get_string(ctx->dctx, -1));
-   duk_pop(ctx->dctx);
+   rc = copystr(dst, limit, (char *)duk_get_string(c->dctx, -1));
+   duk_pop(c->dctx);
    return MACH_OKAY;
 }
 
-/* Utility function: Like printf except calls eval and does not return
-   a result. */
-int evalf(char *fmt, ...) {
-   va_list args;
-   va_start(args, fmt);
+/* API: mach_open, which is an exposed library function, creates the
+   duktape heap, sets the binding for 'router' function, and maybe
+   does some other initialization. */
+int machx_open(void *cx) {
+   Ctx *c = cx;
+   if (c == NULL) {
+      return MACH_SAD;
+   }
+   return ctx_open(c);
+}
+
+int mach_open() {
+   return machx_open(ctx);
+}
+
+/* API: mach_close, which is an exposed library function, releases the
+   ECMAScript heap. */
+void machx_close(void *cx) {
+   Ctx *c = cx;
+   if (c) {
+      workers_stop(c);
+      ctx_close(c);
+   }
+}
+
+void mach_close() {
+   machx_close(ctx);
+}
+
+/* API: mach_eval, which is an exposed library function, evaluates the
+   given string as ECMAScript in the context's duktape heap. */
+int machx_eval(void *cx, char *src, JSON dst, int limit) {
+   Ctx *c = cx;
+   return ctx_eval(c, src, dst, limit);
+}
+
+int mach_eval(char *src, JSON dst, int limit) {
+   return machx_eval(ctx, src, dst, limit);
+}
+
+/* ctx_vevalf evaluates the formatted string in the given context and
+   its workers. */
+static int ctx_vevalf(Ctx *c, char *fmt, va_list args) {
    size_t buf_limit = 16 * 1024;
    char *buf = (char *)malloc(buf_limit);
    JSON dst = (char *)malloc(buf_limit);
@@ -257,24 +888,26 @@ int evalf(char *fmt, ...) {
    int wrote = vsnprintf(buf, buf_limit, fmt, args);
    if (buf_limit <= wrote) {
       free(buf);
+      free(dst);
       return MACH_TOO_BIG;
    }
 #if 0
-   int rc = duk_peval_string(ctx->dctx, buf);
-   va_end(args);
+   int rc = duk_peval_string(c->dctx, buf);
    free(buf);
 
    if (rc != 0) {
-      const char *err = duk_safe_to_string(ctx->dctx, -1);
+      const char *err = duk_safe_to_string(c->dctx, -1);
       fprintf(stderr, "evalf error %s\n", err);
       rc = MACH_SAD;
    } else {
       rc = MACH_OKAY;
    }
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
 #else
-   int rc = mach_eval(buf, dst, buf_limit);
-   va_end(args);
+   int rc = ctx_eval(c, buf, dst, buf_limit);
+   if (rc == MACH_OKAY) {
+      rc = workers_eval(c, buf);
+   }
    free(buf);
    free(dst); // discard output
 #endif
@@ -282,66 +915,149 @@ int evalf(char *fmt, ...) {
    return rc;
 }
 
+/* ctx_evalf is evalf for the given context. */
+static int ctx_evalf(Ctx *c, char *fmt, ...) {
+   va_list args;
+   va_start(args, fmt);
+   int rc = ctx_vevalf(c, fmt, args);
+   va_end(args);
+   return rc;
+}
+
+/* Utility function: Like printf except calls eval and does not return
+   a result. */
+int evalf(char *fmt, ...) {
+   va_list args;
+   va_start(args, fmt);
+   int rc = ctx_vevalf(ctx, fmt, args);
+   va_end(args);
+   return rc;
+}
+
 /* API: mach_process, which is an exposed library function, calls the
    ECMAScript function bound to Process.  Returns NULL. */
-int mach_process(JSON state, JSON message, JSON dst, int limit) {
+int machx_process(void *cx, JSON state, JSON message, JSON dst, int limit) {
+   Ctx *c = cx;
    JSON result;
-   duk_get_global_string(ctx->dctx, "Process");
-   duk_push_string(ctx->dctx, state);
-   duk_push_string(ctx->dctx, message);
-   if (duk_pcall(ctx->dctx, 2) == DUK_EXEC_SUCCESS) {
-      result = (JSON)duk_get_string(ctx->dctx, -1);
+   duk_get_global_string(c->dctx, "Process");
+   duk_push_string(c->dctx, state);
+   duk_push_string(c->dctx, message);
+   if (duk_pcall(c->dctx, 2) == DUK_EXEC_SUCCESS) {
+      result = (JSON)duk_get_string(c->dctx, -1);
       /* printf("mach_process result: %s\n", result); */
    } else {
-      result = (JSON)duk_safe_to_string(ctx->dctx, -1);
+      result = (JSON)duk_safe_to_string(c->dctx, -1);
       fprintf(stderr, "mach_process error: %s\n", result);
    }
    int rc = copystr(dst, limit, result);
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
    return rc;
 }
 
+int mach_process(JSON state, JSON message, JSON dst, int limit) {
+   return machx_process(ctx, state, message, dst, limit);
+}
+
 /* API: mach_match, which is an exposed library utility function, calls the
    ECMAScript function bound to Match.  Returns NULL. */
-int mach_match(JSON pattern, JSON message, JSON bindings, JSON dst, int limit) {
+int machx_match(void *cx, JSON pattern, JSON message, JSON bindings, JSON dst, int limit) {
+   Ctx *c = cx;
    JSON result;
-   duk_get_global_string(ctx->dctx, "Match");
-   duk_push_object(ctx->dctx); // Another "ctx" ...
-   duk_push_string(ctx->dctx, pattern);
-   duk_push_string(ctx->dctx, message);
-   duk_push_string(ctx->dctx, bindings);
-   if (duk_pcall(ctx->dctx, 4) == DUK_EXEC_SUCCESS) {
-      result = (JSON)duk_get_string(ctx->dctx, -1);
+   duk_get_global_string(c->dctx, "Match");
+   duk_push_object(c->dctx); // Another "ctx" ...
+   duk_push_string(c->dctx, pattern);
+   duk_push_string(c->dctx, message);
+   duk_push_string(c->dctx, bindings);
+   if (duk_pcall(c->dctx, 4) == DUK_EXEC_SUCCESS) {
+      result = (JSON)duk_get_string(c->dctx, -1);
       /* printf("mach_match result: %s\n", result); */
    } else {
-      result = (JSON)duk_safe_to_string(ctx->dctx, -1);
+      result = (JSON)duk_safe_to_string(c->dctx, -1);
       fprintf(stderr, "mach_match error: %s\n", result);
    }
    int rc = copystr(dst, limit, result);
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
    return rc;
 }
 
+int mach_match(JSON pattern, JSON message, JSON bindings, JSON dst, int limit) {
+   return machx_match(ctx, pattern, message, bindings, dst, limit);
+}
+
 /* API: mach_set_spec_cache_limit sets the spec cache limit.  This
    function does NOT enable the cache if it is not already enabled.
 
    The default limit is 'DefaultSpecCacheLimit' in 'driver.js'. */
+int machx_set_spec_cache_limit(void *cx, int limit) {
+   Ctx *c = cx;
+   return ctx_evalf(c, "SpecCache.setLimit(%d)", limit);
+}
+
 int mach_set_spec_cache_limit(int limit) {
-   return evalf("SpecCache.setLimit(%d)", limit);
+   return machx_set_spec_cache_limit(ctx, limit);
 }
 
-int mach_enable_spec_cache(int enable) {
+int machx_set_steppeds_mode(void *cx, int mode) {
+   Ctx *c = cx;
+   switch (mode) {
+   case MACH_STEPPEDS_FULL:
+      return ctx_evalf(c, "Cfg.Steppeds = 'full'");
+   case MACH_STEPPEDS_CHANGED:
+      return ctx_evalf(c, "Cfg.Steppeds = 'changed'");
+   default:
+      return MACH_SAD;
+   }
+}
+
+int mach_set_steppeds_mode(int mode) {
+   return machx_set_steppeds_mode(ctx, mode);
+}
+
+int machx_enable_spec_cache(void *cx, int enable) {
+   Ctx *c = cx;
    if (enable) {
-      return evalf("SpecCache.enable()");
+      return ctx_evalf(c, "SpecCache.enable()");
    } else {
-      return evalf("SpecCache.disable()");
+      return ctx_evalf(c, "SpecCache.disable()");
    }
 }
 
+int mach_enable_spec_cache(int enable) {
+   return machx_enable_spec_cache(ctx, enable);
+}
+
 /* API: mach_clear_spec_cache empties the cache (and resets cache
    statistics). */
+int machx_clear_spec_cache(void *cx) {
+   Ctx *c = cx;
+   return ctx_evalf(c, "SpecCache.clear()");
+}
+
 int mach_clear_spec_cache() {
-   return evalf("SpecCache.clear()");
+   return machx_clear_spec_cache(ctx);
+}
+
+/* API: mach_set_spec_cache_bytes sets the spec cache's byte limit
+   (zero for none). */
+int machx_set_spec_cache_bytes(void *cx, size_t bytes) {
+   Ctx *c = cx;
+   return ctx_evalf(c, "SpecCache.setByteLimit(%lu)", (unsigned long)bytes);
+}
+
+int mach_set_spec_cache_bytes(size_t bytes) {
+   return machx_set_spec_cache_bytes(ctx, bytes);
+}
+
+/* API: mach_set_spec_ttl sets how long (in milliseconds) a cached
+   spec is used before the provider is asked about it again.  Zero
+   means until it's invalidated. */
+int machx_set_spec_ttl(void *cx, int ms) {
+   Ctx *c = cx;
+   return ctx_evalf(c, "SpecCache.setTTL(%d)", ms);
+}
+
+int mach_set_spec_ttl(int ms) {
+   return machx_set_spec_ttl(ctx, ms);
 }
 
 int mach_make_crew(S id, JSON dst, size_t limit) {
@@ -353,67 +1069,96 @@ int mach_make_crew(S id, JSON dst, size_t limit) {
    return MACH_OKAY;
 }
 
-int getResult(int nargs, JSON dst, size_t limit) {
+int getResult(Ctx *c, int nargs, JSON dst, size_t limit) {
    const char *result;
-   if (duk_pcall(ctx->dctx, nargs) == DUK_EXEC_SUCCESS) {
-      result = duk_get_string(ctx->dctx, -1);
+   if (duk_pcall(c->dctx, nargs) == DUK_EXEC_SUCCESS) {
+      result = duk_get_string(c->dctx, -1);
       /* printf("result %s\n", result); */
    } else {
-      result = duk_safe_to_string(ctx->dctx, -1);
+      result = duk_safe_to_string(c->dctx, -1);
       printf("getResult serror %s\n", result);
    }
+   duk_size_t n = 0;
    if (result == NULL) {
       result = "";
+   } else {
+      duk_get_lstring(c->dctx, -1, &n);
    }
-   int n = strlen(result);
    int rc = MACH_OKAY;
-   if (limit < n) {
+   if (limit <= n) {
       rc = MACH_TOO_BIG;
    } else {
-      strncpy(dst, result, limit);
+      memcpy(dst, result, n + 1);
    }
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
    return rc;
 }
 
+int machx_set_machine(void *cx, JSON crew, S id, S specRef, JSON bindings, S node, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "SetMachine");
+   duk_push_string(c->dctx, crew);
+   duk_push_string(c->dctx, id);
+   duk_push_string(c->dctx, specRef);
+   duk_push_string(c->dctx, bindings);
+   duk_push_string(c->dctx, node);
+   return getResult(c, 5, dst, limit);
+}
+
 int mach_set_machine(JSON crew, S id, S specRef, JSON bindings, S node, JSON dst, size_t limit) {
-   duk_get_global_string(ctx->dctx, "SetMachine");
-   duk_push_string(ctx->dctx, crew);
-   duk_push_string(ctx->dctx, id);
-   duk_push_string(ctx->dctx, specRef);
-   duk_push_string(ctx->dctx, bindings);
-   duk_push_string(ctx->dctx, node);
-   return getResult(5, dst, limit);
+   return machx_set_machine(ctx, crew, id, specRef, bindings, node, dst, limit);
+}
+
+int machx_rem_machine(void *cx, JSON crew, S id, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "RemMachine");
+   duk_push_string(c->dctx, crew);
+   duk_push_string(c->dctx, id);
+   return getResult(c, 2, dst, limit);
 }
 
 int mach_rem_machine(JSON crew, S id, JSON dst, size_t limit) {
-   duk_get_global_string(ctx->dctx, "RemMachine");
-   duk_push_string(ctx->dctx, crew);
-   duk_push_string(ctx->dctx, id);
-   return getResult(2, dst, limit);
+   return machx_rem_machine(ctx, crew, id, dst, limit);
+}
+
+int machx_crew_process(void *cx, JSON crew, JSON message, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   if (c->workers) {
+      mach_buf crew_buf = {crew, strlen(crew), 0};
+      mach_buf message_buf = {message, strlen(message), 0};
+      mach_buf out = MACH_BUF_INIT;
+      int rc = workers_crew_process(c, &crew_buf, &message_buf, &out, 0);
+      if (rc == MACH_OKAY) {
+         rc = copystr(dst, limit, out.data);
+      }
+      mach_buf_free(&out);
+      return rc;
+   }
+   duk_get_global_string(c->dctx, "CrewProcess");
+   duk_push_string(c->dctx, crew);
+   duk_push_string(c->dctx, message);
+   return getResult(c, 2, dst, limit);
 }
 
 int mach_crew_process(JSON crew, JSON message, JSON dst, size_t limit) {
-   duk_get_global_string(ctx->dctx, "CrewProcess");
-   duk_push_string(ctx->dctx, crew);
-   duk_push_string(ctx->dctx, message);
-   return getResult(2, dst, limit);
+   return machx_crew_process(ctx, crew, message, dst, limit);
 }
 
-int mach_get_emitted(JSON steppeds, JSON dsts[], int most, size_t limit) {
+int machx_get_emitted(void *cx, JSON steppeds, JSON dsts[], int most, size_t limit) {
+   Ctx *c = cx;
    /* ToDo: Stop ignoring 'most'. */
-   duk_get_global_string(ctx->dctx, "GetEmitted");
-   duk_push_string(ctx->dctx, steppeds);
+   duk_get_global_string(c->dctx, "GetEmitted");
+   duk_push_string(c->dctx, steppeds);
 
    int rc = MACH_OKAY;
 
-   if (duk_pcall(ctx->dctx, 1) == DUK_EXEC_SUCCESS) {
+   if (duk_pcall(c->dctx, 1) == DUK_EXEC_SUCCESS) {
       duk_size_t i, n;
-      n = duk_get_length(ctx->dctx, -1);
+      n = duk_get_length(c->dctx, -1);
       for (i = 0; i < n; i++) {
-         if (duk_get_prop_index(ctx->dctx, -1, i)) {
-            const char *result = duk_safe_to_string(ctx->dctx, -1);
-            duk_pop(ctx->dctx);
+         if (duk_get_prop_index(c->dctx, -1, i)) {
+            const char *result = duk_safe_to_string(c->dctx, -1);
+            duk_pop(c->dctx);
             int n = strlen(result);
             if (limit < n) {
                rc = MACH_TOO_BIG;
@@ -428,30 +1173,35 @@ int mach_get_emitted(JSON steppeds, JSON dsts[], int most, size_t limit) {
          memset(dsts[i], 0, limit);
       }
    } else {
-      const char *result = duk_safe_to_string(ctx->dctx, -1);
+      const char *result = duk_safe_to_string(c->dctx, -1);
       printf("error: %s\n", result);
       return MACH_SAD;
    }
 
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
 
    return rc;
 }
 
-int mach_do_emitted(JSON steppeds, int (*f)(JSON)) {
+int mach_get_emitted(JSON steppeds, JSON dsts[], int most, size_t limit) {
+   return machx_get_emitted(ctx, steppeds, dsts, most, limit);
+}
+
+int machx_do_emitted(void *cx, JSON steppeds, int (*f)(JSON)) {
+   Ctx *c = cx;
    /* ToDo: Stop ignoring 'most'. */
-   duk_get_global_string(ctx->dctx, "GetEmitted");
-   duk_push_string(ctx->dctx, steppeds);
+   duk_get_global_string(c->dctx, "GetEmitted");
+   duk_push_string(c->dctx, steppeds);
 
    int rc = MACH_OKAY;
 
-   if (duk_pcall(ctx->dctx, 1) == DUK_EXEC_SUCCESS) {
+   if (duk_pcall(c->dctx, 1) == DUK_EXEC_SUCCESS) {
       duk_size_t i, n;
-      n = duk_get_length(ctx->dctx, -1);
+      n = duk_get_length(c->dctx, -1);
       for (i = 0; i < n; i++) {
-         if (duk_get_prop_index(ctx->dctx, -1, i)) {
-            const char *result = duk_safe_to_string(ctx->dctx, -1);
-            duk_pop(ctx->dctx);
+         if (duk_get_prop_index(c->dctx, -1, i)) {
+            const char *result = duk_safe_to_string(c->dctx, -1);
+            duk_pop(c->dctx);
             int ret = f((char *)result);
             if (ret) {
                break;
@@ -461,21 +1211,1453 @@ int mach_do_emitted(JSON steppeds, int (*f)(JSON)) {
          }
       }
    } else {
-      const char *result = duk_safe_to_string(ctx->dctx, -1);
+      const char *result = duk_safe_to_string(c->dctx, -1);
       printf("error: %s\n", result);
       return MACH_SAD;
    }
 
-   duk_pop(ctx->dctx);
+   duk_pop(c->dctx);
 
    return rc;
 }
 
-int mach_crew_update(JSON crew, JSON stepped, JSON dst, size_t limit) {
-   duk_get_global_string(ctx->dctx, "CrewUpdate");
-   duk_push_string(ctx->dctx, crew);
-   duk_push_string(ctx->dctx, stepped);
-   return getResult(2, dst, limit);
+int mach_do_emitted(JSON steppeds, int (*f)(JSON)) {
+   return machx_do_emitted(ctx, steppeds, f);
+}
+
+int machx_crew_update(void *cx, JSON crew, JSON stepped, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewUpdate");
+   duk_push_string(c->dctx, crew);
+   duk_push_string(c->dctx, stepped);
+   return getResult(c, 2, dst, limit);
+}
+
+int mach_crew_update(JSON crew, JSON stepped, JSON dst, size_t limit) {
+   return machx_crew_update(ctx, crew, stepped, dst, limit);
+}
+
+/* callBatch calls CrewProcessBatch, which is on the stack with its
+   arguments, and gets the statuses (if statuses isn't NULL).  Leaves
+   the result object and its result JSON on the stack, or just the
+   error (with MACH_SAD) if the call threw. */
+static int callBatch(Ctx *c, int nargs, int n, int statuses[]) {
+   duk_context *d = c->dctx;
+   int i;
+
+   if (duk_pcall(d, nargs) != DUK_EXEC_SUCCESS) {
+      printf("mach_crew_process_batch error %s\n", duk_safe_to_string(d, -1));
+      return MACH_SAD;
+   }
+   if (statuses != NULL) {
+      duk_get_prop_string(d, -1, "statuses");
+      for (i = 0; i < n; i++) {
+         duk_get_prop_index(d, -1, i);
+         statuses[i] = duk_get_int(d, -1);
+         duk_pop(d);
+      }
+      duk_pop(d);
+   }
+   duk_get_prop_string(d, -1, "result");
+   return MACH_OKAY;
+}
+
+int machx_crew_process_batch(void *cx, JSON crew, JSON messages[], int n, JSON dst, size_t limit, int statuses[]) {
+   Ctx *c = cx;
+   duk_context *d = c->dctx;
+   int i;
+
+   duk_get_global_string(d, "CrewProcessBatch");
+   duk_push_string(d, crew);
+   duk_push_array(d);
+   for (i = 0; i < n; i++) {
+      duk_push_string(d, messages[i]);
+      duk_put_prop_index(d, -2, i);
+   }
+   if (callBatch(c, 2, n, statuses) != MACH_OKAY) {
+      duk_pop(d);
+      return MACH_SAD;
+   }
+
+   int rc = MACH_OKAY;
+   duk_size_t len;
+   const char *result = duk_get_lstring(d, -1, &len);
+   if (result == NULL) {
+      rc = MACH_SAD;
+   } else if (limit <= len) {
+      rc = MACH_TOO_BIG;
+   } else {
+      memcpy(dst, result, len + 1);
+   }
+   duk_pop_2(d);
+
+   return rc;
+}
+
+int mach_crew_process_batch(JSON crew, JSON messages[], int n, JSON dst, size_t limit, int statuses[]) {
+   return machx_crew_process_batch(ctx, crew, messages, n, dst, limit, statuses);
+}
+
+/* callStatus calls the function on the stack with nargs arguments and
+   pops the result.  Returns MACH_SAD if the call threw. */
+static int callStatus(Ctx *c, int nargs) {
+   int rc = MACH_OKAY;
+   if (duk_pcall(c->dctx, nargs) != DUK_EXEC_SUCCESS) {
+      printf("callStatus error %s\n", duk_safe_to_string(c->dctx, -1));
+      rc = MACH_SAD;
+   }
+   duk_pop(c->dctx);
+   return rc;
+}
+
+/* callResult is like getResult except that it returns MACH_SAD (and
+   writes nothing to dst) if the call threw. */
+static int callResult(Ctx *c, int nargs, JSON dst, size_t limit) {
+   int rc = MACH_OKAY;
+   if (duk_pcall(c->dctx, nargs) != DUK_EXEC_SUCCESS) {
+      printf("callResult error %s\n", duk_safe_to_string(c->dctx, -1));
+      rc = MACH_SAD;
+   } else {
+      duk_size_t n;
+      const char *result = duk_get_lstring(c->dctx, -1, &n);
+      if (result == NULL) {
+         result = "";
+         n = 0;
+      }
+      if (limit <= n) {
+         rc = MACH_TOO_BIG;
+      } else {
+         memcpy(dst, result, n + 1);
+      }
+   }
+   duk_pop(c->dctx);
+   return rc;
+}
+
+int machx_crew_open(void *cx, JSON crew, int *h) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewOpen");
+   duk_push_string(c->dctx, crew);
+   if (duk_pcall(c->dctx, 1) != DUK_EXEC_SUCCESS) {
+      printf("mach_crew_open error %s\n", duk_safe_to_string(c->dctx, -1));
+      duk_pop(c->dctx);
+      return MACH_SAD;
+   }
+   *h = duk_get_int(c->dctx, -1);
+   duk_pop(c->dctx);
+   return MACH_OKAY;
+}
+
+int mach_crew_open(JSON crew, int *h) {
+   return machx_crew_open(ctx, crew, h);
+}
+
+int machx_crew_close(void *cx, int h) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewClose");
+   duk_push_int(c->dctx, h);
+   return callStatus(c, 1);
+}
+
+int mach_crew_close(int h) {
+   return machx_crew_close(ctx, h);
+}
+
+int machx_crew_handle_process(void *cx, int h, JSON message, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleProcess");
+   duk_push_int(c->dctx, h);
+   duk_push_string(c->dctx, message);
+   return callResult(c, 2, dst, limit);
+}
+
+int mach_crew_handle_process(int h, JSON message, JSON dst, size_t limit) {
+   return machx_crew_handle_process(ctx, h, message, dst, limit);
+}
+
+int machx_crew_handle_update(void *cx, int h, JSON steppeds) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleUpdate");
+   duk_push_int(c->dctx, h);
+   duk_push_string(c->dctx, steppeds);
+   return callStatus(c, 2);
+}
+
+int mach_crew_handle_update(int h, JSON steppeds) {
+   return machx_crew_handle_update(ctx, h, steppeds);
+}
+
+int machx_crew_handle_set_machine(void *cx, int h, S id, S specRef, JSON bindings, S node) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleSetMachine");
+   duk_push_int(c->dctx, h);
+   duk_push_string(c->dctx, id);
+   duk_push_string(c->dctx, specRef);
+   duk_push_string(c->dctx, bindings);
+   duk_push_string(c->dctx, node);
+   return callStatus(c, 5);
+}
+
+int mach_crew_handle_set_machine(int h, S id, S specRef, JSON bindings, S node) {
+   return machx_crew_handle_set_machine(ctx, h, id, specRef, bindings, node);
+}
+
+int machx_crew_handle_rem_machine(void *cx, int h, S id) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleRemMachine");
+   duk_push_int(c->dctx, h);
+   duk_push_string(c->dctx, id);
+   return callStatus(c, 2);
+}
+
+int mach_crew_handle_rem_machine(int h, S id) {
+   return machx_crew_handle_rem_machine(ctx, h, id);
+}
+
+int machx_crew_export(void *cx, int h, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewExport");
+   duk_push_int(c->dctx, h);
+   return callResult(c, 1, dst, limit);
+}
+
+int mach_crew_export(int h, JSON dst, size_t limit) {
+   return machx_crew_export(ctx, h, dst, limit);
+}
+
+int machx_crew_import(void *cx, int h, JSON crew) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewImport");
+   duk_push_int(c->dctx, h);
+   duk_push_string(c->dctx, crew);
+   return callStatus(c, 2);
+}
+
+int mach_crew_import(int h, JSON crew) {
+   return machx_crew_import(ctx, h, crew);
+}
+
+/* API: mach_spec_cache_stats writes the spec cache's summary and
+   entries as JSON to dst.  Calls SpecCacheStats directly rather than
+   going through evalf. */
+int machx_spec_cache_stats(void *cx, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "SpecCacheStats");
+   return callResult(c, 0, dst, limit);
+}
+
+int mach_spec_cache_stats(JSON dst, size_t limit) {
+   return machx_spec_cache_stats(ctx, dst, limit);
+}
+
+/* invalidate calls InvalidateSpec in the given heap. */
+static int invalidate(Ctx *c, S name) {
+   duk_get_global_string(c->dctx, "InvalidateSpec");
+   if (name == NULL) {
+      duk_push_null(c->dctx);
+   } else {
+      duk_push_string(c->dctx, name);
+   }
+   return callStatus(c, 1);
+}
+
+/* API: mach_invalidate_spec makes the named cached spec (or every
+   cached spec if name is NULL) stale, so the next use asks the
+   provider about it. */
+int machx_invalidate_spec(void *cx, S name) {
+   Ctx *c = cx;
+   int rc = invalidate(c, name);
+   if (workers_invalidate(c, name) != MACH_OKAY) {
+      rc = MACH_SAD;
+   }
+   return rc;
+}
+
+int mach_invalidate_spec(S name) {
+   return machx_invalidate_spec(ctx, name);
+}
+
+/* Preload is a spec that mach_preload_specs fetched. */
+typedef struct {
+   S name;
+   char *js;
+   char *version;
+   /* ms is how long the fetch took. */
+   double ms;
+} Preload;
+
+/* PreloadJob is the list of specs that preload_fetch threads take
+   turns fetching. */
+typedef struct {
+   Ctx *c;
+   Preload *specs;
+   int n;
+   int next;
+   pthread_mutex_t lock;
+} PreloadJob;
+
+static int workers_preload(Ctx *c, Preload *specs, int n);
+
+static double now_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* preload_fetch fetches the job's specs, one at a time, until there
+   aren't any left. */
+static void *preload_fetch(void *arg) {
+   PreloadJob *job = arg;
+   Ctx *c = job->c;
+
+   for (;;) {
+      int i;
+      pthread_mutex_lock(&job->lock);
+      i = job->next++;
+      pthread_mutex_unlock(&job->lock);
+      if (job->n <= i) {
+         break;
+      }
+
+      Preload *p = &job->specs[i];
+      double then = now_ms();
+      if (c->vprovider != NULL) {
+         p->js = c->vprovider(c->provider_ctx, p->name, NULL, &p->version);
+      } else {
+         p->js = c->provider(c->provider_ctx, p->name, "");
+      }
+      p->ms = now_ms() - then;
+   }
+
+   return NULL;
+}
+
+/* preload_install calls PreloadSpecs with the fetched specs.  The
+   report goes to dst if it's not NULL. */
+static int preload_install(Ctx *c, Preload *specs, int n, JSON dst, size_t limit) {
+   duk_context *d = c->dctx;
+   int i;
+
+   duk_get_global_string(d, "PreloadSpecs");
+   duk_push_array(d);
+   for (i = 0; i < n; i++) {
+      duk_push_object(d);
+      duk_push_string(d, specs[i].name);
+      duk_put_prop_string(d, -2, "name");
+      duk_push_string(d, specs[i].js);
+      duk_put_prop_string(d, -2, "js");
+      duk_push_string(d, specs[i].version);
+      duk_put_prop_string(d, -2, "version");
+      duk_push_number(d, specs[i].ms);
+      duk_put_prop_string(d, -2, "fetchMs");
+      duk_put_prop_index(d, -2, i);
+   }
+
+   if (dst == NULL) {
+      return callStatus(c, 1);
+   }
+   return callResult(c, 1, dst, limit);
+}
+
+/* API: mach_preload_specs fetches the named specs on several threads
+   and then installs them in the spec cache (and the workers' caches),
+   so that the first messages for those specs don't pay for fetching
+   and compiling them.  Writes a report with each spec's timings to
+   dst. */
+int machx_preload_specs(void *cx, S names[], int n, JSON dst, size_t limit) {
+   Ctx *c = cx;
+   PreloadJob job;
+   pthread_t threads[MACH_PRELOAD_THREADS];
+   int i, started, rc;
+
+   if (n < 0 || (c->provider == NULL && c->vprovider == NULL)) {
+      return MACH_SAD;
+   }
+
+   job.c = c;
+   job.n = n;
+   job.next = 0;
+   job.specs = calloc(n + 1, sizeof(Preload));
+   if (job.specs == NULL) {
+      return MACH_SAD;
+   }
+   for (i = 0; i < n; i++) {
+      job.specs[i].name = names[i];
+   }
+   pthread_mutex_init(&job.lock, NULL);
+
+   /* This thread fetches, too, so it's fine if a thread doesn't
+      start. */
+   for (started = 0; started < MACH_PRELOAD_THREADS && started < n - 1; started++) {
+      if (pthread_create(&threads[started], NULL, preload_fetch, &job) != 0) {
+         break;
+      }
+   }
+   preload_fetch(&job);
+   for (i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+   }
+   pthread_mutex_destroy(&job.lock);
+
+   rc = preload_install(c, job.specs, n, dst, limit);
+   if (workers_preload(c, job.specs, n) != MACH_OKAY && rc == MACH_OKAY) {
+      rc = MACH_SAD;
+   }
+
+   if (c->provider_mode & MACH_FREE_FOR_PROVIDER) {
+      for (i = 0; i < n; i++) {
+         free(job.specs[i].js);
+         free(job.specs[i].version);
+      }
+   }
+   free(job.specs);
+
+   return rc;
+}
+
+int mach_preload_specs(S names[], int n, JSON dst, size_t limit) {
+   return machx_preload_specs(ctx, names, n, dst, limit);
+}
+
+/* The _buf functions: Like the functions above but with mach_buf
+   inputs and outputs.  Inputs are pushed with their lengths, and
+   outputs are copied once, from the heap's string to the buffer, which
+   grows as needed.  With MACH_FORMAT_CBOR (see mach_set_format), the
+   inputs and outputs are CBOR rather than JSON. */
+
+/* push_wire pushes the buffer's contents: a string or, for
+   MACH_FORMAT_CBOR, a buffer (which refers to the contents rather
+   than copying them) for the driver to decode. */
+static void push_wire(duk_context *d, const mach_buf *b, int format) {
+   if (format == MACH_FORMAT_CBOR) {
+      duk_push_external_buffer(d);
+      duk_config_buffer(d, -1, b->data, b->len);
+   } else {
+      duk_push_lstring(d, b->data, b->len);
+   }
+}
+
+/* push_buf pushes the buffer's contents in the context's format. */
+static void push_buf(Ctx *c, const mach_buf *b) {
+   push_wire(c->dctx, b, c->format);
+}
+
+/* push_format pushes the 'binary' argument that the driver's
+   functions take last (see decodeWire in driver.js). */
+static void push_format(Ctx *c) {
+   duk_push_boolean(c->dctx, c->format == MACH_FORMAT_CBOR);
+}
+
+/* get_wire returns the bytes of the string or buffer at the given
+   index. */
+static const char *get_wire(duk_context *d, duk_idx_t i, duk_size_t *n) {
+   if (duk_is_buffer_data(d, i)) {
+      return duk_get_buffer_data(d, i, n);
+   }
+   return duk_get_lstring(d, i, n);
+}
+
+/* API: mach_set_format sets the format for the mach_buf functions. */
+int machx_set_format(void *cx, int format) {
+   Ctx *c = cx;
+   if (format != MACH_FORMAT_JSON && format != MACH_FORMAT_CBOR) {
+      return MACH_SAD;
+   }
+   c->format = format;
+   return MACH_OKAY;
+}
+
+int mach_set_format(int format) {
+   return machx_set_format(ctx, format);
+}
+
+/* callBuf calls the function on the stack with nargs arguments and
+   writes the (string or buffer) result to dst.  Returns MACH_SAD (and
+   leaves dst alone) if the call threw. */
+static int callBuf(Ctx *c, int nargs, mach_buf *dst) {
+   int rc;
+   if (duk_pcall(c->dctx, nargs) != DUK_EXEC_SUCCESS) {
+      printf("callBuf error %s\n", duk_safe_to_string(c->dctx, -1));
+      rc = MACH_SAD;
+   } else {
+      duk_size_t n;
+      const char *result = get_wire(c->dctx, -1, &n);
+      rc = mach_buf_set(dst, result == NULL ? "" : result, result == NULL ? 0 : n);
+   }
+   duk_pop(c->dctx);
+   return rc;
+}
+
+int machx_eval_buf(void *cx, const mach_buf *src, mach_buf *dst) {
+   Ctx *c = cx;
+   if (duk_peval_lstring(c->dctx, src->data, src->len) != 0) {
+      fprintf(stderr, "mach_eval error %s\n", duk_safe_to_string(c->dctx, -1));
+      duk_pop(c->dctx);
+      return MACH_SAD;
+   }
+   duk_size_t n;
+   const char *result = duk_get_lstring(c->dctx, -1, &n);
+   int rc = mach_buf_set(dst, result == NULL ? "" : result, result == NULL ? 0 : n);
+   duk_pop(c->dctx);
+   return rc;
+}
+
+int mach_eval_buf(const mach_buf *src, mach_buf *dst) {
+   return machx_eval_buf(ctx, src, dst);
+}
+
+int machx_process_buf(void *cx, const mach_buf *state, const mach_buf *message, mach_buf *dst) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "Process");
+   push_buf(c, state);
+   push_buf(c, message);
+   push_format(c);
+   return callBuf(c, 3, dst);
+}
+
+int mach_process_buf(const mach_buf *state, const mach_buf *message, mach_buf *dst) {
+   return machx_process_buf(ctx, state, message, dst);
+}
+
+int machx_crew_process_buf(void *cx, const mach_buf *crew, const mach_buf *message, mach_buf *dst) {
+   Ctx *c = cx;
+   if (c->workers) {
+      return workers_crew_process(c, crew, message, dst, c->format == MACH_FORMAT_CBOR);
+   }
+   duk_get_global_string(c->dctx, "CrewProcess");
+   push_buf(c, crew);
+   push_buf(c, message);
+   push_format(c);
+   return callBuf(c, 3, dst);
+}
+
+int mach_crew_process_buf(const mach_buf *crew, const mach_buf *message, mach_buf *dst) {
+   return machx_crew_process_buf(ctx, crew, message, dst);
+}
+
+int machx_crew_update_buf(void *cx, const mach_buf *crew, const mach_buf *steppeds, mach_buf *dst) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewUpdate");
+   push_buf(c, crew);
+   push_buf(c, steppeds);
+   push_format(c);
+   return callBuf(c, 3, dst);
+}
+
+int mach_crew_update_buf(const mach_buf *crew, const mach_buf *steppeds, mach_buf *dst) {
+   return machx_crew_update_buf(ctx, crew, steppeds, dst);
+}
+
+int machx_crew_process_batch_buf(void *cx, const mach_buf *crew, const mach_buf messages[], int n, mach_buf *dst, int statuses[]) {
+   Ctx *c = cx;
+   duk_context *d = c->dctx;
+   int i;
+
+   duk_get_global_string(d, "CrewProcessBatch");
+   push_buf(c, crew);
+   duk_push_array(d);
+   for (i = 0; i < n; i++) {
+      push_buf(c, &messages[i]);
+      duk_put_prop_index(d, -2, i);
+   }
+   push_format(c);
+   if (callBatch(c, 3, n, statuses) != MACH_OKAY) {
+      duk_pop(d);
+      return MACH_SAD;
+   }
+   duk_size_t len;
+   const char *result = get_wire(d, -1, &len);
+   int rc = result == NULL ? MACH_SAD : mach_buf_set(dst, result, len);
+   duk_pop_2(d);
+   return rc;
+}
+
+int mach_crew_process_batch_buf(const mach_buf *crew, const mach_buf messages[], int n, mach_buf *dst, int statuses[]) {
+   return machx_crew_process_batch_buf(ctx, crew, messages, n, dst, statuses);
+}
+
+int machx_crew_open_buf(void *cx, const mach_buf *crew, int *h) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewOpen");
+   push_buf(c, crew);
+   push_format(c);
+   if (duk_pcall(c->dctx, 2) != DUK_EXEC_SUCCESS) {
+      printf("mach_crew_open error %s\n", duk_safe_to_string(c->dctx, -1));
+      duk_pop(c->dctx);
+      return MACH_SAD;
+   }
+   *h = duk_get_int(c->dctx, -1);
+   duk_pop(c->dctx);
+   return MACH_OKAY;
+}
+
+int mach_crew_open_buf(const mach_buf *crew, int *h) {
+   return machx_crew_open_buf(ctx, crew, h);
+}
+
+int machx_crew_handle_process_buf(void *cx, int h, const mach_buf *message, mach_buf *dst) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleProcess");
+   duk_push_int(c->dctx, h);
+   push_buf(c, message);
+   push_format(c);
+   return callBuf(c, 3, dst);
+}
+
+int mach_crew_handle_process_buf(int h, const mach_buf *message, mach_buf *dst) {
+   return machx_crew_handle_process_buf(ctx, h, message, dst);
+}
+
+int machx_crew_handle_update_buf(void *cx, int h, const mach_buf *steppeds) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewHandleUpdate");
+   duk_push_int(c->dctx, h);
+   push_buf(c, steppeds);
+   push_format(c);
+   return callStatus(c, 3);
+}
+
+int mach_crew_handle_update_buf(int h, const mach_buf *steppeds) {
+   return machx_crew_handle_update_buf(ctx, h, steppeds);
+}
+
+int machx_crew_export_buf(void *cx, int h, mach_buf *dst) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewExport");
+   duk_push_int(c->dctx, h);
+   push_format(c);
+   return callBuf(c, 2, dst);
+}
+
+int mach_crew_export_buf(int h, mach_buf *dst) {
+   return machx_crew_export_buf(ctx, h, dst);
+}
+
+int machx_crew_import_buf(void *cx, int h, const mach_buf *crew) {
+   Ctx *c = cx;
+   duk_get_global_string(c->dctx, "CrewImport");
+   duk_push_int(c->dctx, h);
+   push_buf(c, crew);
+   push_format(c);
+   return callStatus(c, 3);
+}
+
+int mach_crew_import_buf(int h, const mach_buf *crew) {
+   return machx_crew_import_buf(ctx, h, crew);
+}
+
+/* Workers: A pool of threads, each with its own context (and heap),
+   that mach_crew_process uses to process a crew's machines in
+   parallel.  Each worker processes the machines in its shard of the
+   crew (see crew_split), and the workers' steppeds are merged in
+   shard order.
+
+   The main context's heap isn't touched while the workers are busy,
+   and the workers' heaps are only touched by the main thread while
+   the workers are idle. */
+
+typedef struct Worker {
+   pthread_t thread;
+   int started;
+   Ctx ctx;
+   int shard;
+   struct WorkerPool *pool;
+   /* The worker's shard of the current job's crew. */
+   mach_buf in;
+   /* The result of the current job: steppeds. */
+   mach_buf out;
+   int rc;
+   /* The messages that the current job emitted (see worker_emit). */
+   mach_buf emitted;
+   int emit_rc;
+} Worker;
+
+typedef struct WorkerPool {
+   int n;
+   Worker *workers;
+   pthread_mutex_t lock;
+   /* work is signaled when there's a new job (or when it's time to
+      stop). */
+   pthread_cond_t work;
+   /* done is signaled when the last worker finishes a job. */
+   pthread_cond_t done;
+   unsigned long job;
+   int pending;
+   int stopping;
+   const mach_buf *message;
+   /* binary is whether the crew and message are CBOR. */
+   int binary;
+} WorkerPool;
+
+/* Splitting a crew: Before the workers start on a message,
+   workers_crew_process splits the crew into a crew for each worker
+   with only the machines in the worker's shard, so each worker
+   decodes just its own machines rather than the whole crew.  The
+   split scans the crew's JSON or CBOR without decoding it.  A
+   machine's shard is a hash (FNV-1a) of the bytes that encode its
+   id, and everything in the crew other than the machines goes to
+   every shard. */
+
+/* MACH_SPLIT_MAX_DEPTH limits the nesting of CBOR items that the
+   split will skip. */
+#define MACH_SPLIT_MAX_DEPTH (1000)
+
+static int shard_of(const char *s, size_t len, int n) {
+   uint32_t h = 0x811c9dc5;
+   size_t i;
+   for (i = 0; i < len; i++) {
+      h ^= (unsigned char)s[i];
+      h *= 0x01000193;
+   }
+   return (int)(h % (uint32_t)n);
+}
+
+/* buf_append appends n bytes to b, which stays null-terminated. */
+static int buf_append(mach_buf *b, const char *s, size_t n) {
+   if (mach_buf_reserve(b, b->len + n) != MACH_OKAY) {
+      return MACH_SAD;
+   }
+   memcpy(b->data + b->len, s, n);
+   b->len += n;
+   b->data[b->len] = '\0';
+   return MACH_OKAY;
+}
+
+static const char *json_space(const char *p, const char *end) {
+   while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+      p++;
+   }
+   return p;
+}
+
+/* json_skip returns the end of the JSON value that starts at p (or
+   NULL if there isn't one). */
+static const char *json_skip(const char *p, const char *end) {
+   int depth = 0;
+   do {
+      if (end <= p) {
+         return NULL;
+      }
+      char c = *p++;
+      if (c == '"') {
+         while (p < end && *p != '"') {
+            if (*p == '\\' && p + 1 < end) {
+               p++;
+            }
+            p++;
+         }
+         if (end <= p) {
+            return NULL;
+         }
+         p++;
+      } else if (c == '{' || c == '[') {
+         depth++;
+      } else if (c == '}' || c == ']') {
+         if (--depth < 0) {
+            return NULL;
+         }
+      } else if (depth == 0) {
+         /* A number, true, false, or null. */
+         while (p < end && strchr(",:]} \t\n\r", *p) == NULL) {
+            p++;
+         }
+      }
+   } while (0 < depth);
+   return p;
+}
+
+/* json_member reads the member at p (after an object's '{' if
+   first and otherwise after a member).  Returns the end of the
+   member's value, and where its key and value start and end, or NULL
+   at the end of the object (and sets *bad if the object isn't well
+   formed). */
+static const char *json_member(const char *p, const char *end, int first, const char **k,
+                               const char **ke, const char **v, int *bad) {
+   p = json_space(p, end);
+   if (p < end && *p == '}') {
+      return NULL;
+   }
+   if (!first) {
+      if (p == end || *p != ',') {
+         *bad = 1;
+         return NULL;
+      }
+      p = json_space(p + 1, end);
+   }
+   *k = p;
+   *ke = p < end && *p == '"' ? json_skip(p, end) : NULL;
+   p = *ke == NULL ? NULL : json_space(*ke, end);
+   if (p == NULL || p == end || *p != ':') {
+      *bad = 1;
+      return NULL;
+   }
+   *v = json_space(p + 1, end);
+   p = json_skip(*v, end);
+   if (p == NULL) {
+      *bad = 1;
+   }
+   return p;
+}
+
+/* split_none gives the first worker the crew, which doesn't have
+   machines to split, and the others an empty crew. */
+static int split_none(const mach_buf *crew, const char *empty, size_t len, Worker *ws, int n) {
+   int i;
+   for (i = 0; i < n; i++) {
+      ws[i].in.len = 0;
+      if (buf_append(&ws[i].in, i == 0 ? crew->data : empty, i == 0 ? crew->len : len) != MACH_OKAY) {
+         return MACH_SAD;
+      }
+   }
+   return MACH_OKAY;
+}
+
+/* json_split writes the shards of the JSON crew to the workers'
+   crews. */
+static int json_split(const mach_buf *crew, Worker *ws, int n) {
+   const char *start = crew->data, *end = crew->data + crew->len;
+   const char *p, *k, *ke, *v, *ms = NULL, *me = NULL;
+   int i, first, bad = 0;
+
+   p = json_space(start, end);
+   if (p == end || *p != '{') {
+      return MACH_SAD;
+   }
+   for (p++, first = 1; (p = json_member(p, end, first, &k, &ke, &v, &bad)) != NULL; first = 0) {
+      if (ke - k == 10 && memcmp(k, "\"machines\"", 10) == 0 && *v == '{') {
+         ms = v;
+         me = p;
+      }
+   }
+   if (bad) {
+      return MACH_SAD;
+   }
+   if (ms == NULL) {
+      return split_none(crew, "{}", 2, ws, n);
+   }
+
+   for (i = 0; i < n; i++) {
+      ws[i].in.len = 0;
+      if (buf_append(&ws[i].in, start, ms - start) != MACH_OKAY ||
+          buf_append(&ws[i].in, "{", 1) != MACH_OKAY) {
+         return MACH_SAD;
+      }
+   }
+   for (p = ms + 1, first = 1; (p = json_member(p, me, first, &k, &ke, &v, &bad)) != NULL; first = 0) {
+      mach_buf *b = &ws[shard_of(k, ke - k, n)].in;
+      if ((b->data[b->len - 1] != '{' && buf_append(b, ",", 1) != MACH_OKAY) ||
+          buf_append(b, k, ke - k) != MACH_OKAY ||
+          buf_append(b, ":", 1) != MACH_OKAY ||
+          buf_append(b, v, p - v) != MACH_OKAY) {
+         return MACH_SAD;
+      }
+   }
+   if (bad) {
+      return MACH_SAD;
+   }
+   for (i = 0; i < n; i++) {
+      if (buf_append(&ws[i].in, "}", 1) != MACH_OKAY ||
+          buf_append(&ws[i].in, me, end - me) != MACH_OKAY) {
+         return MACH_SAD;
+      }
+   }
+   return MACH_OKAY;
+}
+
+/* cbor_head reads the initial byte and argument of the CBOR item at
+   p.  Returns the position after them (or NULL if they're not
+   well formed).  *indefinite is set for an indefinite length. */
+static const unsigned char *cbor_head(const unsigned char *p, const unsigned char *end,
+                                      int *major, uint64_t *arg, int *indefinite) {
+   if (end <= p) {
+      return NULL;
+   }
+   int ai = *p & 31;
+   *major = *p++ >> 5;
+   *arg = 0;
+   *indefinite = 0;
+   if (ai < 24) {
+      *arg = ai;
+   } else if (ai <= 27) {
+      int i, k = 1 << (ai - 24);
+      if (end - p < k) {
+         return NULL;
+      }
+      for (i = 0; i < k; i++) {
+         *arg = (*arg << 8) | *p++;
+      }
+   } else if (ai == 31 && 2 <= *major && *major <= 5) {
+      *indefinite = 1;
+   } else {
+      return NULL;
+   }
+   return p;
+}
+
+/* cbor_skip returns the end of the CBOR item that starts at p (or
+   NULL if there isn't one). */
+static const unsigned char *cbor_skip(const unsigned char *p, const unsigned char *end, int depth) {
+   int major, indefinite;
+   uint64_t arg, i;
+
+   if (MACH_SPLIT_MAX_DEPTH < depth) {
+      return NULL;
+   }
+   p = cbor_head(p, end, &major, &arg, &indefinite);
+   if (p == NULL) {
+      return NULL;
+   }
+   if (indefinite) {
+      /* Chunks or items until a break. */
+      while (p != NULL && p < end && *p != 0xff) {
+         p = cbor_skip(p, end, depth + 1);
+      }
+      return p == NULL || end <= p ? NULL : p + 1;
+   }
+   switch (major) {
+   case 2:
+   case 3:
+      return (uint64_t)(end - p) < arg ? NULL : p + arg;
+   case 4:
+   case 5:
+      if ((uint64_t)(end - p) < arg) {
+         /* Too many items for what's left. */
+         return NULL;
+      }
+      for (i = 0; p != NULL && i < (major == 5 ? 2 * arg : arg); i++) {
+         p = cbor_skip(p, end, depth + 1);
+      }
+      return p;
+   case 6:
+      return cbor_skip(p, end, depth + 1);
+   default:
+      return p;
+   }
+}
+
+/* cbor_map_head appends the head of a map with n pairs. */
+static int cbor_map_head(mach_buf *b, uint64_t n) {
+   unsigned char head[9];
+   int i, k;
+   if (n < 24) {
+      head[0] = 0xa0 | (unsigned char)n;
+      k = 0;
+   } else {
+      k = n < 0x100 ? 1 : n < 0x10000 ? 2 : n < 0x100000000ULL ? 4 : 8;
+      head[0] = 0xa0 | (k == 1 ? 24 : k == 2 ? 25 : k == 4 ? 26 : 27);
+      for (i = 0; i < k; i++) {
+         head[k - i] = (unsigned char)(n >> (8 * i));
+      }
+   }
+   return buf_append(b, (const char *)head, k + 1);
+}
+
+/* cbor_pairs calls f for each key and value in the map whose items
+   start at p.  Returns the end of the map (or NULL if it's not well
+   formed). */
+static const unsigned char *cbor_pairs(const unsigned char *p, const unsigned char *end,
+                                       uint64_t n, int indefinite,
+                                       int (*f)(void *, const unsigned char *, const unsigned char *,
+                                                const unsigned char *, const unsigned char *),
+                                       void *arg) {
+   uint64_t i;
+   for (i = 0; indefinite || i < n; i++) {
+      if (indefinite && p < end && *p == 0xff) {
+         return p + 1;
+      }
+      const unsigned char *k = p;
+      const unsigned char *v = cbor_skip(k, end, 1);
+      p = v == NULL ? NULL : cbor_skip(v, end, 1);
+      if (p == NULL || f(arg, k, v, v, p) != MACH_OKAY) {
+         return NULL;
+      }
+   }
+   return p;
+}
+
+typedef struct {
+   Worker *ws;
+   int n;
+   uint64_t *counts;
+   /* Where the machines are in the crew. */
+   const unsigned char *ms;
+   const unsigned char *me;
+} CborSplit;
+
+/* cbor_find notes where the crew's machines are. */
+static int cbor_find(void *arg, const unsigned char *k, const unsigned char *ke,
+                     const unsigned char *v, const unsigned char *ve) {
+   CborSplit *s = arg;
+   if (ke - k == 9 && memcmp(k, "\x68machines", 9) == 0 && (*v >> 5) == 5) {
+      s->ms = v;
+      s->me = ve;
+   }
+   return MACH_OKAY;
+}
+
+/* cbor_shard appends a machine to its shard. */
+static int cbor_shard(void *arg, const unsigned char *k, const unsigned char *ke,
+                      const unsigned char *v, const unsigned char *ve) {
+   CborSplit *s = arg;
+   int i = shard_of((const char *)k, ke - k, s->n);
+   s->counts[i]++;
+   return buf_append(&s->ws[i].in, (const char *)k, ve - k);
+}
+
+/* cbor_split writes the shards of the CBOR crew to the workers'
+   crews.  Each shard's machines are a map of definite length. */
+static int cbor_split(const mach_buf *crew, Worker *ws, int n) {
+   const unsigned char *start = (const unsigned char *)crew->data, *end = start + crew->len;
+   const unsigned char *p;
+   CborSplit s = {ws, n, NULL, NULL, NULL};
+   int major, indefinite, i, rc = MACH_OKAY;
+   uint64_t pairs;
+   size_t *at;
+
+   p = cbor_head(start, end, &major, &pairs, &indefinite);
+   if (p == NULL || major != 5 || cbor_pairs(p, end, pairs, indefinite, cbor_find, &s) == NULL) {
+      return MACH_SAD;
+   }
+   if (s.ms == NULL) {
+      return split_none(crew, "\xa0", 1, ws, n);
+   }
+
+   s.counts = calloc(n, sizeof(uint64_t));
+   at = calloc(n, sizeof(size_t));
+   if (s.counts == NULL || at == NULL) {
+      rc = MACH_SAD;
+   }
+   for (i = 0; rc == MACH_OKAY && i < n; i++) {
+      ws[i].in.len = 0;
+      rc = buf_append(&ws[i].in, (const char *)start, s.ms - start);
+      at[i] = ws[i].in.len;
+   }
+   if (rc == MACH_OKAY) {
+      p = cbor_head(s.ms, end, &major, &pairs, &indefinite);
+      if (p == NULL || cbor_pairs(p, end, pairs, indefinite, cbor_shard, &s) == NULL) {
+         rc = MACH_SAD;
+      }
+      /* Put each shard's map head in front of its machines. */
+      for (i = 0; rc == MACH_OKAY && i < n; i++) {
+         mach_buf *b = &ws[i].in;
+         size_t machines = b->len - at[i];
+         rc = cbor_map_head(b, s.counts[i]);
+         if (rc == MACH_OKAY) {
+            size_t k = b->len - at[i] - machines;
+            char head[9];
+            memcpy(head, b->data + at[i] + machines, k);
+            memmove(b->data + at[i] + k, b->data + at[i], machines);
+            memcpy(b->data + at[i], head, k);
+         }
+      }
+   }
+   for (i = 0; rc == MACH_OKAY && i < n; i++) {
+      rc = buf_append(&ws[i].in, (const char *)s.me, end - s.me);
+   }
+
+   free(s.counts);
+   free(at);
+   return rc;
+}
+
+/* crew_split writes the shards of the crew to the workers' crews. */
+static int crew_split(const mach_buf *crew, int binary, Worker *ws, int n) {
+   int rc = binary ? cbor_split(crew, ws, n) : json_split(crew, ws, n);
+   if (rc != MACH_OKAY) {
+      fprintf(stderr, "workers: couldn't split the crew\n");
+   }
+   return rc;
+}
+
+/* worker_emit is a worker's emit handler.  It appends the machine id
+   (with its NUL), the message's length, and the message to the
+   worker's emitted messages, which workers_emit passes to the
+   context's handler after the job. */
+static void worker_emit(void *arg, const char *mid, const char *message, size_t n) {
+   Worker *w = arg;
+   size_t m = strlen(mid) + 1;
+   size_t at = w->emitted.len;
+   if (w->emit_rc != MACH_OKAY ||
+       mach_buf_reserve(&w->emitted, at + m + sizeof(n) + n) != MACH_OKAY) {
+      w->emit_rc = MACH_SAD;
+      return;
+   }
+   memcpy(w->emitted.data + at, mid, m);
+   memcpy(w->emitted.data + at + m, &n, sizeof(n));
+   memcpy(w->emitted.data + at + m + sizeof(n), message, n);
+   w->emitted.len = at + m + sizeof(n) + n;
+}
+
+/* workers_emit passes the messages that the workers emitted during
+   the last job to the context's emit handler, in shard order. */
+static void workers_emit(Ctx *c) {
+   WorkerPool *pool = c->workers;
+   int i;
+
+   for (i = 0; c->emit_handler && i < pool->n; i++) {
+      Worker *w = &pool->workers[i];
+      size_t at = 0;
+      while (at < w->emitted.len) {
+         const char *mid = w->emitted.data + at;
+         size_t n;
+         at += strlen(mid) + 1;
+         memcpy(&n, w->emitted.data + at, sizeof(n));
+         at += sizeof(n);
+         c->emit_handler(c->emit_arg, mid, w->emitted.data + at, n);
+         at += n;
+      }
+   }
+}
+
+/* worker_run processes the current job's message for the worker's
+   shard of the current job's crew. */
+static void worker_run(Worker *w, const mach_buf *message) {
+   duk_context *d = w->ctx.dctx;
+   int format = w->pool->binary ? MACH_FORMAT_CBOR : MACH_FORMAT_JSON;
+   w->emitted.len = 0;
+   w->emit_rc = MACH_OKAY;
+   duk_get_global_string(d, "CrewProcessShard");
+   push_wire(d, &w->in, format);
+   push_wire(d, message, format);
+   duk_push_int(d, w->shard);
+   duk_push_int(d, w->pool->n);
+   duk_push_boolean(d, w->pool->binary);
+   if (duk_pcall(d, 5) == DUK_EXEC_SUCCESS) {
+      duk_size_t n;
+      const char *out = duk_get_lstring(d, -1, &n);
+      w->rc = mach_buf_set(&w->out, out, n);
+   } else {
+      fprintf(stderr, "worker %d error %s\n", w->shard, duk_safe_to_string(d, -1));
+      w->rc = MACH_SAD;
+   }
+   duk_pop(d);
+   if (w->emit_rc != MACH_OKAY) {
+      w->rc = MACH_SAD;
+   }
+}
+
+static void *worker_main(void *arg) {
+   Worker *w = (Worker *)arg;
+   WorkerPool *pool = w->pool;
+   unsigned long seen = 0;
+
+   pthread_mutex_lock(&pool->lock);
+   for (;;) {
+      while (!pool->stopping && pool->job == seen) {
+         pthread_cond_wait(&pool->work, &pool->lock);
+      }
+      if (pool->stopping) {
+         break;
+      }
+      seen = pool->job;
+      const mach_buf *message = pool->message;
+      pthread_mutex_unlock(&pool->lock);
+
+      worker_run(w, message);
+
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0) {
+         pthread_cond_signal(&pool->done);
+      }
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   return NULL;
+}
+
+/* workers_eval evaluates the given source in each worker's heap. */
+static int workers_eval(Ctx *c, char *src) {
+   size_t dst_limit = 16 * 1024;
+   JSON dst;
+   int i, rc = MACH_OKAY;
+
+   if (c->workers == NULL) {
+      return MACH_OKAY;
+   }
+   dst = malloc(dst_limit);
+   if (dst == NULL) {
+      return MACH_SAD;
+   }
+   for (i = 0; i < c->workers->n; i++) {
+      if (ctx_eval(&c->workers->workers[i].ctx, src, dst, (int)dst_limit) != MACH_OKAY) {
+         rc = MACH_SAD;
+      }
+   }
+   free(dst);
+   return rc;
+}
+
+/* PreloadWorker is a worker heap for workers_preload to install
+   specs in. */
+typedef struct {
+   Ctx *c;
+   Preload *specs;
+   int n;
+   int rc;
+   pthread_t thread;
+   int started;
+} PreloadWorker;
+
+static void *preload_worker(void *arg) {
+   PreloadWorker *pw = arg;
+   pw->rc = preload_install(pw->c, pw->specs, pw->n, NULL, 0);
+   return NULL;
+}
+
+/* workers_preload installs the fetched specs in the context's
+   workers' heaps (if any), which are idle, on a thread for each
+   heap. */
+static int workers_preload(Ctx *c, Preload *specs, int n) {
+   PreloadWorker *pws;
+   int i, rc = MACH_OKAY;
+
+   if (c->workers == NULL) {
+      return MACH_OKAY;
+   }
+   pws = calloc(c->workers->n, sizeof(PreloadWorker));
+   if (pws == NULL) {
+      return MACH_SAD;
+   }
+
+   for (i = 0; i < c->workers->n; i++) {
+      pws[i].c = &c->workers->workers[i].ctx;
+      pws[i].specs = specs;
+      pws[i].n = n;
+      pws[i].started = pthread_create(&pws[i].thread, NULL, preload_worker, &pws[i]) == 0;
+      if (!pws[i].started) {
+         /* Just do it here. */
+         preload_worker(&pws[i]);
+      }
+   }
+   for (i = 0; i < c->workers->n; i++) {
+      if (pws[i].started) {
+         pthread_join(pws[i].thread, NULL);
+      }
+      if (pws[i].rc != MACH_OKAY) {
+         rc = MACH_SAD;
+      }
+   }
+
+   free(pws);
+   return rc;
+}
+
+/* workers_invalidate invalidates the named cached spec (or all of
+   them) in the context's workers (if any). */
+static int workers_invalidate(Ctx *c, S name) {
+   int i, rc = MACH_OKAY;
+
+   if (c->workers == NULL) {
+      return MACH_OKAY;
+   }
+   for (i = 0; i < c->workers->n; i++) {
+      if (invalidate(&c->workers->workers[i].ctx, name) != MACH_OKAY) {
+         rc = MACH_SAD;
+      }
+   }
+   return rc;
+}
+
+/* workers_set_provider gives the context's workers (if any) the
+   context's spec provider. */
+static void workers_set_provider(Ctx *c) {
+   int i;
+
+   if (c->workers == NULL) {
+      return;
+   }
+   for (i = 0; i < c->workers->n; i++) {
+      Ctx *w = &c->workers->workers[i].ctx;
+      w->provider_ctx = c->provider_ctx;
+      w->provider = c->provider;
+      w->vprovider = c->vprovider;
+      w->provider_mode = c->provider_mode;
+   }
+}
+
+/* workers_stop stops and frees the context's workers (if any). */
+static void workers_stop(Ctx *c) {
+   WorkerPool *pool = c->workers;
+   int i;
+
+   if (pool == NULL) {
+      return;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->stopping = 1;
+   pthread_cond_broadcast(&pool->work);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (i = 0; i < pool->n; i++) {
+      Worker *w = &pool->workers[i];
+      if (w->started) {
+         pthread_join(w->thread, NULL);
+      }
+      ctx_close(&w->ctx);
+      mach_buf_free(&w->in);
+      mach_buf_free(&w->out);
+      mach_buf_free(&w->emitted);
+   }
+
+   pthread_cond_destroy(&pool->work);
+   pthread_cond_destroy(&pool->done);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->workers);
+   free(pool);
+   c->workers = NULL;
+}
+
+/* workers_start gives the context n workers, each with a heap that's
+   configured like the context's heap. */
+static int workers_start(Ctx *c, int n) {
+   size_t config_limit = 16 * 1024;
+   char out[16];
+   int i, rc = MACH_OKAY;
+
+   WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+   if (pool == NULL) {
+      return MACH_SAD;
+   }
+   pool->workers = calloc(n, sizeof(Worker));
+   if (pool->workers == NULL) {
+      free(pool);
+      return MACH_SAD;
+   }
+   pool->n = n;
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->work, NULL);
+   pthread_cond_init(&pool->done, NULL);
+   c->workers = pool;
+
+   JSON config = malloc(config_limit);
+   if (config == NULL || ctx_eval(c, "ConfigScript()", config, (int)config_limit) != MACH_OKAY) {
+      rc = MACH_SAD;
+   }
+
+   for (i = 0; rc == MACH_OKAY && i < n; i++) {
+      Worker *w = &pool->workers[i];
+      w->shard = i;
+      w->pool = pool;
+      w->ctx.provider = c->provider;
+      w->ctx.vprovider = c->vprovider;
+      w->ctx.provider_mode = c->provider_mode;
+      w->ctx.provider_ctx = c->provider_ctx;
+      w->ctx.pool.size = c->pool.size;
+      w->ctx.emit_handler = worker_emit;
+      w->ctx.emit_arg = w;
+      if (ctx_open(&w->ctx) != MACH_OKAY ||
+          ctx_eval(&w->ctx, config, out, sizeof(out)) != MACH_OKAY ||
+          pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+         rc = MACH_SAD;
+      } else {
+         w->started = 1;
+      }
+   }
+
+   free(config);
+   if (rc != MACH_OKAY) {
+      workers_stop(c);
+   }
+   return rc;
+}
+
+int machx_set_workers(void *cx, int n) {
+   Ctx *c = cx;
+   if (c == NULL || c->dctx == NULL || n < 0 || MACH_MAX_WORKERS < n) {
+      return MACH_SAD;
+   }
+   workers_stop(c);
+   if (n < 2) {
+      return MACH_OKAY;
+   }
+   return workers_start(c, n);
+}
+
+int mach_set_workers(int n) {
+   return machx_set_workers(ctx, n);
+}
+
+/* json_to_cbor replaces the JSON at the top of the stack with its
+   CBOR encoding. */
+static duk_ret_t json_to_cbor(duk_context *d, void *udata) {
+   duk_json_decode(d, -1);
+   duk_cbor_encode(d, -1, 0);
+   return 1;
+}
+
+/* workers_crew_process is mach_crew_process_buf for a context with
+   workers. */
+static int workers_crew_process(Ctx *c, const mach_buf *crew, const mach_buf *message, mach_buf *dst, int binary) {
+   WorkerPool *pool = c->workers;
+   int i, rc = MACH_OKAY;
+
+   /* The workers are idle, so their crews can be written. */
+   if (crew_split(crew, binary, pool->workers, pool->n) != MACH_OKAY) {
+      return MACH_SAD;
+   }
+
+   pthread_mutex_lock(&pool->lock);
+   pool->message = message;
+   pool->binary = binary;
+   pool->pending = pool->n;
+   pool->job++;
+   pthread_cond_broadcast(&pool->work);
+   while (0 < pool->pending) {
+      pthread_cond_wait(&pool->done, &pool->lock);
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   /* On this thread, as the handler expects. */
+   workers_emit(c);
+
+   /* Merge the workers' steppeds, which are JSON objects with
+      disjoint keys, in shard order. */
+   size_t need = 2;
+   for (i = 0; i < pool->n; i++) {
+      Worker *w = &pool->workers[i];
+      if (w->rc != MACH_OKAY) {
+         return w->rc;
+      }
+      need += w->out.len - 1;
+   }
+   if (mach_buf_reserve(dst, need) != MACH_OKAY) {
+      return MACH_SAD;
+   }
+   size_t at = 0;
+   dst->data[at++] = '{';
+   for (i = 0; i < pool->n; i++) {
+      Worker *w = &pool->workers[i];
+      /* Strip the braces. */
+      size_t n = w->out.len - 2;
+      if (0 < n) {
+         if (1 < at) {
+            dst->data[at++] = ',';
+         }
+         memcpy(dst->data + at, w->out.data + 1, n);
+         at += n;
+      }
+   }
+   dst->data[at++] = '}';
+   dst->data[at] = '\0';
+   dst->len = at;
+
+   if (binary) {
+      /* The main heap is idle, so it can do the encoding. */
+      duk_context *d = c->dctx;
+      duk_push_lstring(d, dst->data, dst->len);
+      if (duk_safe_call(d, json_to_cbor, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+         fprintf(stderr, "workers CBOR error %s\n", duk_safe_to_string(d, -1));
+         rc = MACH_SAD;
+      } else {
+         duk_size_t n;
+         const char *cbor = duk_get_buffer_data(d, -1, &n);
+         rc = mach_buf_set(dst, cbor, n);
+      }
+      duk_pop(d);
+   }
+
+   return rc;
 }
 
 static void load_and_register_functions(Ctx *ctx, const char *path) {
@@ -30,6 +30,44 @@ typedef char * S;
    is phonetially short for "meh-sheens", but I obviously didn't
    follow through with that brilliant idea. */
 
+/* mach_buf is a growable buffer.  Functions with the suffix "_buf"
+   take their JSON inputs as mach_bufs, so they don't need to be
+   null-terminated or measured, and write their outputs to mach_bufs,
+   which grow (via realloc) as needed, so large outputs never result
+   in MACH_TOO_BIG.  An output is always null-terminated, and len
+   doesn't count that null.  A mach_buf that's reused keeps its
+   storage, so a loop that reuses its buffers doesn't allocate once
+   they're big enough.
+
+   For example:
+
+     mach_buf steppeds = MACH_BUF_INIT;
+     mach_buf message = {line, strlen(line), 0};
+     mach_crew_process_buf(&crew, &message, &steppeds);
+     ...
+     mach_buf_free(&steppeds);
+
+   An input mach_buf's cap isn't used. */
+typedef struct mach_buf {
+   char *data;
+   size_t len;
+   size_t cap;
+} mach_buf;
+
+/* MACH_BUF_INIT initializes an empty mach_buf. */
+#define MACH_BUF_INIT {NULL, 0, 0}
+
+/* mach_buf_reserve makes sure the buffer can hold n bytes (plus a
+   null).  Returns MACH_SAD if it can't get the memory. */
+int mach_buf_reserve(mach_buf *b, size_t n) ;
+
+/* mach_buf_set copies the n bytes at s (plus a null) into the
+   buffer. */
+int mach_buf_set(mach_buf *b, const char *s, size_t n) ;
+
+/* mach_buf_free frees the buffer's storage and empties it. */
+void mach_buf_free(mach_buf *b) ;
+
 /* provider is the signature for a function that can resolve the given
    SpecName to Spec.  The first argument will be _ctx.  The second
    argument is a string that represents the JSON representation of the
@@ -37,6 +75,13 @@ typedef char * S;
    representation, then the provide can just return NULL. */
 typedef char * (*mach_provider)(void*, const char *, const char *);
 
+/* versioned_provider is like provider, but instead of the cached
+   spec's JSON it gets the version (an opaque token like an etag) that
+   it gave with that spec, or NULL if there isn't one.  If that
+   version is current, the provider can just return NULL.  The
+   provider can set the last argument to the spec's (new) version. */
+typedef char * (*mach_versioned_provider)(void*, const char *, const char *, char **);
+
 /* A generic mode type. */
 typedef unsigned int mach_mode;
 
@@ -59,8 +104,16 @@ void mach_set_ctx(void *c) ;
 /* mach_get_ctx just returns the (global) active context. */  
 void *mach_get_ctx() ;
 
-/* mach_open creates and initializes the runtime.  (Currently there is
-   only one global runtime.) */
+/* mach_set_bytecode chooses whether mach_open loads the driver's
+   precompiled bytecode (1, the default), when the library was built
+   with it, or compiles the driver's source (0).  Loading the bytecode
+   is faster.  If the bytecode doesn't load, mach_open uses the
+   source. */
+int mach_set_bytecode(int enable) ;
+
+/* mach_open creates and initializes the runtime for the active
+   context.  (See the machx_* functions below to use contexts
+   explicitly.) */
 int mach_open();
 
 /* mach_close frees the runtime. */
@@ -84,6 +137,43 @@ int mach_process(JSON state, JSON message, JSON dst, int limit);
    provider to be freed.  Use 0 if you don't want that. */
 void mach_set_spec_provider(void * ctx, mach_provider f, mach_mode m);
 
+/* mach_set_versioned_spec_provider is like mach_set_spec_provider
+   for a versioned provider.  With MACH_FREE_FOR_PROVIDER, the
+   returned version is freed, too. */
+void mach_set_versioned_spec_provider(void * ctx, mach_versioned_provider f, mach_mode m);
+
+/* mach_bundle_open maps the given spec bundle (see mkbundle.c) into
+   memory and returns a handle for it, or NULL if the file can't be
+   mapped or isn't a bundle.  The bundle's specs can then be provided
+   without reading or copying any files:
+
+     void *bundle = mach_bundle_open("specs.bundle");
+     mach_set_spec_provider(bundle, mach_bundle_provider, 0);
+     ...
+     mach_bundle_close(bundle);
+
+   Don't close the bundle while it's the provider. */
+void *mach_bundle_open(const char *filename) ;
+
+/* mach_bundle_close unmaps the bundle. */
+void mach_bundle_close(void *bundle) ;
+
+/* mach_bundle_count returns the number of specs in the bundle. */
+int mach_bundle_count(void *bundle) ;
+
+/* mach_bundle_name returns the name of the i-th spec in the bundle
+   (in name order), which is handy for mach_preload_specs. */
+const char *mach_bundle_name(void *bundle, int i) ;
+
+/* mach_bundle_get returns the named spec's JSON, which is in the
+   mapped bundle (so don't free it), or NULL if there's no such spec.
+   If len isn't NULL, the JSON's length is written there. */
+const char *mach_bundle_get(void *bundle, const char *name, size_t *len) ;
+
+/* mach_bundle_provider is a spec provider (use mode 0) whose context
+   is a bundle from mach_bundle_open. */
+char *mach_bundle_provider(void *bundle, const char *name, const char *cached) ;
+
 /* mach_eval is a utilty function that executes the given ECMAScript
    source and writes the result, which better be a string, to dst.
    Returns MACH_OKAY on success.
@@ -126,9 +216,100 @@ int mach_rem_machine(JSON crew, S id, JSON dst, size_t limit) ;
 int mach_crew_process(JSON crew, JSON message, JSON dst, size_t limit) ;
 
 /* mach_crew_update updates the Crew to reflect the net state changes
-   of the given steppeds (as written by mach_crew_process. */
+   of the given steppeds (as written by mach_crew_process.  Accepts
+   steppeds in either mode (see mach_set_steppeds_mode). */
 int mach_crew_update(JSON crew, JSON steppeds, JSON dst, size_t limit) ;
 
+/* mach_crew_process_batch gives the n messages, in order, to the
+   Crew, which is updated (as with mach_crew_update) after each
+   message.  Writes
+
+     {"crew":CREW,"emitted":[MESSAGE]}
+
+   to dst, where CREW is the final Crew and the emitted messages are
+   in the order they were emitted.  If statuses isn't NULL, it gets
+   each message's status (MACH_OKAY or MACH_SAD).  A message that
+   can't be processed (MACH_SAD) doesn't change the Crew. */
+int mach_crew_process_batch(JSON crew, JSON messages[], int n, JSON dst, size_t limit, int statuses[]) ;
+
+/* MACH_STEPPEDS_FULL is the steppeds mode where mach_crew_process
+   writes a stepped for every machine that saw the message, and each
+   stepped has the machine's complete new state. */
+#define MACH_STEPPEDS_FULL (0)
+
+/* MACH_STEPPEDS_CHANGED is the steppeds mode where mach_crew_process
+   only writes steppeds for machines that changed or emitted
+   something.  Each stepped has the form
+
+     {"diff":{"node":NODE,"set":{VAR:VALUE},"del":[VAR]},"emitted":[MESSAGE]}
+
+   where the new node and the changed and deleted bindings only
+   appear if there's something to report. */
+#define MACH_STEPPEDS_CHANGED (1)
+
+/* mach_set_steppeds_mode sets how mach_crew_process and
+   mach_crew_handle_process write steppeds.  The default is
+   MACH_STEPPEDS_FULL. */
+int mach_set_steppeds_mode(int mode) ;
+
+/* Resident crews: A resident crew stays parsed in the runtime between
+   calls and is updated in place, so a message doesn't cost parsing
+   and reserializing the whole crew.  A resident crew is identified by
+   a handle, which is only good until mach_crew_close or
+   mach_close. */
+
+/* mach_crew_open makes a resident crew from the given crew (as
+   written by mach_make_crew or mach_crew_export) and writes its
+   handle to h. */
+int mach_crew_open(JSON crew, int *h) ;
+
+/* mach_crew_close forgets the resident crew. */
+int mach_crew_close(int h) ;
+
+/* mach_crew_handle_process gives the message to the resident crew,
+   writes the steppeds (like mach_crew_process) to dst, and updates
+   the crew with those steppeds (like mach_crew_update). */
+int mach_crew_handle_process(int h, JSON message, JSON dst, size_t limit) ;
+
+/* mach_crew_handle_update applies steppeds that processing the
+   resident crew wrote earlier, as mach_crew_update would.  Replaying
+   logged steppeds this way recovers a crew without rerunning any
+   actions. */
+int mach_crew_handle_update(int h, JSON steppeds) ;
+
+/* mach_crew_handle_set_machine adds or updates a machine in the
+   resident crew. */
+int mach_crew_handle_set_machine(int h, S id, S specRef, JSON bindings, S node) ;
+
+/* mach_crew_handle_rem_machine removes the given machine from the
+   resident crew. */
+int mach_crew_handle_rem_machine(int h, S id) ;
+
+/* mach_crew_export writes the resident crew as JSON to dst (for
+   persistence). */
+int mach_crew_export(int h, JSON dst, size_t limit) ;
+
+/* mach_crew_import replaces the resident crew with the given crew
+   JSON. */
+int mach_crew_import(int h, JSON crew) ;
+
+/* mach_emit_handler is the signature for a function that gets each
+   emitted message as soon as a machine emits it.  The first argument
+   is the arg given to mach_set_emit_handler.  The second is the id of
+   the machine that emitted the message (or "" for mach_process), and
+   the third and fourth are the message (JSON) and its length.  The
+   strings are only good until the handler returns, and the handler
+   must not call mach_* functions with the same context. */
+typedef void (*mach_emit_handler)(void *, const char *, const char *, size_t);
+
+/* mach_set_emit_handler registers a function that gets each emitted
+   message, in order, while mach_process or a crew function processes
+   a message.  The emitted messages are still in the steppeds.  NULL
+   removes the handler.  When workers (see mach_set_workers) process
+   a crew, the handler gets the messages on the calling thread after
+   the workers finish, in shard order, and each machine's in order. */
+int mach_set_emit_handler(void *arg, mach_emit_handler f) ;
+
 /* mach_get_emitted just extracts emitted messages from the given
    steppeds map (as written by mach_crew_process). */
 int mach_get_emitted(JSON steppeds, JSON dsts[], int most, size_t limit) ;
@@ -146,6 +327,185 @@ int mach_clear_spec_cache() ;
 /* mach_enable_spec_cache enables (1) or disables (0) the spec cache. */
 int mach_enable_spec_cache(int enable) ;
 
+/* mach_set_spec_cache_bytes sets the most bytes (roughly: the specs'
+   source plus their compiled actions and guards) that the spec cache
+   holds, in addition to its entries limit.  Zero (the default) means
+   no byte limit.  The least recently used specs are evicted first. */
+int mach_set_spec_cache_bytes(size_t bytes) ;
+
+/* mach_spec_cache_stats writes the spec cache's statistics as JSON to
+   dst:
+
+     {"size":N,"limit":N,"bytes":N,"byteLimit":N,"hits":N,"misses":N,
+      "evictions":N,"enabled":BOOL,
+      "entries":[{"name":NAME,"bytes":N,"hits":N}]}
+
+   with the entries ordered from most to least recently used. */
+int mach_spec_cache_stats(JSON dst, size_t limit) ;
+
+/* mach_set_spec_ttl sets how many milliseconds a cached spec is used
+   without asking the spec provider about it again.  The default, 0,
+   means a cached spec is used until it's invalidated, so a cache hit
+   doesn't call the provider at all. */
+int mach_set_spec_ttl(int ms) ;
+
+/* mach_invalidate_spec marks the named cached spec (or every cached
+   spec if name is NULL) stale, so the next use of the spec asks the
+   provider whether it has changed.  If it has, resident crews'
+   machines that use it are reindexed. */
+int mach_invalidate_spec(S name) ;
+
+/* MACH_PRELOAD_THREADS is the most threads (in addition to the
+   caller's) that mach_preload_specs uses to fetch specs. */
+#define MACH_PRELOAD_THREADS (8)
+
+/* mach_preload_specs fetches the n named specs from the spec
+   provider, using several threads, and then parses, compiles, and
+   caches them (and, if there are workers, does the same in each
+   worker's heap on its own thread).  Call it before traffic starts so
+   the first messages for these specs don't pay for fetching and
+   compiling.  The spec cache must be enabled, and the provider must
+   be safe to call from several threads at once.  Writes a JSON report
+   to dst:
+
+     {"specs":[{"name":NAME,"fetchMs":MS,"compileMs":MS},...],"ms":MS}
+
+   A spec that couldn't be loaded has an "error" instead of
+   "compileMs". */
+int mach_preload_specs(S names[], int n, JSON dst, size_t limit) ;
+
+/* MACH_DEFAULT_SANDBOX_POOL_SIZE is the default number of idle
+   sandbox heaps kept for reuse by actions and guards. */
+#define MACH_DEFAULT_SANDBOX_POOL_SIZE (4)
+
+/* MACH_MAX_SANDBOX_POOL_SIZE is the largest allowed sandbox pool
+   size. */
+#define MACH_MAX_SANDBOX_POOL_SIZE (64)
+
+/* mach_set_sandbox_pool_size sets the number of idle sandbox heaps
+   that are kept for reuse.  A pooled heap has its globals and
+   built-ins reset after each action or guard, so an action sees what
+   it would see in a brand new heap, except that a pooled heap's
+   built-in properties are unconfigurable (an action can reassign
+   Array.prototype.map, but it can't delete it).  Zero disables the
+   pool, so every action and guard gets a brand new heap. */
+int mach_set_sandbox_pool_size(int n) ;
+
+/* mach_sandbox_pool_stats writes sandbox pool statistics (size, idle
+   heaps, calls, heaps created, reused, and retired) as JSON to
+   dst. */
+int mach_sandbox_pool_stats(JSON dst, size_t limit) ;
+
+/* The following functions are the mach_buf (see above) versions of
+   the functions with the same names without the "_buf" suffix.  Their
+   crews, states, messages, and steppeds are in the context's format
+   (see mach_set_format). */
+
+int mach_eval_buf(const mach_buf *src, mach_buf *dst) ;
+int mach_process_buf(const mach_buf *state, const mach_buf *message, mach_buf *dst) ;
+int mach_crew_process_buf(const mach_buf *crew, const mach_buf *message, mach_buf *dst) ;
+int mach_crew_update_buf(const mach_buf *crew, const mach_buf *steppeds, mach_buf *dst) ;
+int mach_crew_process_batch_buf(const mach_buf *crew, const mach_buf messages[], int n, mach_buf *dst, int statuses[]) ;
+int mach_crew_open_buf(const mach_buf *crew, int *h) ;
+int mach_crew_handle_process_buf(int h, const mach_buf *message, mach_buf *dst) ;
+int mach_crew_handle_update_buf(int h, const mach_buf *steppeds) ;
+int mach_crew_export_buf(int h, mach_buf *dst) ;
+int mach_crew_import_buf(int h, const mach_buf *crew) ;
+
+/* Formats for mach_set_format. */
+#define MACH_FORMAT_JSON (0)
+#define MACH_FORMAT_CBOR (1)
+
+/* mach_set_format sets the format of the crews, states, messages, and
+   steppeds that go through the _buf functions (except mach_eval_buf):
+   MACH_FORMAT_JSON (the default) or MACH_FORMAT_CBOR (RFC 8949), which
+   is decoded and encoded by Duktape's CBOR codec.  With CBOR, an
+   embedder that keeps crews in binary doesn't have to convert them to
+   and from JSON text.  The other functions always use JSON, as do
+   emitted messages that go to an emit handler. */
+int mach_set_format(int format) ;
+
+/* MACH_MAX_WORKERS is the largest allowed number of workers. */
+#define MACH_MAX_WORKERS (256)
+
+/* mach_set_workers gives mach_crew_process a pool of n threads, each
+   with its own heap, that process disjoint shards of a crew's
+   machines in parallel.  The steppeds are merged in shard order (and
+   in crew order within a shard).  The calling thread splits the
+   crew's JSON (or CBOR) without decoding it, so each worker only
+   decodes its own shard.  Zero or one stops the pool, so
+   crews are processed on the calling thread again.  Each worker heap
+   starts with the current configuration, and mach_set_steppeds_mode
+   and the spec cache functions also apply to the workers.  The spec
+   provider must be safe to call from several threads at once.  Only
+   mach_crew_process uses the workers; resident crews are processed
+   on the calling thread. */
+int mach_set_workers(int n) ;
+
+/* The machx_* functions are the explicit-context versions of the
+   mach_* functions with the same names: each takes a context (from
+   mach_make_ctx) as its first argument and uses that context instead
+   of the global one, which these functions never touch.  Different
+   threads can use different contexts at the same time, but a context
+   must not be used by more than one thread at a time.  For example:
+
+     void *ctx = mach_make_ctx();
+     machx_open(ctx);
+     machx_set_spec_provider(ctx, NULL, specProvider, MACH_FREE_FOR_PROVIDER);
+     ...
+     machx_close(ctx);
+     free(ctx);
+
+   */
+void machx_set_spec_provider(void *ctx, void *pctx, mach_provider f, mach_mode m) ;
+void machx_set_versioned_spec_provider(void *ctx, void *pctx, mach_versioned_provider f, mach_mode m) ;
+int machx_set_sandbox_pool_size(void *ctx, int n) ;
+int machx_sandbox_pool_stats(void *ctx, JSON dst, size_t limit) ;
+int machx_open(void *ctx) ;
+void machx_close(void *ctx) ;
+int machx_eval(void *ctx, char *src, JSON dst, int limit) ;
+int machx_process(void *ctx, JSON state, JSON message, JSON dst, int limit) ;
+int machx_match(void *ctx, JSON pattern, JSON message, JSON bindings, JSON dst, int limit) ;
+int machx_set_spec_cache_limit(void *ctx, int limit) ;
+int machx_set_steppeds_mode(void *ctx, int mode) ;
+int machx_enable_spec_cache(void *ctx, int enable) ;
+int machx_clear_spec_cache(void *ctx) ;
+int machx_set_spec_cache_bytes(void *ctx, size_t bytes) ;
+int machx_spec_cache_stats(void *ctx, JSON dst, size_t limit) ;
+int machx_set_spec_ttl(void *ctx, int ms) ;
+int machx_invalidate_spec(void *ctx, S name) ;
+int machx_preload_specs(void *ctx, S names[], int n, JSON dst, size_t limit) ;
+int machx_set_machine(void *ctx, JSON crew, S id, S specRef, JSON bindings, S node, JSON dst, size_t limit) ;
+int machx_rem_machine(void *ctx, JSON crew, S id, JSON dst, size_t limit) ;
+int machx_crew_process(void *ctx, JSON crew, JSON message, JSON dst, size_t limit) ;
+int machx_get_emitted(void *ctx, JSON steppeds, JSON dsts[], int most, size_t limit) ;
+int machx_do_emitted(void *ctx, JSON steppeds, int (*f)(JSON)) ;
+int machx_crew_update(void *ctx, JSON crew, JSON stepped, JSON dst, size_t limit) ;
+int machx_crew_process_batch(void *ctx, JSON crew, JSON messages[], int n, JSON dst, size_t limit, int statuses[]) ;
+int machx_crew_open(void *ctx, JSON crew, int *h) ;
+int machx_crew_close(void *ctx, int h) ;
+int machx_crew_handle_process(void *ctx, int h, JSON message, JSON dst, size_t limit) ;
+int machx_crew_handle_update(void *ctx, int h, JSON steppeds) ;
+int machx_crew_handle_set_machine(void *ctx, int h, S id, S specRef, JSON bindings, S node) ;
+int machx_crew_handle_rem_machine(void *ctx, int h, S id) ;
+int machx_crew_export(void *ctx, int h, JSON dst, size_t limit) ;
+int machx_crew_import(void *ctx, int h, JSON crew) ;
+int machx_set_workers(void *ctx, int n) ;
+int machx_set_emit_handler(void *ctx, void *arg, mach_emit_handler f) ;
+int machx_set_bytecode(void *ctx, int enable) ;
+int machx_eval_buf(void *ctx, const mach_buf *src, mach_buf *dst) ;
+int machx_process_buf(void *ctx, const mach_buf *state, const mach_buf *message, mach_buf *dst) ;
+int machx_crew_process_buf(void *ctx, const mach_buf *crew, const mach_buf *message, mach_buf *dst) ;
+int machx_crew_update_buf(void *ctx, const mach_buf *crew, const mach_buf *steppeds, mach_buf *dst) ;
+int machx_crew_process_batch_buf(void *ctx, const mach_buf *crew, const mach_buf messages[], int n, mach_buf *dst, int statuses[]) ;
+int machx_crew_open_buf(void *ctx, const mach_buf *crew, int *h) ;
+int machx_crew_handle_process_buf(void *ctx, int h, const mach_buf *message, mach_buf *dst) ;
+int machx_crew_handle_update_buf(void *ctx, int h, const mach_buf *steppeds) ;
+int machx_crew_export_buf(void *ctx, int h, mach_buf *dst) ;
+int machx_crew_import_buf(void *ctx, int h, const mach_buf *crew) ;
+int machx_set_format(void *ctx, int format) ;
+void machx_dump_stack(void *ctx, FILE *out, char *tag) ;
+
 /* A utility for seeing the current Duktape stack. */
 void mach_dump_stack(FILE *out, char *tag);
 
@@ -11,3 +11,7 @@
  */
 
 char *mach_machines_js();
+
+/* The driver's bytecode (see dumpjs.c), which can be empty. */
+unsigned char *mach_machines_jsbc();
+unsigned int mach_machines_jsbc_len();
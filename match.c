@@ -0,0 +1,675 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A C implementation of Sheens pattern matching that works directly
+   on Duktape values.
+
+   This code is a port of 'js/match.js', and it should stay that way:
+   same results, same errors, same quirks.
+
+   Sets of bindings are ECMAScript arrays of objects, and every
+   function below pushes its result onto the value stack.  As in
+   match.js, bindings share structure while matching: extend pushes
+   an object with just the new binding whose prototype is the parent
+   bindings, and mach_native_match flattens what it returns.
+
+   A compiled pattern (see CompiledPattern in match.js) comes with its
+   inequality variables, so variables in it aren't rescanned for
+   operators at every step. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "duktape.h"
+#include "match.h"
+
+/* Matcher is what a match needs besides its arguments. */
+typedef struct {
+   /* ieqs is the index of the compiled pattern's inequality
+      variables ({VAR: {ieq: OP, base: VAR}}, or null if it has none),
+      or DUK_INVALID_INDEX if the pattern wasn't compiled. */
+   duk_idx_t ieqs;
+   /* in_pattern is 1 unless the pattern being matched is a value
+      from the bindings, whose variables aren't in ieqs. */
+   int in_pattern;
+   /* allocs counts the objects, arrays, and buffers that the match
+      makes. */
+   duk_uint_t allocs;
+   /* literals is 0 if array patterns shouldn't use Literals (for
+      benchmarks). */
+   int literals;
+} Matcher;
+
+/* Literals indexes the elements of a message array, so that a literal
+   string in an array pattern only tries the elements that could equal
+   it: that string, or anything that isn't a string ('==' at work).
+   See literalCandidates in match.js. */
+typedef struct {
+   const char *s;
+   duk_size_t n;
+   duk_uarridx_t i;
+} Literal;
+
+typedef struct {
+   /* strings has the message's strings, ordered by string and then
+      by index, or is NULL if the pattern has no literal strings. */
+   Literal *strings;
+   duk_size_t nstrings;
+   /* others has the indexes of everything else, in order. */
+   duk_uarridx_t *others;
+   duk_size_t nothers;
+} Literals;
+
+static void match(duk_context *d, Matcher *mt, duk_idx_t p, duk_idx_t m, duk_idx_t bs);
+
+/* var_name returns the string at idx if it's a pattern variable (a
+   string that starts with '?'). */
+static const char *var_name(duk_context *d, duk_idx_t idx, duk_size_t *n) {
+   if (!duk_is_string(d, idx)) {
+      return NULL;
+   }
+   const char *s = duk_get_lstring(d, idx, n);
+   if (*n == 0 || s[0] != '?') {
+      return NULL;
+   }
+   return s;
+}
+
+static int is_var(duk_context *d, duk_idx_t idx) {
+   duk_size_t n;
+   return var_name(d, idx, &n) != NULL;
+}
+
+static int is_opt_var(duk_context *d, duk_idx_t idx) {
+   duk_size_t n;
+   const char *s = var_name(d, idx, &n);
+   return s != NULL && 2 <= n && s[1] == '?';
+}
+
+/* is_object is 'typeof x == "object"'. */
+static int is_object(duk_context *d, duk_idx_t idx) {
+   switch (duk_get_type(d, idx)) {
+   case DUK_TYPE_NULL:
+   case DUK_TYPE_BUFFER:
+      return 1;
+   case DUK_TYPE_OBJECT:
+      return !duk_is_function(d, idx);
+   default:
+      return 0;
+   }
+}
+
+static int truthy(duk_context *d, duk_idx_t idx) {
+   duk_dup(d, idx);
+   int b = duk_to_boolean(d, -1);
+   duk_pop(d);
+   return b;
+}
+
+static void throw_string(duk_context *d, const char *msg) {
+   duk_push_string(d, msg);
+   (void)duk_throw(d);
+}
+
+/* push_array is duk_push_array, counted. */
+static duk_idx_t push_array(duk_context *d, Matcher *mt) {
+   mt->allocs++;
+   return duk_push_array(d);
+}
+
+/* push_singleton pushes [x]. */
+static void push_singleton(duk_context *d, Matcher *mt, duk_idx_t x) {
+   push_array(d, mt);
+   duk_dup(d, x);
+   duk_put_prop_index(d, -2, 0);
+}
+
+/* append pushes the elements of the array at 'from' onto the array at
+   'to'. */
+static void append(duk_context *d, duk_idx_t to, duk_idx_t from) {
+   duk_size_t i, n = duk_get_length(d, from);
+   duk_uarridx_t at = (duk_uarridx_t)duk_get_length(d, to);
+   for (i = 0; i < n; i++) {
+      duk_get_prop_index(d, from, (duk_uarridx_t)i);
+      duk_put_prop_index(d, to, at++);
+   }
+}
+
+/* extend pushes bindings that are bs plus the binding from the key at
+   'b' to the value at 'v'.  The result inherits bs's bindings. */
+static void extend(duk_context *d, Matcher *mt, duk_idx_t bs, duk_idx_t b, duk_idx_t v) {
+   mt->allocs++;
+   duk_idx_t acc = duk_push_object(d);
+   duk_dup(d, bs);
+   duk_set_prototype(d, acc);
+   duk_dup(d, b);
+   duk_dup(d, v);
+   duk_put_prop(d, acc);
+}
+
+/* inequal handles variables like '?<n', which match numbers that are
+   less than the number bound to '?<n'.  If the variable applies,
+   pushes the sets of bindings and returns 1.  Otherwise returns 0
+   without pushing anything. */
+static int inequal(duk_context *d, Matcher *mt, duk_idx_t m, duk_idx_t bs, duk_idx_t v) {
+   static const char *ieqs[] = {"<=", ">=", "!=", ">", "<", NULL};
+   duk_idx_t top = duk_get_top(d);
+   duk_idx_t info = DUK_INVALID_INDEX;
+   duk_size_t n;
+   const char *s = var_name(d, v, &n);
+   const char *ieq = NULL;
+   duk_size_t ieqn = 0;
+   int i;
+
+   if (s == NULL || !duk_is_number(d, m)) {
+      return 0;
+   }
+
+   if (mt->in_pattern && mt->ieqs != DUK_INVALID_INDEX) {
+      /* The compiled pattern says which of its variables have
+         operators. */
+      if (duk_is_null(d, mt->ieqs)) {
+         return 0;
+      }
+      duk_dup(d, v);
+      if (!duk_get_prop(d, mt->ieqs)) {
+         duk_pop(d);
+         return 0;
+      }
+      info = top;
+      duk_get_prop_string(d, info, "ieq");
+      ieq = duk_get_string(d, -1);
+   } else {
+      for (i = 0; ieqs[i] != NULL; i++) {
+         ieqn = strlen(ieqs[i]);
+         if (1 + ieqn <= n && memcmp(s + 1, ieqs[i], ieqn) == 0) {
+            ieq = ieqs[i];
+            break;
+         }
+      }
+   }
+   if (ieq == NULL) {
+      duk_set_top(d, top);
+      return 0;
+   }
+
+   duk_dup(d, v);
+   duk_get_prop(d, bs);
+   if (!duk_is_number(d, -1)) {
+      duk_set_top(d, top);
+      return 0;
+   }
+   duk_double_t x = duk_get_number(d, -1);
+   duk_pop(d);
+   duk_double_t y = duk_get_number(d, m);
+
+   int satisfied;
+   switch (ieq[0]) {
+   case '<':
+      satisfied = ieq[1] == '=' ? y <= x : y < x;
+      break;
+   case '>':
+      satisfied = ieq[1] == '=' ? y >= x : y > x;
+      break;
+   default: /* "!=" */
+      satisfied = y != x;
+   }
+
+   if (!satisfied) {
+      duk_set_top(d, top);
+      push_array(d, mt);
+      return 1;
+   }
+
+   /* vv is the plain variable: "?" + what follows the operator. */
+   if (info != DUK_INVALID_INDEX) {
+      duk_get_prop_string(d, info, "base");
+   } else {
+      duk_push_string(d, "?");
+      duk_push_lstring(d, s + 1 + ieqn, n - 1 - ieqn);
+      duk_concat(d, 2);
+   }
+   duk_idx_t vv = duk_get_top(d) - 1;
+
+   duk_dup(d, vv);
+   duk_get_prop(d, bs);
+   if (!duk_is_undefined(d, -1)) {
+      if (!duk_is_number(d, -1)) {
+         duk_set_top(d, top);
+         return 0;
+      }
+      int same = duk_get_number(d, -1) == y;
+      duk_set_top(d, top);
+      if (same) {
+         push_singleton(d, mt, bs);
+      } else {
+         push_array(d, mt);
+      }
+      return 1;
+   }
+   duk_pop(d);
+
+   push_array(d, mt);
+   extend(d, mt, bs, vv, m);
+   duk_put_prop_index(d, -2, 0);
+   duk_insert(d, top);
+   duk_set_top(d, top + 1);
+
+   return 1;
+}
+
+/* match_with_bindings pushes the concatenation of matching v against
+   mv with each set of bindings in bss. */
+static void match_with_bindings(duk_context *d, Matcher *mt, duk_idx_t bss, duk_idx_t v, duk_idx_t mv) {
+   duk_idx_t acc = push_array(d, mt);
+   duk_size_t i, n = duk_get_length(d, bss);
+   for (i = 0; i < n; i++) {
+      duk_get_prop_index(d, bss, (duk_uarridx_t)i);
+      match(d, mt, v, mv, duk_get_top(d) - 1);
+      append(d, acc, -1);
+      duk_pop_2(d);
+   }
+}
+
+/* arraycat_match matches p[poff:] against the elements of m that
+   aren't marked in 'used'.  An array is a set, not a list.
+
+   The pattern offset for the recursive call is 'poff + i + 1', where
+   i is the index of the current set of bindings.  That's what
+   match.js does ('p.slice(i+1)'), so that's what we do. */
+static int compare_literals(const void *a, const void *b) {
+   const Literal *x = a, *y = b;
+   int c = memcmp(x->s, y->s, x->n < y->n ? x->n : y->n);
+   if (c != 0) {
+      return c;
+   }
+   if (x->n != y->n) {
+      return x->n < y->n ? -1 : 1;
+   }
+   return x->i < y->i ? -1 : x->i > y->i;
+}
+
+/* index_literals fills in lits for the message array m if the array
+   pattern p has a literal string.  Pushes the buffer that holds the
+   index (or undefined). */
+static void index_literals(duk_context *d, Matcher *mt, duk_idx_t p, duk_idx_t m, Literals *lits) {
+   duk_size_t k, np = duk_get_length(d, p);
+   duk_size_t j, nm = duk_get_length(d, m);
+   int any = 0;
+
+   memset(lits, 0, sizeof(*lits));
+   for (k = 0; mt->literals && !any && k < np; k++) {
+      duk_get_prop_index(d, p, (duk_uarridx_t)k);
+      any = duk_is_string(d, -1) && !is_var(d, -1);
+      duk_pop(d);
+   }
+   if (!any) {
+      duk_push_undefined(d);
+      return;
+   }
+
+   mt->allocs++;
+   lits->strings = duk_push_fixed_buffer(d, nm * (sizeof(Literal) + sizeof(duk_uarridx_t)) + 1);
+   lits->others = (duk_uarridx_t *)(lits->strings + nm);
+   for (j = 0; j < nm; j++) {
+      duk_get_prop_index(d, m, (duk_uarridx_t)j);
+      if (duk_is_string(d, -1)) {
+         /* m holds on to the string. */
+         Literal *l = &lits->strings[lits->nstrings++];
+         l->s = duk_get_lstring(d, -1, &l->n);
+         l->i = (duk_uarridx_t)j;
+      } else {
+         lits->others[lits->nothers++] = (duk_uarridx_t)j;
+      }
+      duk_pop(d);
+   }
+   qsort(lits->strings, lits->nstrings, sizeof(Literal), compare_literals);
+}
+
+/* find_literal returns the first of the n strings in lits that equal
+   the string at idx, and sets n. */
+static Literal *find_literal(duk_context *d, Literals *lits, duk_idx_t idx, duk_size_t *n) {
+   Literal key;
+   duk_size_t lo = 0, hi = lits->nstrings, end;
+
+   key.s = duk_get_lstring(d, idx, &key.n);
+   key.i = 0;
+   while (lo < hi) {
+      duk_size_t mid = lo + (hi - lo) / 2;
+      if (compare_literals(&lits->strings[mid], &key) < 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   for (end = lo; end < lits->nstrings; end++) {
+      if (lits->strings[end].n != key.n || memcmp(lits->strings[end].s, key.s, key.n) != 0) {
+         break;
+      }
+   }
+   *n = end - lo;
+   return &lits->strings[lo];
+}
+
+/* var_at returns 1 if the array p has a variable at position k. */
+static int var_at(duk_context *d, duk_idx_t p, duk_size_t k) {
+   int v;
+   if (duk_get_length(d, p) <= k) {
+      return 0;
+   }
+   duk_get_prop_index(d, p, (duk_uarridx_t)k);
+   v = is_var(d, -1);
+   duk_pop(d);
+   return v;
+}
+
+static void arraycat_match(duk_context *d, Matcher *mt, duk_idx_t bss, duk_idx_t p, duk_size_t poff,
+                           duk_idx_t m, unsigned char *used, Literals *lits, int var_count) {
+   duk_require_stack(d, 8);
+
+   if (duk_get_length(d, p) <= poff) {
+      /* An empty pattern array matches any array. */
+      duk_dup(d, bss);
+      return;
+   }
+
+   duk_get_prop_index(d, p, (duk_uarridx_t)poff);
+   duk_idx_t y = duk_get_top(d) - 1;
+   if (is_var(d, y)) {
+      if (0 < var_count) {
+         throw_string(d, "can't have more than one variable in array");
+      }
+      var_count++;
+   }
+
+   /* A literal string only tries the elements that could equal it. */
+   Literal *eqs = NULL;
+   duk_size_t neqs = 0;
+   if (lits->strings != NULL && duk_is_string(d, y) && !is_var(d, y)) {
+      eqs = find_literal(d, lits, y, &neqs);
+   }
+
+   duk_idx_t acc = push_array(d, mt);
+   duk_size_t i, nbss = duk_get_length(d, bss);
+   duk_size_t nm = duk_get_length(d, m);
+   for (i = 0; i < nbss; i++) {
+      duk_get_prop_index(d, bss, (duk_uarridx_t)i);
+      duk_idx_t bs = duk_get_top(d) - 1;
+      int some = 0;
+      /* Skipping an element of m skips the check for a second
+         variable that the rest of the pattern would make, so only
+         skip when that check wouldn't throw. */
+      int skip = eqs != NULL && !(0 < var_count && var_at(d, p, poff + i + 1));
+      duk_size_t a = 0, b = 0, c = 0;
+      for (;;) {
+         duk_uarridx_t j;
+         if (!skip) {
+            if (nm <= c) {
+               break;
+            }
+            j = (duk_uarridx_t)c++;
+         } else if (a < neqs && (b == lits->nothers || eqs[a].i < lits->others[b])) {
+            j = eqs[a++].i;
+         } else if (b < lits->nothers) {
+            j = lits->others[b++];
+         } else {
+            break;
+         }
+         if (used[j]) {
+            continue;
+         }
+         duk_get_prop_index(d, m, j);
+         match(d, mt, y, duk_get_top(d) - 1, bs);
+         used[j] = 1;
+         arraycat_match(d, mt, duk_get_top(d) - 1, p, poff + i + 1, m, used, lits, var_count);
+         used[j] = 0;
+         if (0 < duk_get_length(d, -1)) {
+            append(d, acc, -1);
+            some = 1;
+         }
+         duk_pop_3(d);
+      }
+      if (!some && is_opt_var(d, y)) {
+         duk_dup(d, bs);
+         duk_put_prop_index(d, acc, (duk_uarridx_t)duk_get_length(d, acc));
+      }
+      duk_pop(d);
+   }
+
+   duk_remove(d, y);
+}
+
+static void mapcat_match(duk_context *d, Matcher *mt, duk_idx_t bss, duk_idx_t p, duk_idx_t m) {
+   int var_count = 0;
+
+   duk_require_stack(d, 12);
+   duk_dup(d, bss);
+   bss = duk_get_top(d) - 1;
+
+   duk_enum(d, p, 0);
+   while (duk_next(d, -1, 1)) {
+      duk_idx_t k = duk_get_top(d) - 2;
+      duk_idx_t v = duk_get_top(d) - 1;
+      if (is_var(d, k)) {
+         if (0 < var_count) {
+            throw_string(d, "can't have more than one property variable");
+         }
+         var_count++;
+         duk_idx_t acc = push_array(d, mt);
+         if (!duk_is_null(d, m)) {
+            duk_enum(d, m, 0);
+            while (duk_next(d, -1, 1)) {
+               duk_idx_t mk = duk_get_top(d) - 2;
+               duk_idx_t mv = duk_get_top(d) - 1;
+               match_with_bindings(d, mt, bss, k, mk);
+               if (0 < duk_get_length(d, -1)) {
+                  match_with_bindings(d, mt, duk_get_top(d) - 1, v, mv);
+                  append(d, acc, -1);
+                  duk_pop(d);
+               }
+               duk_pop_3(d);
+            }
+            duk_pop(d);
+         }
+         duk_replace(d, bss);
+      } else {
+         if (duk_is_null(d, m)) {
+            duk_error(d, DUK_ERR_TYPE_ERROR, "cannot read property of null");
+         }
+         duk_dup(d, k);
+         duk_get_prop(d, m);
+         if (duk_is_undefined(d, -1)) {
+            if (is_opt_var(d, v)) {
+               duk_pop_3(d);
+               continue;
+            }
+            duk_pop_n(d, 5);
+            push_array(d, mt);
+            return;
+         }
+         match_with_bindings(d, mt, bss, v, duk_get_top(d) - 1);
+         if (duk_get_length(d, -1) == 0) {
+            duk_replace(d, bss);
+            duk_pop_n(d, 4);
+            return;
+         }
+         duk_replace(d, bss);
+         duk_pop(d);
+      }
+      duk_pop_2(d);
+   }
+   duk_pop(d);
+}
+
+static void match(duk_context *d, Matcher *mt, duk_idx_t p, duk_idx_t m, duk_idx_t bs) {
+   duk_size_t n;
+   const char *s = var_name(d, p, &n);
+
+   duk_require_stack(d, 8);
+
+   if (s != NULL) {
+      if (n == 1) {
+         /* Anonymous variable */
+         push_singleton(d, mt, bs);
+         return;
+      }
+      if (inequal(d, mt, m, bs, p)) {
+         return;
+      }
+      duk_dup(d, p);
+      duk_get_prop(d, bs);
+      if (truthy(d, -1)) {
+         /* The bound value becomes the pattern. */
+         int in_pattern = mt->in_pattern;
+         mt->in_pattern = 0;
+         match(d, mt, duk_get_top(d) - 1, m, bs);
+         mt->in_pattern = in_pattern;
+         duk_remove(d, -2);
+         return;
+      }
+      duk_pop(d);
+      push_array(d, mt);
+      extend(d, mt, bs, p, m);
+      duk_put_prop_index(d, -2, 0);
+      return;
+   }
+
+   if (!is_object(d, p)) {
+      if (duk_equals(d, p, m)) {
+         push_singleton(d, mt, bs);
+      } else {
+         push_array(d, mt);
+      }
+      return;
+   }
+
+   if (duk_is_array(d, p)) {
+      if (!duk_is_array(d, m)) {
+         push_array(d, mt);
+         return;
+      }
+      push_singleton(d, mt, bs);
+      mt->allocs++;
+      unsigned char *used = duk_push_fixed_buffer(d, duk_get_length(d, m) + 1);
+      memset(used, 0, duk_get_length(d, m) + 1);
+      Literals lits;
+      index_literals(d, mt, p, m, &lits);
+      arraycat_match(d, mt, duk_get_top(d) - 3, p, 0, m, used, &lits, 0);
+      duk_remove(d, -2);
+      duk_remove(d, -2);
+      duk_remove(d, -2);
+      return;
+   }
+
+   if (!is_object(d, m) || duk_is_null(d, p)) {
+      push_array(d, mt);
+      return;
+   }
+
+   duk_get_prop_string(d, p, "length");
+   duk_push_int(d, 0);
+   int empty = duk_equals(d, -2, -1);
+   duk_pop_2(d);
+   if (empty) {
+      push_singleton(d, mt, bs);
+      return;
+   }
+
+   push_singleton(d, mt, bs);
+   mapcat_match(d, mt, duk_get_top(d) - 1, p, m);
+   duk_remove(d, -2);
+}
+
+/* flatten pushes a plain object with the bindings of the bindings at
+   bs, which extend built on top of base.  Bindings are in the order
+   they were added, just like copying an object and then adding
+   properties. */
+static void flatten(duk_context *d, Matcher *mt, duk_idx_t bs, duk_idx_t base) {
+   duk_idx_t top = duk_get_top(d);
+   duk_idx_t i;
+
+   duk_require_stack(d, 8);
+   duk_dup(d, bs);
+   while (!duk_strict_equals(d, -1, base) && duk_is_object(d, -1)) {
+      duk_require_stack(d, 8);
+      duk_get_prototype(d, -1);
+   }
+   duk_pop(d);
+
+   /* Stack: top: bs, the next oldest frame, ..., the oldest frame. */
+   mt->allocs++;
+   duk_idx_t acc = duk_push_object(d);
+   duk_enum(d, base, 0);
+   while (duk_next(d, -1, 1)) {
+      duk_put_prop(d, acc);
+   }
+   duk_pop(d);
+   for (i = acc - 1; top <= i; i--) {
+      duk_enum(d, i, DUK_ENUM_OWN_PROPERTIES_ONLY);
+      while (duk_next(d, -1, 1)) {
+         duk_put_prop(d, acc);
+      }
+      duk_pop(d);
+   }
+
+   duk_replace(d, top);
+   duk_set_top(d, top + 1);
+}
+
+duk_ret_t mach_native_match(duk_context *d) {
+   Matcher mt;
+   duk_uarridx_t i;
+
+   duk_set_top(d, 6);
+   if (!truthy(d, 3)) {
+      duk_push_array(d);
+      duk_replace(d, 3);
+   }
+   mt.ieqs = duk_is_undefined(d, 4) ? DUK_INVALID_INDEX : 4;
+   mt.in_pattern = 1;
+   mt.allocs = 0;
+   mt.literals = 1;
+   if (duk_is_object(d, 5)) {
+      duk_get_prop_string(d, 5, "literals");
+      mt.literals = !(duk_is_boolean(d, -1) && !duk_get_boolean(d, -1));
+      duk_pop(d);
+   }
+
+   /* Bindings extend a base object.  match.js would treat bindings
+      that aren't an object as empty. */
+   if (duk_is_object(d, 3)) {
+      duk_dup(d, 3);
+   } else {
+      duk_push_object(d);
+   }
+
+   match(d, &mt, 1, 2, 6);
+
+   duk_size_t n = duk_get_length(d, 7);
+   for (i = 0; i < n; i++) {
+      duk_get_prop_index(d, 7, i);
+      if (duk_strict_equals(d, 8, 6)) {
+         duk_dup(d, 3);
+      } else {
+         flatten(d, &mt, 8, 6);
+      }
+      duk_put_prop_index(d, 7, i);
+      duk_pop(d);
+   }
+
+   if (duk_is_object(d, 5)) {
+      duk_push_uint(d, mt.allocs);
+      duk_put_prop_string(d, 5, "allocs");
+   }
+
+   return 1;
+}
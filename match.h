@@ -0,0 +1,25 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* mach_native_match is the native implementation of 'match' from
+   'js/match.js'.  Same arguments (CTX, P, M, BS) and same result (an
+   array of sets of bindings).  Exposed to ECMAScript as
+   'nativeMatch'.
+
+   An optional fifth argument, IEQS, says that P came from a
+   CompiledPattern and gives its inequality variables (see
+   CompiledPattern.ieqs).  If a sixth argument, OPTS, is an object,
+   its 'allocs' property is set to the number of objects, arrays, and
+   buffers that the match made, and a false 'literals' property keeps
+   array patterns from indexing the message's strings (for
+   benchmarks). */
+duk_ret_t mach_native_match(duk_context *dctx);
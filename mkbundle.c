@@ -0,0 +1,168 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Build tool that packs specs into one indexed bundle file, which
+   mach_bundle_open maps into memory (see bundle.c for the layout).
+
+   Usage: mkbundle OUT.bundle SPEC...
+
+   Each SPEC is a file of spec JSON, and the spec's name is the file's
+   name without its directory or ".js", so "specs/double.js" is
+   "double".  Use NAME=FILE to give a spec some other name.
+
+   Each spec is parsed (so a bad spec fails the build rather than a
+   message) and stored as compact JSON, which is quicker to parse than
+   the indented JSON in specs/. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "duktape.h"
+
+typedef struct {
+  char *name;
+  char *json;
+  size_t len;
+} Spec;
+
+static char *readAll(const char *filename, long *length) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    fprintf(stderr, "couldn't read '%s'\n", filename);
+    exit(1);
+  }
+  fseek(in, 0, SEEK_END);
+  *length = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  char *buf = malloc(*length + 1);
+  if (buf == NULL || fread(buf, 1, *length, in) != *length) {
+    fprintf(stderr, "couldn't read '%s'\n", filename);
+    exit(1);
+  }
+  buf[*length] = '\0';
+  fclose(in);
+  return buf;
+}
+
+/* compact parses the JSON (at index 0) and reencodes it without the
+   whitespace. */
+static duk_ret_t compact(duk_context *ctx, void *udata) {
+  duk_json_decode(ctx, 0);
+  duk_json_encode(ctx, 0);
+  return 1;
+}
+
+static int byName(const void *a, const void *b) {
+  return strcmp(((const Spec *)a)->name, ((const Spec *)b)->name);
+}
+
+static void put32(FILE *out, size_t n) {
+  unsigned char b[4] = {n & 0xff, (n >> 8) & 0xff, (n >> 16) & 0xff, (n >> 24) & 0xff};
+  fwrite(b, 1, 4, out);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s OUT.bundle SPEC...\n", argv[0]);
+    exit(1);
+  }
+
+  int n = argc - 2, i;
+  Spec *specs = calloc(n + 1, sizeof(Spec));
+  duk_context *ctx = duk_create_heap_default();
+
+  for (i = 0; i < n; i++) {
+    char *arg = argv[i + 2];
+    char *file = arg;
+    char *eq = strchr(arg, '=');
+    if (eq != NULL) {
+      specs[i].name = strndup(arg, eq - arg);
+      file = eq + 1;
+    } else {
+      char *base = strrchr(arg, '/');
+      base = base == NULL ? arg : base + 1;
+      size_t len = strlen(base);
+      if (3 < len && strcmp(base + len - 3, ".js") == 0) {
+	len -= 3;
+      }
+      specs[i].name = strndup(base, len);
+    }
+
+    long length;
+    char *src = readAll(file, &length);
+    duk_push_lstring(ctx, src, length);
+    free(src);
+    if (duk_safe_call(ctx, compact, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+      fprintf(stderr, "bad spec '%s': %s\n", file, duk_safe_to_string(ctx, -1));
+      exit(1);
+    }
+    duk_size_t len;
+    const char *json = duk_get_lstring(ctx, -1, &len);
+    specs[i].json = strndup(json, len);
+    specs[i].len = len;
+    duk_pop(ctx);
+  }
+  duk_destroy_heap(ctx);
+
+  qsort(specs, n, sizeof(Spec), byName);
+  for (i = 1; i < n; i++) {
+    if (strcmp(specs[i-1].name, specs[i].name) == 0) {
+      fprintf(stderr, "duplicate spec name '%s'\n", specs[i].name);
+      exit(1);
+    }
+  }
+
+  /* The offsets have to fit in 32 bits. */
+  uint64_t at = 8 + 4 + 16 * (uint64_t)n;
+  for (i = 0; i < n; i++) {
+    at += strlen(specs[i].name) + 1 + specs[i].len + 1;
+  }
+  if (UINT32_MAX < at) {
+    fprintf(stderr, "bundle too big\n");
+    exit(1);
+  }
+
+  FILE *out = fopen(argv[1], "wb");
+  if (out == NULL) {
+    fprintf(stderr, "couldn't write '%s'\n", argv[1]);
+    exit(1);
+  }
+  fwrite("SHEENSB1", 1, 8, out);
+  put32(out, n);
+  at = 8 + 4 + 16 * (uint64_t)n;
+  for (i = 0; i < n; i++) {
+    size_t name_len = strlen(specs[i].name);
+    put32(out, at);
+    put32(out, name_len);
+    at += name_len + 1;
+    put32(out, at);
+    put32(out, specs[i].len);
+    at += specs[i].len + 1;
+  }
+  for (i = 0; i < n; i++) {
+    fwrite(specs[i].name, 1, strlen(specs[i].name) + 1, out);
+    fwrite(specs[i].json, 1, specs[i].len + 1, out);
+    free(specs[i].name);
+    free(specs[i].json);
+  }
+  free(specs);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "couldn't write '%s'\n", argv[1]);
+    exit(1);
+  }
+
+  return 0;
+}
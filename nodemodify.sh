@@ -31,7 +31,7 @@ var sandbox = function(code) {
 }
 EOF
 
-for F in prof match sandbox step; do 
+for F in prof match sandbox compile step; do 
     cat js/$F.js >> $TARGET/index.js
 done
 
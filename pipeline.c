@@ -0,0 +1,470 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* sheensio's pipelined mode ('-P').
+
+   A reader thread does big read()s and splits them into lines, the
+   engine (the calling thread, which owns the Duktape heap) processes
+   each line, and a writer thread gathers the output into big
+   write()s.  That way reading and writing overlap processing rather
+   than waiting for it.
+
+   Each pair of stages shares a bounded single-producer,
+   single-consumer ring.  The producer is the only thread that
+   advances a ring's tail and the consumer the only one that advances
+   its head, so passing messages doesn't take locks.  A stage that
+   finds its input ring empty or its output ring full spins briefly
+   and then sleeps on the ring's condition variable until the other
+   end pushes, pops, closes, or abandons, so a slow stage holds up the
+   stages before it (and memory stays bounded) rather than letting
+   messages pile up, and an idle stage doesn't use the CPU. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "machines.h"
+#include "pipeline.h"
+
+/* PIPELINE_BATCH is the most messages the writer puts in one
+   write(). */
+#define PIPELINE_BATCH (256)
+
+/* PIPELINE_SPINS is how many times a stage yields before it sleeps
+   waiting on a ring. */
+#define PIPELINE_SPINS (64)
+
+/* PIPELINE_POLL_MS is how long the reader waits for input before
+   checking whether the engine has stopped. */
+#define PIPELINE_POLL_MS (100)
+
+typedef struct {
+  mach_buf buf;
+  /* t is when the reader read the message (or negative for the
+     output of an idle call). */
+  double t;
+} Item;
+
+typedef struct {
+  Item slots[PIPELINE_RING];
+  /* Only the consumer advances head, and only the producer advances
+     tail. */
+  unsigned long head;
+  unsigned long tail;
+  /* The producer sets closed after its last push, and the consumer
+     sets abandoned when it won't pop any more. */
+  int closed;
+  int abandoned;
+  /* waiting counts the threads asleep in ring_wait, which the other
+     end wakes with cond. */
+  int waiting;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} Ring;
+
+typedef struct {
+  int in;
+  int out;
+  Ring *read;
+  Ring *written;
+  Latencies *lat;
+  int read_rc;
+  int write_rc;
+} Pipeline;
+
+double pipeline_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static Ring *ring_new() {
+  Ring *r = calloc(1, sizeof(Ring));
+  if (r == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&r->lock, NULL) != 0) {
+    free(r);
+    return NULL;
+  }
+  if (pthread_cond_init(&r->cond, NULL) != 0) {
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+static void ring_free(Ring *r) {
+  if (r != NULL) {
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+  }
+}
+
+/* ring_ready says whether a stage can stop waiting on a ring, given
+   the stage's own head or tail. */
+typedef int (*ring_ready)(Ring *r, unsigned long at);
+
+/* has_room is the producer's ring_ready. */
+static int has_room(Ring *r, unsigned long tail) {
+  return __atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE) ||
+    tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) < PIPELINE_RING;
+}
+
+/* has_item is the consumer's ring_ready. */
+static int has_item(Ring *r, unsigned long head) {
+  return __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE) ||
+    __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != head;
+}
+
+/* ring_wait returns when ready.  It yields PIPELINE_SPINS times and
+   then sleeps until ring_wake. */
+static void ring_wait(Ring *r, ring_ready ready, unsigned long at) {
+  int spins;
+  for (spins = 0; spins < PIPELINE_SPINS; spins++) {
+    if (ready(r, at)) {
+      return;
+    }
+    sched_yield();
+  }
+  pthread_mutex_lock(&r->lock);
+  __atomic_add_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+  /* Pairs with the fence in ring_wake: either the other end sees
+     waiting or this check sees what it did. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while (!ready(r, at)) {
+    pthread_cond_wait(&r->cond, &r->lock);
+  }
+  __atomic_sub_fetch(&r->waiting, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* ring_wake wakes the other end if it's asleep in ring_wait.  Call it
+   after changing head, tail, closed, or abandoned. */
+static void ring_wake(Ring *r) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+/* ring_push waits for room and then adds the item.  Returns MACH_SAD
+   if the consumer has abandoned the ring. */
+static int ring_push(Ring *r, Item *item) {
+  unsigned long tail = r->tail;
+  ring_wait(r, has_room, tail);
+  if (__atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE)) {
+    return MACH_SAD;
+  }
+  r->slots[tail & (PIPELINE_RING - 1)] = *item;
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+  ring_wake(r);
+  return MACH_OKAY;
+}
+
+/* ring_pop takes the next item.  If wait, it waits for one and
+   returns 0 only when the ring is closed and empty.  Otherwise it
+   returns 0 if the ring is empty. */
+static int ring_pop(Ring *r, Item *item, int wait) {
+  unsigned long head = r->head;
+  if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+    if (!wait) {
+      return 0;
+    }
+    ring_wait(r, has_item, head);
+    /* The ring could be closed, but the last push came before the
+       close. */
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+      return 0;
+    }
+  }
+  *item = r->slots[head & (PIPELINE_RING - 1)];
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  ring_wake(r);
+  return 1;
+}
+
+static void ring_close(Ring *r) {
+  __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+  ring_wake(r);
+}
+
+/* ring_abandon tells the producer to stop and frees what's left. */
+static void ring_abandon(Ring *r) {
+  Item item;
+  __atomic_store_n(&r->abandoned, 1, __ATOMIC_RELEASE);
+  ring_wake(r);
+  while (ring_pop(r, &item, 1)) {
+    mach_buf_free(&item.buf);
+  }
+}
+
+/* push_line copies a line to the engine. */
+static int push_line(Pipeline *p, const char *s, size_t n) {
+  Item item = {MACH_BUF_INIT, pipeline_now_ms()};
+  if (mach_buf_set(&item.buf, s, n) != MACH_OKAY) {
+    return MACH_SAD;
+  }
+  if (ring_push(p->read, &item) != MACH_OKAY) {
+    mach_buf_free(&item.buf);
+    return MACH_SAD;
+  }
+  return MACH_OKAY;
+}
+
+static void *reader(void *arg) {
+  Pipeline *p = arg;
+  mach_buf buf = MACH_BUF_INIT;
+  int rc = MACH_OKAY;
+
+  for (;;) {
+    if (mach_buf_reserve(&buf, buf.len + PIPELINE_IO) != MACH_OKAY) {
+      rc = MACH_SAD;
+      break;
+    }
+    /* Wait for input a little at a time, so that the reader doesn't
+       sit in read() on an idle input after the engine has stopped
+       (which waits for the reader). */
+    if (__atomic_load_n(&p->read->abandoned, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    struct pollfd pfd = {p->in, POLLIN, 0};
+    int k = poll(&pfd, 1, PIPELINE_POLL_MS);
+    if (k == 0 || (k < 0 && errno == EINTR)) {
+      continue;
+    }
+    if (k < 0) {
+      fprintf(stderr, "pipeline: poll failed\n");
+      rc = MACH_SAD;
+      break;
+    }
+    ssize_t n = read(p->in, buf.data + buf.len, PIPELINE_IO);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr, "pipeline: read failed\n");
+      rc = MACH_SAD;
+      break;
+    }
+    if (n == 0) {
+      /* A last line without a newline is still a line. */
+      if (0 < buf.len) {
+        rc = push_line(p, buf.data, buf.len);
+      }
+      break;
+    }
+
+    /* Send the complete lines and keep the rest. */
+    char *start = buf.data;
+    char *end = buf.data + buf.len + n;
+    char *nl = memchr(buf.data + buf.len, '\n', n);
+    while (nl != NULL && rc == MACH_OKAY) {
+      rc = push_line(p, start, nl + 1 - start);
+      start = nl + 1;
+      nl = memchr(start, '\n', end - start);
+    }
+    if (rc != MACH_OKAY) {
+      break;
+    }
+    buf.len = end - start;
+    memmove(buf.data, start, buf.len);
+  }
+
+  mach_buf_free(&buf);
+  p->read_rc = rc;
+  ring_close(p->read);
+  return NULL;
+}
+
+static void *writer(void *arg) {
+  Pipeline *p = arg;
+  mach_buf batch = MACH_BUF_INIT;
+  double ts[PIPELINE_BATCH];
+  Item item;
+  int rc = MACH_OKAY;
+
+  while (rc == MACH_OKAY && ring_pop(p->written, &item, 1)) {
+    /* Take whatever else is ready, up to a batch, for the same
+       write(). */
+    int n = 0;
+    batch.len = 0;
+    do {
+      if (mach_buf_reserve(&batch, batch.len + item.buf.len) != MACH_OKAY) {
+        rc = MACH_SAD;
+      } else if (0 < item.buf.len) {
+        memcpy(batch.data + batch.len, item.buf.data, item.buf.len);
+        batch.len += item.buf.len;
+      }
+      ts[n++] = item.t;
+      mach_buf_free(&item.buf);
+    } while (rc == MACH_OKAY && n < PIPELINE_BATCH && batch.len < PIPELINE_IO &&
+             ring_pop(p->written, &item, 0));
+
+    const char *s = batch.data;
+    size_t left = batch.len;
+    while (rc == MACH_OKAY && 0 < left) {
+      ssize_t k = write(p->out, s, left);
+      if (k < 0 && errno == EINTR) {
+        continue;
+      }
+      if (k < 0) {
+        fprintf(stderr, "pipeline: write failed\n");
+        rc = MACH_SAD;
+        break;
+      }
+      s += k;
+      left -= k;
+    }
+
+    if (p->lat != NULL) {
+      double now = pipeline_now_ms();
+      int i;
+      for (i = 0; i < n; i++) {
+        if (0 <= ts[i]) {
+          lat_add(p->lat, (now - ts[i]) * 1e3);
+        }
+      }
+    }
+  }
+
+  if (rc != MACH_OKAY) {
+    ring_abandon(p->written);
+  }
+  mach_buf_free(&batch);
+  p->write_rc = rc;
+  return NULL;
+}
+
+int pipeline_run(int in, int out, pipeline_step step, pipeline_idle idle, void *arg,
+                 Latencies *lat) {
+  Pipeline p = {in, out, NULL, NULL, lat, MACH_OKAY, MACH_OKAY};
+  pthread_t read_thread, write_thread;
+  Item item;
+  int rc = MACH_OKAY;
+  /* Whether to wait for the next message rather than call idle
+     first. */
+  int wait = idle == NULL;
+
+  p.read = ring_new();
+  p.written = ring_new();
+  if (p.read == NULL || p.written == NULL) {
+    ring_free(p.read);
+    ring_free(p.written);
+    return MACH_SAD;
+  }
+  if (pthread_create(&read_thread, NULL, reader, &p) != 0) {
+    ring_free(p.read);
+    ring_free(p.written);
+    return MACH_SAD;
+  }
+  if (pthread_create(&write_thread, NULL, writer, &p) != 0) {
+    ring_abandon(p.read);
+    pthread_join(read_thread, NULL);
+    ring_free(p.read);
+    ring_free(p.written);
+    return MACH_SAD;
+  }
+
+  for (;;) {
+    Item done = {MACH_BUF_INIT, -1};
+    if (ring_pop(p.read, &item, wait)) {
+      done.t = item.t;
+      rc = step(arg, item.buf.data, item.buf.len, &done.buf);
+      mach_buf_free(&item.buf);
+      wait = idle == NULL;
+    } else if (!wait) {
+      /* No messages are waiting. */
+      rc = idle(arg, &done.buf);
+      wait = 1;
+      if (rc == MACH_OKAY && done.buf.len == 0) {
+        mach_buf_free(&done.buf);
+        continue;
+      }
+    } else {
+      break;
+    }
+    if (rc == MACH_OKAY) {
+      rc = ring_push(p.written, &done);
+    }
+    if (rc != MACH_OKAY) {
+      mach_buf_free(&done.buf);
+      ring_abandon(p.read);
+      break;
+    }
+  }
+  ring_close(p.written);
+
+  pthread_join(read_thread, NULL);
+  pthread_join(write_thread, NULL);
+  ring_free(p.read);
+  ring_free(p.written);
+
+  if (rc == MACH_OKAY && (p.read_rc != MACH_OKAY || p.write_rc != MACH_OKAY)) {
+    rc = MACH_SAD;
+  }
+  return rc;
+}
+
+void lat_add(Latencies *l, double us) {
+  if (l->n == l->cap) {
+    size_t cap = l->cap < 1024 ? 1024 : 2 * l->cap;
+    double *a = realloc(l->us, cap * sizeof(double));
+    if (a == NULL) {
+      return;
+    }
+    l->us = a;
+    l->cap = cap;
+  }
+  l->us[l->n++] = us;
+}
+
+static int byValue(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : y < x ? 1 : 0;
+}
+
+static double percentile(const Latencies *l, double q) {
+  size_t i = (size_t)(q * (l->n - 1) + 0.5);
+  return l->us[i];
+}
+
+void lat_report(const char *label, Latencies *l, double elapsed_ms) {
+  if (l->n == 0) {
+    fprintf(stderr, "%s: no messages\n", label);
+    return;
+  }
+  qsort(l->us, l->n, sizeof(double), byValue);
+  fprintf(stderr, "%s: %zu msgs in %.3fs (%.0f msgs/sec) "
+          "latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+          label, l->n, elapsed_ms / 1e3, l->n / (elapsed_ms / 1e3),
+          percentile(l, 0.5), percentile(l, 0.9), percentile(l, 0.99),
+          percentile(l, 0.999), l->us[l->n - 1]);
+}
+
+void lat_free(Latencies *l) {
+  free(l->us);
+  l->us = NULL;
+  l->n = l->cap = 0;
+}
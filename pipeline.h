@@ -0,0 +1,60 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A reader, engine, and writer pipeline for sheensio (see
+   pipeline.c).  Include machines.h first. */
+
+/* PIPELINE_RING is how many messages can wait between two stages (a
+   power of 2).  A full ring holds up the stage that feeds it. */
+#define PIPELINE_RING (1024)
+
+/* PIPELINE_IO is the size of the reader's reads and (about) the
+   writer's writes. */
+#define PIPELINE_IO (64*1024)
+
+/* Latencies collects per-message latencies in microseconds. */
+typedef struct {
+  double *us;
+  size_t n;
+  size_t cap;
+} Latencies;
+
+/* pipeline_now_ms returns a monotonic time in milliseconds. */
+double pipeline_now_ms() ;
+
+void lat_add(Latencies *l, double us) ;
+
+/* lat_report writes the message rate and the latency percentiles to
+   stderr. */
+void lat_report(const char *label, Latencies *l, double elapsed_ms) ;
+
+void lat_free(Latencies *l) ;
+
+/* pipeline_step processes a message (a line of input) and appends
+   anything to write to out. */
+typedef int (*pipeline_step)(void *arg, const char *msg, size_t len, mach_buf *out);
+
+/* pipeline_idle is called when no messages are waiting for the
+   engine and appends anything to write to out. */
+typedef int (*pipeline_idle)(void *arg, mach_buf *out);
+
+/* pipeline_run reads lines from the fd in on one thread, calls step
+   for each line on this thread, and writes the output to the fd out
+   on another thread.  If idle isn't NULL, it's called (on this
+   thread) whenever the engine runs out of messages, including before
+   the pipeline finishes.  If lat isn't NULL, each message's latency
+   (from being read to its output being written) goes there.
+
+   Returns MACH_SAD if a read or write failed or step or idle didn't
+   return MACH_OKAY, in which case the pipeline stops. */
+int pipeline_run(int in, int out, pipeline_step step, pipeline_idle idle, void *arg,
+                 Latencies *lat) ;
@@ -0,0 +1,453 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* sheensio's server mode ('-u PATH').
+
+   Rather than a process per stream, one sheensio listens on a
+   Unix-domain socket and serves many clients with epoll.  All of the
+   clients' crews live in the same runtime, so they share its spec
+   cache.
+
+   A client sends lines.  The first line is a crew (like crew.json,
+   on one line), which the server opens as a resident crew and
+   answers with
+
+     crew<TAB>HANDLE
+
+   Each line after that is a message for that crew, which the server
+   answers with a line for each message that the crew emitted and then
+   'ok':
+
+     out<TAB>MESSAGE
+     ...
+     ok
+
+   If something goes wrong, 'ok' is 'error<TAB>RC' instead, and if the
+   crew can't be opened, the server hangs up after the error.  Blank
+   lines are ignored.  A client can send many messages before reading
+   the answers.
+
+   A single thread does all of the processing.  To be fair, each
+   client with messages waiting gets up to SERVER_QUANTUM of them
+   processed per turn, and a client whose answers it isn't reading
+   (SERVER_OUT_LIMIT) doesn't get any processed until it catches up.
+   The server also stops reading from a client that has a lot of
+   input waiting, so a fast client can't make the server buffer
+   without bound. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#ifndef OSX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "machines.h"
+#include "server.h"
+
+#ifdef OSX
+
+int server_run(const char *path, server_step step, void *arg) {
+  fprintf(stderr, "server: needs epoll\n");
+  return MACH_SAD;
+}
+
+#else
+
+#define SERVER_EVENTS (64)
+#define SERVER_READ (64*1024)
+
+typedef struct Conn {
+  int fd;
+  /* h is the client's crew, or -1 until the first line. */
+  int h;
+  /* The unprocessed input starts at in_start. */
+  mach_buf in;
+  size_t in_start;
+  /* The unwritten output starts at out_sent. */
+  mach_buf out;
+  size_t out_sent;
+  /* events is what epoll is watching for. */
+  unsigned int events;
+  int eof;
+  int failed;
+  /* ready says the connection is in the ready list. */
+  int ready;
+  struct Conn *next_ready;
+  struct Conn *prev;
+  struct Conn *next;
+} Conn;
+
+typedef struct {
+  int ep;
+  server_step step;
+  void *arg;
+  /* line holds the line being processed. */
+  mach_buf line;
+  /* ready is the connections with messages to process in the order
+     they get their turns. */
+  Conn *ready;
+  Conn *last_ready;
+  Conn *conns;
+} Server;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int sig) {
+  stopping = 1;
+}
+
+static int nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return MACH_SAD;
+  }
+  return MACH_OKAY;
+}
+
+static void reply(Conn *c, const char *s, int rc) {
+  char buf[64];
+  int n = rc < 0 ? snprintf(buf, sizeof(buf), "%s\n", s) : snprintf(buf, sizeof(buf), "%s\t%d\n", s, rc);
+  if (mach_buf_reserve(&c->out, c->out.len + n) != MACH_OKAY) {
+    c->failed = 1;
+    return;
+  }
+  memcpy(c->out.data + c->out.len, buf, n);
+  c->out.len += n;
+}
+
+/* conn_line returns the length of the next line (with its newline) if
+   it's all here, or, at the end of the input, what's left. */
+static size_t conn_line(const Conn *c) {
+  size_t left = c->in.len - c->in_start;
+  if (left == 0) {
+    return 0;
+  }
+  char *nl = memchr(c->in.data + c->in_start, '\n', left);
+  if (nl != NULL) {
+    return nl + 1 - (c->in.data + c->in_start);
+  }
+  return c->eof ? left : 0;
+}
+
+/* conn_runnable says there's a line to process and room for its
+   output. */
+static int conn_runnable(const Conn *c) {
+  return !c->failed && c->out.len - c->out_sent < SERVER_OUT_LIMIT && 0 < conn_line(c);
+}
+
+/* conn_done says the connection can be closed. */
+static int conn_done(const Conn *c) {
+  return c->failed || (c->eof && conn_line(c) == 0 && c->out_sent == c->out.len);
+}
+
+static void conn_watch(Server *s, Conn *c) {
+  unsigned int events = 0;
+  if (!c->eof && c->in.len - c->in_start < SERVER_MAX_LINE) {
+    events |= EPOLLIN;
+  }
+  if (c->out_sent < c->out.len) {
+    events |= EPOLLOUT;
+  }
+  if (events != c->events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->ep, EPOLL_CTL_MOD, c->fd, &ev) != 0) {
+      c->failed = 1;
+    }
+    c->events = events;
+  }
+}
+
+static Conn *conn_open(Server *s, int fd) {
+  struct epoll_event ev;
+  Conn *c = calloc(1, sizeof(Conn));
+  if (c == NULL || nonblocking(fd) != MACH_OKAY) {
+    free(c);
+    return NULL;
+  }
+  c->fd = fd;
+  c->h = -1;
+  c->events = EPOLLIN;
+  ev.events = c->events;
+  ev.data.ptr = c;
+  if (epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    free(c);
+    return NULL;
+  }
+  c->next = s->conns;
+  if (s->conns != NULL) {
+    s->conns->prev = c;
+  }
+  s->conns = c;
+  return c;
+}
+
+static void conn_close(Server *s, Conn *c) {
+  close(c->fd);
+  if (0 <= c->h) {
+    mach_crew_close(c->h);
+  }
+  mach_buf_free(&c->in);
+  mach_buf_free(&c->out);
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    s->conns = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  free(c);
+}
+
+static void conn_read(Conn *c) {
+  /* Move what's left to the front first. */
+  if (0 < c->in_start) {
+    c->in.len -= c->in_start;
+    memmove(c->in.data, c->in.data + c->in_start, c->in.len);
+    c->in_start = 0;
+  }
+  if (mach_buf_reserve(&c->in, c->in.len + SERVER_READ) != MACH_OKAY) {
+    c->failed = 1;
+    return;
+  }
+  ssize_t n = read(c->fd, c->in.data + c->in.len, SERVER_READ);
+  if (0 < n) {
+    c->in.len += n;
+  } else if (n == 0) {
+    c->eof = 1;
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    c->failed = 1;
+  }
+
+  if (!c->eof && conn_line(c) == 0 && SERVER_MAX_LINE <= c->in.len - c->in_start) {
+    /* Too long, so give up on this client. */
+    reply(c, "error", MACH_TOO_BIG);
+    c->in_start = c->in.len;
+    c->eof = 1;
+  }
+}
+
+static void conn_flush(Conn *c) {
+  while (c->out_sent < c->out.len) {
+    ssize_t n = write(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        c->failed = 1;
+      }
+      break;
+    }
+    c->out_sent += n;
+  }
+  if (c->out_sent == c->out.len) {
+    c->out.len = c->out_sent = 0;
+  }
+}
+
+/* conn_run processes up to SERVER_QUANTUM of the connection's
+   lines. */
+static void conn_run(Server *s, Conn *c) {
+  int i;
+  for (i = 0; i < SERVER_QUANTUM && conn_runnable(c); i++) {
+    size_t n = conn_line(c);
+    const char *p = c->in.data + c->in_start;
+    c->in_start += n;
+    if (n == 1 && p[0] == '\n') {
+      i--;
+      continue;
+    }
+    if (mach_buf_set(&s->line, p, n) != MACH_OKAY) {
+      c->failed = 1;
+      break;
+    }
+
+    if (c->h < 0) {
+      int rc = mach_crew_open_buf(&s->line, &c->h);
+      if (rc != MACH_OKAY) {
+        c->h = -1;
+        reply(c, "error", rc);
+        /* Hang up after the error. */
+        c->in_start = c->in.len;
+        c->eof = 1;
+        break;
+      }
+      reply(c, "crew", c->h);
+    } else {
+      int rc = s->step(s->arg, c->h, s->line.data, s->line.len, &c->out);
+      if (rc == MACH_OKAY) {
+        reply(c, "ok", -1);
+      } else {
+        reply(c, "error", rc);
+      }
+    }
+  }
+  conn_flush(c);
+}
+
+/* conn_settle closes the connection if it's done and otherwise
+   updates what epoll watches for and queues it if it has lines to
+   process. */
+static void conn_settle(Server *s, Conn *c) {
+  if (c->ready) {
+    /* Its turn will come. */
+    return;
+  }
+  if (conn_done(c)) {
+    conn_close(s, c);
+    return;
+  }
+  conn_watch(s, c);
+  if (c->failed) {
+    conn_close(s, c);
+    return;
+  }
+  if (conn_runnable(c)) {
+    c->ready = 1;
+    c->next_ready = NULL;
+    if (s->last_ready != NULL) {
+      s->last_ready->next_ready = c;
+    } else {
+      s->ready = c;
+    }
+    s->last_ready = c;
+  }
+}
+
+static void accept_all(Server *s, int listener) {
+  for (;;) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("server: accept");
+      }
+      return;
+    }
+    if (conn_open(s, fd) == NULL) {
+      fprintf(stderr, "server: couldn't take a connection\n");
+      close(fd);
+    }
+  }
+}
+
+int server_run(const char *path, server_step step, void *arg) {
+  Server s = {-1, step, arg, MACH_BUF_INIT, NULL, NULL, NULL};
+  struct epoll_event events[SERVER_EVENTS];
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  int listener, i;
+
+  if (sizeof(addr.sun_path) <= strlen(path)) {
+    fprintf(stderr, "server: '%s' is too long\n", path);
+    return MACH_SAD;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("server: socket");
+    return MACH_SAD;
+  }
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(listener, SOMAXCONN) != 0 ||
+      nonblocking(listener) != MACH_OKAY) {
+    perror("server: listen");
+    close(listener);
+    return MACH_SAD;
+  }
+
+  s.ep = epoll_create1(0);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (s.ep < 0 || epoll_ctl(s.ep, EPOLL_CTL_ADD, listener, &ev) != 0) {
+    perror("server: epoll");
+    close(listener);
+    unlink(path);
+    return MACH_SAD;
+  }
+
+  /* No SA_RESTART, so a signal interrupts epoll_wait. */
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  fprintf(stderr, "server: listening on %s\n", path);
+
+  while (!stopping) {
+    /* Don't wait if there are messages to process. */
+    int n = epoll_wait(s.ep, events, SERVER_EVENTS, s.ready != NULL ? 0 : -1);
+    if (n < 0 && errno != EINTR) {
+      perror("server: epoll_wait");
+      break;
+    }
+
+    for (i = 0; i < n; i++) {
+      Conn *c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_all(&s, listener);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !c->eof) {
+        conn_read(c);
+      }
+      if (events[i].events & EPOLLOUT) {
+        conn_flush(c);
+      }
+      conn_settle(&s, c);
+    }
+
+    /* A turn for each connection that was ready. */
+    Conn *c = s.ready;
+    s.ready = s.last_ready = NULL;
+    while (c != NULL) {
+      Conn *next = c->next_ready;
+      c->ready = 0;
+      conn_run(&s, c);
+      conn_settle(&s, c);
+      c = next;
+    }
+  }
+
+  while (s.conns != NULL) {
+    conn_close(&s, s.conns);
+  }
+  close(s.ep);
+  close(listener);
+  unlink(path);
+  mach_buf_free(&s.line);
+  return MACH_OKAY;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* sheensio's Unix-domain socket server (see server.c).  Include
+   machines.h first. */
+
+/* SERVER_QUANTUM is how many messages a connection gets processed
+   before the other connections get a turn. */
+#define SERVER_QUANTUM (16)
+
+/* SERVER_MAX_LINE is the longest line a client can send. */
+#define SERVER_MAX_LINE (1024*1024)
+
+/* SERVER_OUT_LIMIT is how much output can wait for a client before
+   the server stops processing (and reading) that client's
+   messages. */
+#define SERVER_OUT_LIMIT (1024*1024)
+
+/* server_step processes a message for the resident crew h and
+   appends its output to out. */
+typedef int (*server_step)(void *arg, int h, const char *msg, size_t len, mach_buf *out);
+
+/* server_run listens on the Unix-domain socket at path and serves
+   clients until SIGINT or SIGTERM.  Each client's first line is a
+   crew, which the server opens, and every line after that is a
+   message for that crew. */
+int server_run(const char *path, server_step step, void *arg) ;
@@ -1,11 +1,26 @@
 #!/bin/bash
 
-N=${1:-100}
+# Message rate and latency percentiles for sheensio, serially and
+# pipelined ('-P').
+#
+#   ./sheens-perf.sh [MESSAGES]
 
-time (yes '{"double":1}' | head -$N | ./sheens > sheens-perf.log 2>&1)
+N=${1:-100000}
 
-echo "logged  $(wc -l sheens-perf.log)"
-echo "emitted $(grep '"doubled":' sheens-perf.log | wc -l)"
+set -e
 
+make specs/turnstile.js specs/double.js sheensio
 
+cat<<EOF2 > crew.json
+{"id":"perf",
+ "machines":{
+   "doubler":{"spec":"specs/double.js","node":"listen","bs":{"count":0}},
+   "turnstile":{"spec":"specs/turnstile.js","node":"locked","bs":{}}}}
+EOF2
 
+(for I in `seq $N`; do echo "{\"double\":$I}"; done) > sheens-perf.input
+
+for MODE in "" "-P"; do
+    ./sheensio -c -L $MODE < sheens-perf.input > sheens-perf.log
+    echo "emitted $(grep -c '"doubled":' sheens-perf.log)"
+done
@@ -0,0 +1,23 @@
+#!/bin/bash
+
+# Load test for sheensio's server mode ('-u').
+#
+#   ./sheensio-server.sh [CLIENTS] [MESSAGES] [WINDOW]
+
+C=${1:-10}
+N=${2:-10000}
+W=${3:-16}
+SOCKET=sheensio.sock
+
+set -e
+
+make specs/turnstile.js specs/double.js sheensio sheensload
+
+./sheensio -c -u $SOCKET > sheensio-server.log 2>&1 &
+SERVER=$!
+trap "kill $SERVER" EXIT
+
+while [ ! -S $SOCKET ]; do sleep 0.1; done
+
+echo "$C clients sending $N messages each, $W at a time."
+./sheensload -c $C -n $N -w $W $SOCKET
@@ -12,14 +12,39 @@
 
 /* Little process to read messages from stdin and write things to
    stdout.  Expects a crew at 'crew.json'.  See 'demo.sh' for
-   an example. */
+   an example.
+
+   With '-w DIR', the crew lives in DIR (starting from 'crew.json'
+   the first time), and a write-ahead log there ('wal.c') lets a
+   restart recover it.  The log is committed whenever no input is
+   waiting, and '-g N' and '-G MS' bound how many records (and how
+   long) a commit waits for while input keeps coming.  '-S N' is how
+   many records go between snapshots.  The records only have the
+   machines that changed (as with '-n').  Output for a message is held
+   until the message's record is committed, so a crash can't lose the
+   effects of a message whose output went out.
+
+   With '-P', reading, processing, and writing happen on separate
+   threads (see 'pipeline.c'), and '-L' reports the message rate and
+   latencies.
+
+   With '-u PATH', sheensio serves clients on a Unix-domain socket
+   instead (see 'server.c' and 'sheensload.c'). */
+
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include "machines.h"
+#include "wal.h"
+#include "pipeline.h"
+#include "server.h"
 
 int logging = 0;
 
@@ -81,11 +106,202 @@ void eval(char * src) {
   free(dst);
 }
 
+/* Engine is what processing a message needs. */
+typedef struct {
+  int h;
+  Wal *wal;
+  mach_buf steppeds;
+  mach_buf updated;
+  /* out, if not NULL, gets the output for the pipeline's writer
+     rather than stdout. */
+  mach_buf *out;
+  /* held is output waiting for the log to commit. */
+  mach_buf held;
+} Engine;
+
+/* printEmitted writes each emitted message as soon as a machine
+   emits it. */
+void printEmitted(void *arg, const char *mid, const char *msg, size_t len) {
+  Engine *e = arg;
+  if (e->out == NULL) {
+    printf("out\t%.*s\n", (int) len, msg);
+    return;
+  }
+  mach_buf *out = e->out;
+  if (mach_buf_reserve(out, out->len + len + 5) == MACH_OKAY) {
+    memcpy(out->data + out->len, "out\t", 4);
+    memcpy(out->data + out->len + 4, msg, len);
+    out->data[out->len + 4 + len] = '\n';
+    out->len += len + 5;
+  }
+}
+
+/* release moves the output that was waiting for a commit to out. */
+static int release(Engine *e, mach_buf *out) {
+  if (e->held.len == 0) {
+    return MACH_OKAY;
+  }
+  if (mach_buf_reserve(out, out->len + e->held.len) != MACH_OKAY) {
+    return MACH_SAD;
+  }
+  memcpy(out->data + out->len, e->held.data, e->held.len);
+  out->len += e->held.len;
+  e->held.len = 0;
+  return MACH_OKAY;
+}
+
+/* step processes one message, which is a pipeline_step.  Errors go
+   to stderr, since the pipeline's writer owns stdout. */
+int step(void *arg, const char *line, size_t line_len, mach_buf *out) {
+  Engine *e = arg;
+  int rc;
+
+  lgf("in\t%s", line); /* Already has newline. */
+
+  e->out = out;
+  mach_buf message = {(char *)line, line_len, 0};
+  rc = mach_crew_handle_process_buf(e->h, &message, &e->steppeds);
+  e->out = NULL;
+  if (rc == MACH_OKAY) {
+    lgf("steps\t%s\n", e->steppeds.data);
+  } else {
+    fprintf(stderr, "mach_crew_handle_process error %d\n", rc);
+    return rc;
+  }
+
+  if (e->wal != NULL) {
+    /* The output waits (behind any output that's already waiting)
+       until the steppeds are committed. */
+    if (mach_buf_reserve(&e->held, e->held.len + out->len) != MACH_OKAY) {
+      return MACH_SAD;
+    }
+    if (0 < out->len) {
+      memcpy(e->held.data + e->held.len, out->data, out->len);
+      e->held.len += out->len;
+      out->len = 0;
+    }
+    rc = wal_append(e->wal, e->h, &e->steppeds);
+    if (rc != MACH_OKAY) {
+      fprintf(stderr, "wal_append error %d\n", rc);
+      return rc;
+    }
+    if (e->wal->pending == 0 && release(e, out) != MACH_OKAY) {
+      return MACH_SAD;
+    }
+  }
+
+  if (logging) {
+    rc = mach_crew_export_buf(e->h, &e->updated);
+    if (rc == MACH_OKAY) {
+      lgf("updated\t%s\n", e->updated.data);
+    } else {
+      fprintf(stderr, "export error %d\n", rc);
+      return rc;
+    }
+  }
+
+  return MACH_OKAY;
+}
+
+/* idle commits the log when no input is waiting, which is a
+   pipeline_idle, and releases the output that was waiting for the
+   commit. */
+int idle(void *arg, mach_buf *out) {
+  Engine *e = arg;
+  if (e->wal == NULL) {
+    return MACH_OKAY;
+  }
+  int rc = wal_commit(e->wal);
+  if (rc != MACH_OKAY) {
+    fprintf(stderr, "wal_commit error %d\n", rc);
+    return rc;
+  }
+  return release(e, out);
+}
+
+/* Input reads stdin by lines for the serial mode.  Unlike getline,
+   it can tell whether a line is waiting. */
+typedef struct {
+  mach_buf buf;
+  size_t start;
+  int eof;
+} Input;
+
+/* nextLine copies the next line (with its newline, if it has one) to
+   line.  Returns 0 at the end of the input or, if !wait, when no line
+   is waiting. */
+static int nextLine(Input *in, int wait, mach_buf *line) {
+  for (;;) {
+    char *s = in->buf.data + in->start;
+    size_t n = in->buf.len - in->start;
+    char *nl = 0 < n ? memchr(s, '\n', n) : NULL;
+    if (nl != NULL || (in->eof && 0 < n)) {
+      /* A last line without a newline is still a line. */
+      size_t k = nl != NULL ? (size_t)(nl + 1 - s) : n;
+      if (mach_buf_set(line, s, k) != MACH_OKAY) {
+        fprintf(stderr, "line too long\n");
+        exit(1);
+      }
+      in->start += k;
+      return 1;
+    }
+    if (in->eof) {
+      return 0;
+    }
+    if (!wait) {
+      struct pollfd pfd = {0, POLLIN, 0};
+      if (poll(&pfd, 1, 0) == 0) {
+        return 0;
+      }
+    }
+
+    if (0 < in->start) {
+      memmove(in->buf.data, s, n);
+      in->buf.len = n;
+      in->start = 0;
+    }
+    if (mach_buf_reserve(&in->buf, in->buf.len + PIPELINE_IO) != MACH_OKAY) {
+      fprintf(stderr, "line too long\n");
+      exit(1);
+    }
+    ssize_t k = read(0, in->buf.data + in->buf.len, PIPELINE_IO);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k < 0) {
+      fprintf(stderr, "read failed\n");
+    }
+    if (k <= 0) {
+      in->eof = 1;
+    } else {
+      in->buf.len += k;
+    }
+  }
+}
+
+/* serveStep processes a message for a server client's crew, which
+   is a server_step. */
+int serveStep(void *arg, int h, const char *line, size_t line_len, mach_buf *out) {
+  Engine *e = arg;
+  e->h = h;
+  return step(e, line, line_len, out);
+}
+
 int main(int argc, char **argv) {
 
   int useSpecCache = 0;
   int profiling = 0;
   int stats = 0;
+  int changedOnly = 0;
+  int pipelined = 0;
+  int latencies = 0;
+  char *bundleFile = NULL;
+  char *walDir = NULL;
+  char *socketPath = NULL;
+  Wal wal = {0};
+  wal.group = 64;
+  wal.group_ms = 10;
+  wal.snapshot_every = 10000;
   for (int i = 1; i < argc; i++) {
     char *arg = argv[i];
     if (strcmp(arg, "-d") == 0) {
@@ -96,6 +312,31 @@ int main(int argc, char **argv) {
       profiling = 1;
     } else if (strcmp(arg, "-s") == 0) {
       stats = 1;
+    } else if (strcmp(arg, "-n") == 0) {
+      changedOnly = 1;
+    } else if (strcmp(arg, "-P") == 0) {
+      /* Read, process, and write on separate threads (see
+	 pipeline.c). */
+      pipelined = 1;
+    } else if (strcmp(arg, "-L") == 0) {
+      /* Report the message rate and latencies on stderr. */
+      latencies = 1;
+    } else if (strcmp(arg, "-b") == 0 && i + 1 < argc) {
+      /* Specs come from this bundle (see mkbundle.c), and crews
+	 refer to them by their names in the bundle. */
+      bundleFile = argv[++i];
+    } else if (strcmp(arg, "-u") == 0 && i + 1 < argc) {
+      /* Serve clients on this Unix-domain socket (see server.c). */
+      socketPath = argv[++i];
+    } else if (strcmp(arg, "-w") == 0 && i + 1 < argc) {
+      /* Keep the crew in this directory (see wal.c). */
+      walDir = argv[++i];
+    } else if (strcmp(arg, "-g") == 0 && i + 1 < argc) {
+      wal.group = atoi(argv[++i]);
+    } else if (strcmp(arg, "-G") == 0 && i + 1 < argc) {
+      wal.group_ms = atof(argv[++i]);
+    } else if (strcmp(arg, "-S") == 0 && i + 1 < argc) {
+      wal.snapshot_every = strtoul(argv[++i], NULL, 10);
     }
   }
 
@@ -111,7 +352,17 @@ int main(int argc, char **argv) {
     eval("Times.enable(); true;");
   }
 
-  mach_set_spec_provider(NULL, specProvider, MACH_FREE_FOR_PROVIDER);
+  void *bundle = NULL;
+  if (bundleFile != NULL) {
+    bundle = mach_bundle_open(bundleFile);
+    if (bundle == NULL) {
+      printf("mach_bundle_open error '%s'\n", bundleFile);
+      exit(1);
+    }
+    mach_set_spec_provider(bundle, mach_bundle_provider, 0);
+  } else {
+    mach_set_spec_provider(NULL, specProvider, MACH_FREE_FOR_PROVIDER);
+  }
   if (useSpecCache) {
     rc = mach_enable_spec_cache(1);
     if (rc != MACH_OKAY) {
@@ -126,77 +377,143 @@ int main(int argc, char **argv) {
   }
 
 
-  char *crew  = readFile("crew.json");
+  if (walDir != NULL) {
+    /* Otherwise every record would be the whole crew. */
+    changedOnly = 1;
+  }
+  if (changedOnly) {
+    rc = mach_set_steppeds_mode(MACH_STEPPEDS_CHANGED);
+    if (rc != MACH_OKAY) {
+      printf("mach_set_steppeds_mode error %d\n", rc);
+      exit(rc);
+    }
+  }
 
-  {
-    size_t line_limit = 16*1024;
-    size_t max_emitted = 128;
-    char *line = malloc(line_limit);
-    size_t dst_limit = 16*1024;
-    char * steppeds = (char*) malloc(dst_limit);
-    char * dst = (char*) malloc(dst_limit);
+  Engine engine = {0, NULL, MACH_BUF_INIT, MACH_BUF_INIT, NULL, MACH_BUF_INIT};
+  rc = mach_set_emit_handler(&engine, printEmitted);
+  if (rc != MACH_OKAY) {
+    printf("mach_set_emit_handler error %d\n", rc);
+    exit(rc);
+  }
 
-    char * emitted[max_emitted];
-    int i;
-    for (i = 0; i < max_emitted; i++) {
-      emitted[i] = (char*) malloc(dst_limit);
+  /* The crew stays resident in the runtime, so a message doesn't
+     cost parsing and reserializing the whole crew. */
+  int h;
+  if (socketPath != NULL) {
+    /* Each client brings its own crew. */
+    if (walDir != NULL) {
+      printf("-w doesn't work with -u\n");
+      exit(1);
+    }
+    rc = server_run(socketPath, serveStep, &engine);
+    if (rc != MACH_OKAY) {
+      printf("server_run error %d\n", rc);
+      exit(rc);
+    }
+    h = -1;
+  } else if (walDir != NULL) {
+    rc = wal_open(&wal, walDir, "crew.json", &h);
+    if (rc != MACH_OKAY) {
+      printf("wal_open error %d\n", rc);
+      exit(rc);
+    }
+    fprintf(stderr, "recovered record %llu (replayed %llu) in %.3fms\n",
+	    wal.lsn, wal.replayed, wal.recovery_ms);
+  } else {
+    char *crew  = readFile("crew.json");
+    rc = mach_crew_open(crew, &h);
+    if (rc != MACH_OKAY) {
+      printf("mach_crew_open error %d\n", rc);
+      exit(rc);
     }
+    free(crew);
+  }
 
+  engine.h = h;
+  engine.wal = walDir != NULL ? &wal : NULL;
 
-    while (1) {
-      char *s = fgets(line, (int) line_limit, stdin);
-      if (s == NULL) {
-	break;
-      }
-      lgf("in\t%s", line); /* Already has newline. */
+  if (socketPath == NULL) {
+    Latencies lat = {0};
+    double then = pipeline_now_ms();
 
-      rc = mach_crew_process(crew, line, steppeds, dst_limit);
-      if (rc == MACH_OKAY) {
-	lgf("steps\t%s\n", steppeds);
-      } else {
-	printf("mach_crew_process error %d\n", rc);
+    if (pipelined) {
+      rc = pipeline_run(0, 1, step, idle, &engine, latencies ? &lat : NULL);
+      if (rc != MACH_OKAY) {
+	printf("pipeline error %d\n", rc);
 	exit(rc);
       }
-      
-      rc = mach_get_emitted(steppeds, emitted, max_emitted, dst_limit);
-      if (rc == MACH_OKAY) {
-	for (i = 0; i < max_emitted; i++) {
-	  JSON msg = emitted[i];
-	  if (msg[0]) {
-	    printf("out\t%s\n", emitted[i]);
+    } else {
+      /* Lines can be any length, and the buffers grow as needed. */
+      Input input = {MACH_BUF_INIT, 0, 0};
+      mach_buf line = MACH_BUF_INIT;
+      mach_buf out = MACH_BUF_INIT;
+
+      for (;;) {
+	out.len = 0;
+	if (!nextLine(&input, 0, &line)) {
+	  /* Nothing is waiting, so write what's done before waiting. */
+	  rc = idle(&engine, &out);
+	  if (rc != MACH_OKAY) {
+	    exit(rc);
+	  }
+	  fwrite(out.data, 1, out.len, stdout);
+	  fflush(stdout);
+	  out.len = 0;
+	  if (!nextLine(&input, 1, &line)) {
+	    break;
 	  }
 	}
-      } else {
-	printf("emitted error %d\n", rc);
-	exit(rc);
-      }
-
-      rc = mach_crew_update(crew, steppeds, dst, dst_limit);
-      if (rc == MACH_OKAY) {
-	lgf("updated\t%s\n", dst);
-      } else {
-	  printf("update error %d\n", rc);
+	double t = pipeline_now_ms();
+	rc = step(&engine, line.data, line.len, &out);
+	if (rc != MACH_OKAY) {
 	  exit(rc);
+	}
+	fwrite(out.data, 1, out.len, stdout);
+	if (latencies) {
+	  /* Until the output is in stdout's buffer. */
+	  lat_add(&lat, (pipeline_now_ms() - t) * 1e3);
+	}
       }
-      strcpy(crew, dst);
+      mach_buf_free(&input.buf);
+      mach_buf_free(&line);
+      mach_buf_free(&out);
+      fflush(stdout);
     }
 
-    free(line);
-    free(steppeds);
-    free(dst);
-    for (i = 0; i < max_emitted; i++) {
-      free(emitted[i]);
+    if (latencies) {
+      lat_report(pipelined ? "pipelined" : "serial", &lat, pipeline_now_ms() - then);
+      lat_free(&lat);
     }
-    free(crew);
+
+    if (walDir != NULL) {
+      rc = wal_close(&wal);
+      if (rc != MACH_OKAY) {
+	printf("wal_close error %d\n", rc);
+	exit(rc);
+      }
+    }
+
+    mach_crew_close(h);
   }
 
+  mach_buf_free(&engine.steppeds);
+  mach_buf_free(&engine.updated);
+  mach_buf_free(&engine.held);
+
   if (stats) {
-    eval("'SpecCache: ' + JSON.stringify(SpecCache.summary())");
+    char cache[16*1024];
+    rc = mach_spec_cache_stats(cache, sizeof(cache));
+    if (rc == MACH_OKAY) {
+      printf("SpecCache: %s\n", cache);
+    } else {
+      printf("warning: mach_spec_cache_stats rc %d\n", rc);
+    }
     eval("'Stats:     ' + JSON.stringify(Stats)");
     eval("'Times:     ' + JSON.stringify(Times.summary())");
   }
 
   mach_close();
+  mach_bundle_close(bundle);
 
   free(mach_get_ctx());
 }
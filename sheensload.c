@@ -0,0 +1,271 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Load test for 'sheensio -u' (see server.c).
+
+   Usage: sheensload [-c CLIENTS] [-n MESSAGES] [-w WINDOW] [-f CREW] SOCKET
+
+   Each client (a thread) connects, opens a crew (CREW, or a doubler
+   and a turnstile), and sends MESSAGES {"double":N} messages, WINDOW
+   at a time, waiting for the answers to a window before sending the
+   next.  Reports the message rate and latencies (from sending a
+   window to a message's 'ok') for all of the clients together. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "machines.h"
+#include "pipeline.h"
+
+typedef struct {
+  const char *path;
+  const char *crew;
+  int messages;
+  int window;
+  Latencies lat;
+  int errors;
+  int rc;
+  pthread_t thread;
+} Client;
+
+/* Reader buffers a socket's input so it can be read by lines. */
+typedef struct {
+  int fd;
+  char buf[64*1024];
+  size_t start;
+  size_t len;
+} Reader;
+
+/* readLine returns the next line (without its newline) or NULL at the
+   end. */
+static char *readLine(Reader *r) {
+  for (;;) {
+    char *nl = memchr(r->buf + r->start, '\n', r->len - r->start);
+    if (nl != NULL) {
+      char *line = r->buf + r->start;
+      *nl = '\0';
+      r->start = nl + 1 - r->buf;
+      return line;
+    }
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+    if (r->len == sizeof(r->buf)) {
+      fprintf(stderr, "line too long\n");
+      return NULL;
+    }
+    ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return NULL;
+    }
+    r->len += n;
+  }
+}
+
+static int writeAll(int fd, const char *p, size_t n) {
+  while (0 < n) {
+    ssize_t k = write(fd, p, n);
+    if (k < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return MACH_SAD;
+    }
+    p += k;
+    n -= k;
+  }
+  return MACH_OKAY;
+}
+
+static void *client(void *arg) {
+  Client *c = arg;
+  struct sockaddr_un addr;
+  Reader *r = calloc(1, sizeof(Reader));
+  mach_buf out = MACH_BUF_INIT;
+  char msg[64];
+  char *line;
+  int sent = 0;
+
+  c->rc = MACH_SAD;
+  if (r == NULL) {
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, c->path, sizeof(addr.sun_path) - 1);
+  r->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (r->fd < 0 || connect(r->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    goto done;
+  }
+
+  if (writeAll(r->fd, c->crew, strlen(c->crew)) != MACH_OKAY ||
+      writeAll(r->fd, "\n", 1) != MACH_OKAY ||
+      (line = readLine(r)) == NULL) {
+    fprintf(stderr, "couldn't open the crew\n");
+    goto done;
+  }
+  if (strncmp(line, "crew\t", 5) != 0) {
+    fprintf(stderr, "couldn't open the crew: %s\n", line);
+    goto done;
+  }
+
+  while (sent < c->messages) {
+    int n = c->window < c->messages - sent ? c->window : c->messages - sent;
+    int i;
+    out.len = 0;
+    for (i = 0; i < n; i++) {
+      int k = snprintf(msg, sizeof(msg), "{\"double\":%d}\n", sent + i);
+      if (mach_buf_reserve(&out, out.len + k) != MACH_OKAY) {
+        goto done;
+      }
+      memcpy(out.data + out.len, msg, k);
+      out.len += k;
+    }
+    double then = pipeline_now_ms();
+    if (writeAll(r->fd, out.data, out.len) != MACH_OKAY) {
+      perror("write");
+      goto done;
+    }
+    sent += n;
+
+    /* Skip the emitted messages. */
+    while (0 < n) {
+      line = readLine(r);
+      if (line == NULL) {
+        fprintf(stderr, "server hung up\n");
+        goto done;
+      }
+      if (strncmp(line, "out\t", 4) == 0) {
+        continue;
+      }
+      if (strcmp(line, "ok") != 0) {
+        c->errors++;
+      }
+      lat_add(&c->lat, (pipeline_now_ms() - then) * 1e3);
+      n--;
+    }
+  }
+  c->rc = MACH_OKAY;
+
+ done:
+  if (0 <= r->fd) {
+    close(r->fd);
+  }
+  free(r);
+  mach_buf_free(&out);
+  return NULL;
+}
+
+static char *readFile(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "couldn't read '%s'\n", filename);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *s = malloc(n + 1);
+  if (s == NULL || fread(s, 1, n, f) != (size_t)n) {
+    fprintf(stderr, "couldn't read '%s'\n", filename);
+    exit(1);
+  }
+  fclose(f);
+  s[n] = '\0';
+  /* The crew has to be one line. */
+  char *p;
+  for (p = s; *p; p++) {
+    if (*p == '\n' || *p == '\r') {
+      *p = ' ';
+    }
+  }
+  return s;
+}
+
+int main(int argc, char **argv) {
+  int clients = 10, messages = 10000, window = 16, i;
+  char *crew = NULL;
+  char *path = NULL;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      clients = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      messages = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      window = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      crew = readFile(argv[++i]);
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL || clients < 1 || window < 1) {
+    fprintf(stderr, "usage: %s [-c CLIENTS] [-n MESSAGES] [-w WINDOW] [-f CREW] SOCKET\n", argv[0]);
+    exit(1);
+  }
+  if (crew == NULL) {
+    crew = strdup("{\"id\":\"load\",\"machines\":{"
+                  "\"doubler\":{\"spec\":\"specs/double.js\",\"node\":\"listen\",\"bs\":{\"count\":0}},"
+                  "\"turnstile\":{\"spec\":\"specs/turnstile.js\",\"node\":\"locked\",\"bs\":{}}}}");
+  }
+
+  Client *cs = calloc(clients, sizeof(Client));
+  double then = pipeline_now_ms();
+  for (i = 0; i < clients; i++) {
+    cs[i].path = path;
+    cs[i].crew = crew;
+    cs[i].messages = messages;
+    cs[i].window = window;
+    if (pthread_create(&cs[i].thread, NULL, client, &cs[i]) != 0) {
+      fprintf(stderr, "couldn't start client %d\n", i);
+      exit(1);
+    }
+  }
+
+  Latencies lat = {0};
+  int errors = 0, failed = 0;
+  for (i = 0; i < clients; i++) {
+    size_t j;
+    pthread_join(cs[i].thread, NULL);
+    for (j = 0; j < cs[i].lat.n; j++) {
+      lat_add(&lat, cs[i].lat.us[j]);
+    }
+    lat_free(&cs[i].lat);
+    errors += cs[i].errors;
+    failed += cs[i].rc != MACH_OKAY;
+  }
+
+  char label[64];
+  snprintf(label, sizeof(label), "%d clients", clients);
+  lat_report(label, &lat, pipeline_now_ms() - then);
+  if (errors || failed) {
+    fprintf(stderr, "%d errors, %d clients failed\n", errors, failed);
+  }
+
+  lat_free(&lat);
+  free(cs);
+  free(crew);
+  return failed ? 1 : 0;
+}
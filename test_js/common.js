@@ -38,19 +38,23 @@ function run_tests(tests) {
       acc.push(result);
 
       try {
-         try {
-            // Benchmark
-            var rounds = 1000;
-            result.bench = {rounds: null, elapsed: null};
-            var then = Date.now();
-            for (var b = 0; b < rounds; b++) {
-               // make a copy of input params in case the function manipulates
-               var args = Object.assign({}, test.i);
-               test.f.apply(null, args);
+         // Tests with side effects (opening crews, say) can skip the
+         // benchmark.
+         if (!test.noBenchmark) {
+            try {
+               // Benchmark
+               var rounds = 1000;
+               result.bench = {rounds: null, elapsed: null};
+               var then = Date.now();
+               for (var b = 0; b < rounds; b++) {
+                  // make a copy of input params in case the function manipulates
+                  var args = Object.assign({}, test.i);
+                  test.f.apply(null, args);
+               }
+               result.bench.rounds = rounds;
+               result.bench.elapsed = Date.now() - then;
+            } catch (e) {
             }
-            result.bench.rounds = rounds;
-            result.bench.elapsed = Date.now() - then;
-         } catch (e) {
          }
 
          if (test.benchmarkOnly) {
@@ -0,0 +1,269 @@
+// Crew processing: index pruning, changed steppeds, and reindexing.
+//
+// f - function
+// i - inputs
+// w - want
+
+// The specs come from here rather than from files (and don't log), so
+// the only output is the results.
+var crewSpecs = {
+   counter: {
+      name: "counter",
+      parsepatterns: true,
+      nodes: {
+         start: {branching: {branches: [{target: "listen"}]}},
+         listen: {
+            branching: {
+               type: "message",
+               branches: [
+                  {pattern: '{"double":"?x"}', target: "double"},
+                  {pattern: '{"reset":true}', target: "reset"}
+               ]
+            }
+         },
+         double: {
+            action: {
+               interpreter: "ecmascript",
+               source: '_.out({doubled: _.bindings["?x"]*2}); _.bindings.count++; return _.bindings;'
+            },
+            branching: {branches: [{target: "listen"}]}
+         },
+         reset: {
+            action: {
+               interpreter: "ecmascript",
+               source: 'delete _.bindings["?x"]; _.bindings.count = 0; return _.bindings;'
+            },
+            branching: {branches: [{target: "listen"}]}
+         }
+      }
+   },
+   gate: {
+      name: "gate",
+      parsepatterns: true,
+      nodes: {
+         locked: {
+            branching: {
+               type: "message",
+               branches: [{pattern: '{"input":"coin"}', target: "unlocked"}]
+            }
+         },
+         unlocked: {
+            branching: {
+               type: "message",
+               branches: [{pattern: '{"input":"push"}', target: "locked"}]
+            }
+         }
+      }
+   },
+   // Its guard throws, and a branch whose guard throws is taken
+   // with an 'error' binding.
+   thrower: {
+      name: "thrower",
+      parsepatterns: true,
+      nodes: {
+         ready: {
+            branching: {
+               type: "message",
+               branches: [{
+                  pattern: '{"go":1}',
+                  guard: {interpreter: "ecmascript", source: 'throw "kaboom";'},
+                  target: "thrown"
+               }]
+            }
+         },
+         thrown: {}
+      }
+   },
+   // Sees every message, so the index can't rule it out.
+   tally: {
+      name: "tally",
+      nodes: {
+         counting: {
+            branching: {
+               type: "message",
+               branches: [{
+                  guard: {
+                     interpreter: "ecmascript",
+                     source: '_.bindings.seen++; return _.bindings;'
+                  },
+                  target: "counting"
+               }]
+            }
+         }
+      }
+   }
+};
+
+provider = function(name) {
+   var spec = crewSpecs[name];
+   return spec ? JSON.stringify(spec) : null;
+};
+
+var crewJS = JSON.stringify({
+   id: "test",
+   machines: {
+      c1: {spec: "counter", node: "listen", bs: {count: 0}},
+      g1: {spec: "gate", node: "locked", bs: {}},
+      c2: {spec: "counter", node: "listen", bs: {count: 10}},
+      t1: {spec: "tally", node: "counting", bs: {seen: 0}},
+      g2: {spec: "gate", node: "unlocked", bs: {}}
+   }
+});
+
+var crewMessages = [
+   {double: 1},
+   {input: "coin"},
+   {input: "push"},
+   {other: 1},
+   {double: 2},
+   {reset: true},
+   {input: "coin"}
+];
+
+// canonical is JSON with sorted keys.
+function canonical(x) {
+   if (x === null || typeof x != 'object') {
+      return JSON.stringify(x);
+   }
+   if (Array.isArray(x)) {
+      return "[" + x.map(canonical).join(",") + "]";
+   }
+   return "{" + Object.keys(x).sort().map(function(k) {
+      return JSON.stringify(k) + ":" + canonical(x[k]);
+   }).join(",") + "}";
+}
+
+// prunedSteppeds processes the messages with a resident crew, whose
+// index prunes machines, and with crew JSON, which isn't indexed.
+function prunedSteppeds(mode) {
+   SpecCache.enable();
+   Cfg.Steppeds = mode;
+   var pruned = Stats.CrewIndexPruned;
+   var h = CrewOpen(crewJS);
+   var crew = crewJS;
+   var acc = {same: true, pruned: false};
+   for (var i = 0; i < crewMessages.length; i++) {
+      var message = JSON.stringify(crewMessages[i]);
+      var p = CrewHandleProcess(h, message);
+      var u = CrewProcess(crew, message);
+      crew = CrewUpdate(crew, u);
+      if (p != u) {
+         acc = {same: false, message: message, pruned: p, unpruned: u};
+         break;
+      }
+   }
+   acc.pruned = acc.same ? pruned < Stats.CrewIndexPruned : acc.pruned;
+   CrewClose(h);
+   Cfg.Steppeds = "full";
+   return [acc];
+}
+
+// changedRoundTrip gives the messages to a crew with full steppeds,
+// to a copy with changed steppeds, and to a resident crew that's
+// updated with the changed steppeds, and reports whether they all end
+// up the same.
+function changedRoundTrip(crew_js, messages) {
+   var full = crew_js, changed = crew_js;
+   var h = CrewOpen(crew_js);
+   for (var i = 0; i < messages.length; i++) {
+      var message = JSON.stringify(messages[i]);
+      Cfg.Steppeds = "full";
+      full = CrewUpdate(full, CrewProcess(full, message));
+      Cfg.Steppeds = "changed";
+      var steppeds = CrewProcess(changed, message);
+      changed = CrewUpdate(changed, steppeds);
+      CrewHandleUpdate(h, steppeds);
+   }
+   Cfg.Steppeds = "full";
+   var resident = CrewExport(h);
+   CrewClose(h);
+   full = canonical(JSON.parse(full));
+   return [{
+      changed: canonical(JSON.parse(changed)) == full,
+      resident: canonical(JSON.parse(resident)) == full
+   }];
+}
+
+// reinstalledSpec opens a resident crew, changes the pattern that the
+// machine's node wants, and reinstalls the spec (via 'reinstall').
+// Then a message for the new pattern should move the machine.
+function reinstalledSpec(reinstall) {
+   var spec = function(key) {
+      return JSON.stringify({name: "w", parsepatterns: true, nodes: {
+         wait: {branching: {type: "message", branches: [
+            {pattern: '{"' + key + '":"?x"}', target: "got"}]}},
+         got: {}
+      }});
+   };
+   SpecCache.enable();
+   SpecCache.clear();
+   Cfg.Steppeds = "changed";
+   crewSpecs.w = JSON.parse(spec("a"));
+   var h = CrewOpen(JSON.stringify({id: "w", machines: {m: {spec: "w", node: "wait", bs: {}}}}));
+   crewSpecs.w = JSON.parse(spec("z"));
+   reinstall(spec("z"));
+   var steppeds = JSON.parse(CrewHandleProcess(h, JSON.stringify({z: 1})));
+   CrewClose(h);
+   Cfg.Steppeds = "full";
+   SpecCache.setLimit(DefaultSpecCacheLimit);
+   return [{node: steppeds.m && steppeds.m.diff ? steppeds.m.diff.node : null}];
+}
+
+// afterEviction evicts the spec and then gets it again.
+function afterEviction(js) {
+   SpecCache.setLimit(1);
+   GetSpec("gate");
+   GetSpec("w");
+}
+
+function afterPreload(js) {
+   PreloadSpecs([{name: "w", js: js}]);
+}
+
+var tests = [
+   {
+      "title": "Index pruning doesn't change full steppeds",
+      "f": prunedSteppeds,
+      "i": ["full"],
+      "w": [{"same": true, "pruned": true}],
+      "noBenchmark": true
+   },
+   {
+      "title": "Index pruning doesn't change changed steppeds",
+      "f": prunedSteppeds,
+      "i": ["changed"],
+      "w": [{"same": true, "pruned": true}],
+      "noBenchmark": true
+   },
+   {
+      "title": "Changed steppeds update a crew like full steppeds",
+      "f": changedRoundTrip,
+      "i": [crewJS, crewMessages],
+      "w": [{"changed": true, "resident": true}],
+      "noBenchmark": true
+   },
+   {
+      "title": "Changed steppeds keep the error binding from a guard that throws",
+      "f": changedRoundTrip,
+      "i": [JSON.stringify({id: "t", machines: {m: {spec: "thrower", node: "ready", bs: {}}}}),
+            [{go: 1}]],
+      "w": [{"changed": true, "resident": true}],
+      "noBenchmark": true
+   },
+   {
+      "title": "A spec reinstalled after eviction reindexes resident crews",
+      "f": reinstalledSpec,
+      "i": [afterEviction],
+      "w": [{"node": "got"}],
+      "noBenchmark": true
+   },
+   {
+      "title": "A preloaded spec reindexes resident crews",
+      "f": reinstalledSpec,
+      "i": [afterPreload],
+      "w": [{"node": "got"}],
+      "noBenchmark": true
+   }
+];
+
+print(run_tests(tests));
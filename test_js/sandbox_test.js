@@ -0,0 +1,71 @@
+// Pooled sandbox heaps are reused, so what one action does to a
+// heap's globals must not show up in the next action that gets that
+// heap.
+//
+// f - function
+// i - inputs
+// w - want
+
+function sandboxTwice(first, second) {
+   sandbox(first);
+   return [{"got": sandbox(second)}];
+}
+
+// sandboxBoth is sandboxTwice but also returns what the first call
+// got.
+function sandboxBoth(first, second) {
+   return [{"got": [sandbox(first), sandbox(second)]}];
+}
+
+var tests = [
+   {
+      "title": "Reassigned built-in globals don't leak",
+      "f": sandboxTwice,
+      "i": ["JSON = null; Math = {max: function() { return 42; }}; print = 1; 'ok'",
+            "typeof JSON.stringify + ' ' + Math.max(1, 2) + ' ' + typeof print"],
+      "w": [{"got": "function 2 function"}],
+      "noBenchmark": true
+   },
+   {
+      "title": "New globals don't leak",
+      "f": sandboxTwice,
+      "i": ["leaked = 1; 'ok'",
+            "typeof leaked"],
+      "w": [{"got": "undefined"}],
+      "noBenchmark": true
+   },
+   {
+      "title": "Patched prototypes don't leak",
+      "f": sandboxTwice,
+      "i": ["try { Array.prototype.push = null; } catch (e) {} try { Object.prototype.x = 1; } catch (e) {} try { delete Array.prototype.map; } catch (e) {} 'ok'",
+            "typeof [].push + ' ' + ({}).x + ' ' + typeof [].map"],
+      "w": [{"got": "function undefined function"}],
+      "noBenchmark": true
+   },
+   {
+      "title": "Objects held by built-ins are reset, too",
+      "f": sandboxTwice,
+      "i": ["try { Duktape.Pointer.prototype.x = 1; } catch (e) {} 'ok'",
+            "'' + Duktape.Pointer.prototype.x"],
+      "w": [{"got": "undefined"}],
+      "noBenchmark": true
+   },
+   {
+      "title": "An action can patch built-ins for itself",
+      "f": sandboxBoth,
+      "i": ["Array.prototype.sum = function() { return 3; }; Duktape.Pointer.prototype.x = 1; [].sum() + ' ' + Duktape.Pointer.prototype.x",
+            "typeof [].sum + ' ' + Duktape.Pointer.prototype.x"],
+      "w": [{"got": ["3 1", "undefined undefined"]}],
+      "noBenchmark": true
+   },
+   {
+      "title": "An action's own objects can override what they inherit",
+      "f": sandboxTwice,
+      "i": ["'ok'",
+            "(function() { var o = {}; o.toString = function() { return 'mine'; }; var e = new Error(); e.message = 'm'; return '' + o + ' ' + e.message; })()"],
+      "w": [{"got": "mine m"}],
+      "noBenchmark": true
+   }
+];
+
+print(run_tests(tests));
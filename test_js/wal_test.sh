@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# WAL recovery (see wal.c): 'sheensio -w' recovers its crew from a log
+# whose last record a crash tore.  Run from the top directory after
+# building sheensio and specs/double.js.  Quiet unless something's
+# wrong.
+
+TOP=$PWD
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR"
+
+fail() {
+    echo "wal_test: $*"
+    exit 1
+}
+
+# Every record is committed by itself, and there are no snapshots.
+run() {
+    "$TOP/sheensio" -d -w log -g 1 -S 0 > out 2> err
+}
+
+echo "{\"id\":\"wal\",\"machines\":{\"doubler\":{\"spec\":\"$TOP/specs/double.js\",\"node\":\"listen\",\"bs\":{\"count\":0}}}}" > crew.json
+
+printf '{"double":1}\n{"double":2}\n{"double":3}\n' | run || fail "first run failed"
+[ "$(grep -c doubled out)" = 3 ] || fail "wanted 3 outputs, got $(cat out)"
+
+# Cut the last record short, as a crash in the middle of writing it
+# would.
+size=$(wc -c < log/wal)
+head -c $((size - 5)) log/wal > torn
+cat torn > log/wal
+
+echo '{"double":4}' | run || fail "recovery failed: $(cat err)"
+grep -q "dropping .* bytes after record 2" err || fail "torn record wasn't dropped: $(cat err)"
+grep -q "recovered record 2 (replayed 2)" err || fail "wanted 2 records: $(cat err)"
+# Two recovered doublings and this one.
+grep '^updated' err | tail -1 | grep -q '"count":3' || fail "wanted count 3: $(grep '^updated' err)"
+
+# The new record took the torn one's place.
+run < /dev/null || fail "second recovery failed: $(cat err)"
+grep -q "recovered record 3 (replayed 3)" err || fail "wanted 3 records: $(cat err)"
+grep -q "dropping" err && fail "dropped a good record: $(cat err)"
+
+# A recovered crew is the crew that crashed, even after a guard threw
+# (which adds an 'error' binding).
+rm -rf log
+cat > thrower.js <<EOF
+{"name": "thrower", "parsepatterns": true, "nodes": {
+  "ready": {"branching": {"type": "message", "branches": [
+    {"pattern": "{\"go\":1}",
+     "guard": {"interpreter": "ecmascript", "source": "throw 'kaboom';"},
+     "target": "thrown"}]}},
+  "thrown": {}}}
+EOF
+echo "{\"id\":\"wal\",\"machines\":{\"doubler\":{\"spec\":\"$TOP/specs/double.js\",\"node\":\"listen\",\"bs\":{\"count\":0}},\"thrower\":{\"spec\":\"$DIR/thrower.js\",\"node\":\"ready\",\"bs\":{}}}}" > crew.json
+
+# The crew as of the last message, with sorted keys.
+crew() {
+    grep '^updated' err | tail -1 | cut -f 2 | jq -S -c .
+}
+
+printf '{"go":1}\n{"double":1}\n' | run || fail "throwing run failed: $(cat err)"
+live=$(crew)
+echo "$live" | grep -q '"error":' || fail "wanted an error binding: $live"
+# Nothing wants this message, so the crew after it is the recovered
+# crew.
+echo '{"nothing":1}' | run || fail "throwing recovery failed: $(cat err)"
+[ "$(crew)" = "$live" ] || fail "recovered $(crew), but the crew was $live"
+exit 0
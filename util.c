@@ -10,7 +10,11 @@
  * limitations under the License.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <string.h>
+#include <dirent.h>
 
 #include "machines.h"
 
@@ -88,3 +92,57 @@ int evalFiles(int argc, char **argv) {
   }
   return some_rc;
 }
+
+/* specNames finds the specs (files ending in ".js") in the given
+   directory and returns their names without the ".js", which is what
+   specProvider wants when the directory is "specs".  Free the result
+   with freeSpecNames.  Returns the number of names or -1 if the
+   directory couldn't be read. */
+int specNames(const char *dir, char ***names) {
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  int n = 0, most = 16;
+
+  if (d == NULL) {
+    fprintf(stderr, "couldn't read '%s'\n", dir);
+    return -1;
+  }
+
+  *names = malloc(most * sizeof(char *));
+  while ((e = readdir(d)) != NULL) {
+    size_t len = strlen(e->d_name);
+    if (len <= 3 || strcmp(e->d_name + len - 3, ".js") != 0) {
+      continue;
+    }
+    if (n == most) {
+      most *= 2;
+      *names = realloc(*names, most * sizeof(char *));
+    }
+    (*names)[n] = strndup(e->d_name, len - 3);
+    n++;
+  }
+  closedir(d);
+
+  return n;
+}
+
+void freeSpecNames(char **names, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    free(names[i]);
+  }
+  free(names);
+}
+
+/* preloadSpecDir preloads (see mach_preload_specs) all of the specs in
+   the given directory and writes the report to dst. */
+int preloadSpecDir(const char *dir, JSON dst, size_t limit) {
+  char **names;
+  int n = specNames(dir, &names);
+  if (n < 0) {
+    return MACH_SAD;
+  }
+  int rc = mach_preload_specs(names, n, dst, limit);
+  freeSpecNames(names, n);
+  return rc;
+}
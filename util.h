@@ -15,3 +15,9 @@ char *readFile(const char *filename) ;
 char *specProvider(void *this, const char *specname, const char *cached) ;
 
 int evalFiles(int argc, char **argv) ;
+
+int specNames(const char *dir, char ***names) ;
+
+void freeSpecNames(char **names, int n) ;
+
+int preloadSpecDir(const char *dir, char *dst, size_t limit) ;
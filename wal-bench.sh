@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# WAL throughput and recovery time for sheensio with a big crew.
+#
+#   ./wal-bench.sh [MACHINES] [MESSAGES] [DOUBLERS]
+#
+# The crew is mostly turnstiles, which ignore the messages, and a few
+# doublers, which change with each message, so the log gets small
+# records and the snapshots get the whole crew.
+
+M=${1:-100000}
+N=${2:-10000}
+D=${3:-10}
+DIR=wal-bench.d
+
+set -e
+
+make specs/turnstile.js specs/double.js sheensio
+
+(echo '{"id":"bench","machines":{'
+ for I in `seq $M`; do
+     [ $I = 1 ] || echo ','
+     if [ $I -le $D ]; then
+	 echo "\"d$I\":{\"spec\":\"specs/double.js\",\"node\":\"listen\",\"bs\":{\"count\":0}}"
+     else
+	 echo "\"t$I\":{\"spec\":\"specs/turnstile.js\",\"node\":\"locked\",\"bs\":{}}"
+     fi
+ done
+ echo '}}') > crew.json
+
+for I in `seq $N`; do echo "{\"double\":$I}"; done > wal-bench.input
+
+rm -rf $DIR
+
+echo "Processing $N messages for $M machines with the log in $DIR."
+time (./sheensio -c -w $DIR < wal-bench.input > wal-bench.output)
+
+echo "Log: $(du -sh $DIR)"
+
+echo "Recovering."
+time (./sheensio -c -w $DIR < /dev/null > /dev/null)
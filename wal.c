@@ -0,0 +1,359 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A write-ahead log for a resident crew, which sheensio uses so that
+   a crash doesn't lose the crew.
+
+   A directory holds a snapshot of the crew and a log of the steppeds
+   that processing has written since then.  Applying the logged
+   steppeds (mach_crew_handle_update) to the snapshot recovers the
+   crew without running any actions again.
+
+   The log ('wal') is a sequence of records:
+
+     lsn       8 bytes, the record's number (1, 2, 3, ...)
+     length    4 bytes, the length of the steppeds
+     checksum  4 bytes, CRC-32 of the above and the steppeds
+     steppeds  JSON
+
+   with numbers in little-endian order.  Recovery stops at the first
+   record that's short or has a bad checksum (the tail of a write that
+   a crash interrupted) and truncates the log there.
+
+   Records are committed (written and synced) in groups, so a crash
+   can lose the last group (up to 'group' records).  Every
+   'snapshot_every' records, the crew is written to 'snapshot.tmp',
+   which is synced and renamed to 'snapshot', and the log starts over.
+   The snapshot's first line is the number of the last record it
+   includes, so recovery skips log records that a crash left behind
+   after a snapshot. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "machines.h"
+#include "wal.h"
+
+#define WAL_HEADER (8 + 4 + 4)
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t n) {
+  if (crc_table[1] == 0) {
+    uint32_t i, j;
+    for (i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (j = 0; j < 8; j++) {
+	c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      crc_table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while (n--) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void put_le(unsigned char *p, uint64_t n, int bytes) {
+  int i;
+  for (i = 0; i < bytes; i++) {
+    p[i] = (n >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+  uint64_t n = 0;
+  int i;
+  for (i = bytes - 1; 0 <= i; i--) {
+    n = n << 8 | p[i];
+  }
+  return n;
+}
+
+static char *path(const Wal *w, const char *name) {
+  size_t n = strlen(w->dir) + strlen(name) + 2;
+  char *p = malloc(n);
+  snprintf(p, n, "%s/%s", w->dir, name);
+  return p;
+}
+
+/* slurp reads the whole file, or returns NULL if it can't. */
+static char *slurp(const char *filename, size_t *len) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buf = malloc(n + 1);
+  if (buf != NULL && fread(buf, 1, n, f) != (size_t)n) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  if (buf != NULL) {
+    buf[n] = '\0';
+    *len = n;
+  }
+  return buf;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+  while (0 < n) {
+    ssize_t k = write(fd, p, n);
+    if (k < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return MACH_SAD;
+    }
+    p += k;
+    n -= k;
+  }
+  return MACH_OKAY;
+}
+
+/* sync_dir syncs the directory so a rename in it is durable. */
+static int sync_dir(const Wal *w) {
+  int fd = open(w->dir, O_RDONLY);
+  if (fd < 0) {
+    return MACH_SAD;
+  }
+  int rc = fsync(fd) == 0 ? MACH_OKAY : MACH_SAD;
+  close(fd);
+  return rc;
+}
+
+/* replay applies the log's records after the snapshot to the crew
+   and returns the length of the log's good prefix. */
+static size_t replay(Wal *w, int h, const char *log, size_t len) {
+  const unsigned char *p = (const unsigned char *)log;
+  size_t at = 0;
+
+  while (WAL_HEADER <= len - at) {
+    uint64_t lsn = get_le(p + at, 8);
+    size_t n = get_le(p + at + 8, 4);
+    uint32_t sum = get_le(p + at + 12, 4);
+    if (len - at - WAL_HEADER < n) {
+      break;
+    }
+    uint32_t crc = crc32(0, p + at, 12);
+    crc = crc32(crc, p + at + WAL_HEADER, n);
+    if (crc != sum) {
+      break;
+    }
+    if (w->lsn < lsn) {
+      if (lsn != w->lsn + 1) {
+	fprintf(stderr, "wal: record %llu follows %llu\n", (unsigned long long)lsn, w->lsn);
+	break;
+      }
+      mach_buf steppeds = {(char *)p + at + WAL_HEADER, n, 0};
+      if (mach_crew_handle_update_buf(h, &steppeds) != MACH_OKAY) {
+	fprintf(stderr, "wal: couldn't apply record %llu\n", (unsigned long long)lsn);
+	break;
+      }
+      w->lsn = lsn;
+      w->replayed++;
+    }
+    at += WAL_HEADER + n;
+  }
+
+  return at;
+}
+
+int wal_open(Wal *w, const char *dir, const char *crew, int *h) {
+  double then = now_ms();
+  size_t len;
+  char *p;
+
+  w->dir = strdup(dir);
+  w->fd = -1;
+  w->lsn = 0;
+  w->buf = (mach_buf)MACH_BUF_INIT;
+  w->pending = 0;
+  w->since_snapshot = 0;
+  w->replayed = 0;
+  if (w->group <= 0) {
+    w->group = 1;
+  }
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "wal: couldn't make '%s'\n", dir);
+    return MACH_SAD;
+  }
+
+  /* The snapshot if there is one.  Otherwise the initial crew. */
+  p = path(w, "snapshot");
+  char *snapshot = slurp(p, &len);
+  free(p);
+  mach_buf crew_buf;
+  if (snapshot != NULL) {
+    char *nl = strchr(snapshot, '\n');
+    if (nl == NULL) {
+      fprintf(stderr, "wal: bad snapshot in '%s'\n", dir);
+      free(snapshot);
+      return MACH_SAD;
+    }
+    w->lsn = strtoull(snapshot, NULL, 10);
+    crew_buf = (mach_buf){nl + 1, len - (nl + 1 - snapshot), 0};
+  } else {
+    snapshot = slurp(crew, &len);
+    if (snapshot == NULL) {
+      fprintf(stderr, "wal: couldn't read '%s'\n", crew);
+      return MACH_SAD;
+    }
+    crew_buf = (mach_buf){snapshot, len, 0};
+  }
+  int rc = mach_crew_open_buf(&crew_buf, h);
+  free(snapshot);
+  if (rc != MACH_OKAY) {
+    return rc;
+  }
+
+  p = path(w, "wal");
+  w->fd = open(p, O_RDWR | O_CREAT | O_APPEND, 0644);
+  char *log = slurp(p, &len);
+  free(p);
+  if (w->fd < 0 || log == NULL) {
+    fprintf(stderr, "wal: couldn't open the log in '%s'\n", dir);
+    free(log);
+    return MACH_SAD;
+  }
+  size_t good = replay(w, *h, log, len);
+  free(log);
+  if (good < len) {
+    fprintf(stderr, "wal: dropping %zu bytes after record %llu\n", len - good, w->lsn);
+    if (ftruncate(w->fd, good) != 0 || fsync(w->fd) != 0) {
+      return MACH_SAD;
+    }
+  }
+
+  w->last_commit = now_ms();
+  w->recovery_ms = w->last_commit - then;
+  return MACH_OKAY;
+}
+
+int wal_commit(Wal *w) {
+  if (w->pending == 0) {
+    return MACH_OKAY;
+  }
+  if (write_all(w->fd, w->buf.data, w->buf.len) != MACH_OKAY || fsync(w->fd) != 0) {
+    fprintf(stderr, "wal: commit failed\n");
+    return MACH_SAD;
+  }
+  w->buf.len = 0;
+  w->pending = 0;
+  w->last_commit = now_ms();
+  return MACH_OKAY;
+}
+
+int wal_append(Wal *w, int h, const mach_buf *steppeds) {
+  /* Steppeds that don't report any machines don't change anything. */
+  if (steppeds->len <= 2) {
+    return MACH_OKAY;
+  }
+
+  if (mach_buf_reserve(&w->buf, w->buf.len + WAL_HEADER + steppeds->len) != MACH_OKAY) {
+    return MACH_SAD;
+  }
+  unsigned char *rec = (unsigned char *)w->buf.data + w->buf.len;
+  put_le(rec, w->lsn + 1, 8);
+  put_le(rec + 8, steppeds->len, 4);
+  memcpy(rec + WAL_HEADER, steppeds->data, steppeds->len);
+  uint32_t crc = crc32(0, rec, 12);
+  put_le(rec + 12, crc32(crc, rec + WAL_HEADER, steppeds->len), 4);
+  w->buf.len += WAL_HEADER + steppeds->len;
+  w->lsn++;
+  w->pending++;
+  w->since_snapshot++;
+
+  if (w->group <= w->pending ||
+      (0 < w->group_ms && w->group_ms <= now_ms() - w->last_commit)) {
+    if (wal_commit(w) != MACH_OKAY) {
+      return MACH_SAD;
+    }
+  }
+  if (0 < w->snapshot_every && w->snapshot_every <= w->since_snapshot) {
+    return wal_snapshot(w, h);
+  }
+  return MACH_OKAY;
+}
+
+int wal_snapshot(Wal *w, int h) {
+  mach_buf crew = MACH_BUF_INIT;
+  char lsn[32];
+  int rc;
+
+  if (wal_commit(w) != MACH_OKAY) {
+    return MACH_SAD;
+  }
+  rc = mach_crew_export_buf(h, &crew);
+  if (rc != MACH_OKAY) {
+    return rc;
+  }
+
+  char *tmp = path(w, "snapshot.tmp");
+  char *snapshot = path(w, "snapshot");
+  int n = snprintf(lsn, sizeof(lsn), "%llu\n", w->lsn);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int written = 0 <= fd &&
+    write_all(fd, lsn, n) == MACH_OKAY &&
+    write_all(fd, crew.data, crew.len) == MACH_OKAY &&
+    fsync(fd) == 0;
+  if (0 <= fd && close(fd) != 0) {
+    written = 0;
+  }
+  rc = MACH_SAD;
+  if (written && rename(tmp, snapshot) == 0 && sync_dir(w) == MACH_OKAY) {
+    /* The snapshot has everything in the log now. */
+    if (ftruncate(w->fd, 0) == 0 && fsync(w->fd) == 0) {
+      rc = MACH_OKAY;
+    }
+  }
+  if (rc != MACH_OKAY) {
+    fprintf(stderr, "wal: snapshot failed\n");
+  }
+  w->since_snapshot = 0;
+
+  free(tmp);
+  free(snapshot);
+  mach_buf_free(&crew);
+  return rc;
+}
+
+int wal_close(Wal *w) {
+  int rc = wal_commit(w);
+  if (0 <= w->fd) {
+    close(w->fd);
+  }
+  mach_buf_free(&w->buf);
+  free(w->dir);
+  return rc;
+}
@@ -0,0 +1,58 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A write-ahead log for a resident crew (see wal.c).  Include
+   machines.h first. */
+
+typedef struct {
+  char *dir;
+  int fd;
+  /* lsn is the number of the last record appended. */
+  unsigned long long lsn;
+  /* buf holds records that haven't been written yet. */
+  mach_buf buf;
+  int pending;
+  double last_commit;
+  unsigned long since_snapshot;
+
+  /* group is how many records are committed (written and synced)
+     together.  If group_ms isn't zero, a record that comes group_ms
+     milliseconds after the last commit is committed, too. */
+  int group;
+  double group_ms;
+  /* snapshot_every is how many records go between snapshots (zero
+     for no snapshots). */
+  unsigned long snapshot_every;
+
+  /* Recovery statistics. */
+  unsigned long long replayed;
+  double recovery_ms;
+} Wal;
+
+/* wal_open recovers the crew in dir from its snapshot (or, if there
+   isn't one, from the file crew) and log, and opens it as a resident
+   crew, whose handle is written to h. */
+int wal_open(Wal *w, const char *dir, const char *crew, int *h) ;
+
+/* wal_append logs steppeds that the resident crew h wrote and then
+   commits and takes a snapshot as needed. */
+int wal_append(Wal *w, int h, const mach_buf *steppeds) ;
+
+/* wal_commit writes and syncs the records that haven't been. */
+int wal_commit(Wal *w) ;
+
+/* wal_snapshot writes the resident crew to the snapshot and starts a
+   new log. */
+int wal_snapshot(Wal *w, int h) ;
+
+/* wal_close commits and closes the log. */
+int wal_close(Wal *w) ;
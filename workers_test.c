@@ -0,0 +1,278 @@
+/* Copyright 2018 Comcast Cable Communications Management, LLC
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* workers_test checks that mach_crew_process_buf gives the same
+   steppeds with workers (see mach_set_workers) as without them, for
+   JSON and CBOR crews, full and changed steppeds, messages with and
+   without "to", crews with and without machines, and machine ids
+   that need escaping in JSON.  It also checks that the emit handler
+   gets the same messages.  The workers merge their steppeds and emit
+   in shard order, so steppeds are compared with their keys sorted,
+   and emitted messages are sorted.
+
+   Run from the top-level directory so that specs/double.js can be
+   found.  Writes what's wrong to stderr and exits with 1 if anything
+   is. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "duktape.h"
+#include "machines.h"
+#include "util.h"
+
+#define WORKERS (4)
+
+/* A machine with the given id (as JSON). */
+#define MACHINE(id) id ":{\"spec\":\"double\",\"node\":\"listen\",\"bs\":{\"count\":0}}"
+
+/* The ids that need escaping are a quote, a backslash, a newline, an
+   escaped slash, and escaped and unescaped non-ASCII.  One machine is
+   called "machines". */
+#define MACHINES "{" \
+  MACHINE("\"m0\"") "," MACHINE("\"m1\"") "," MACHINE("\"m2\"") "," \
+  MACHINE("\"q\\\"uote\"") "," MACHINE("\"back\\\\slash\"") "," \
+  MACHINE("\"new\\nline\"") "," MACHINE("\"\\/slash\"") "," \
+  MACHINE("\"\\u00e9t\\u00e9\"") "," MACHINE("\"\xe2\x98\x83\"") "," \
+  MACHINE("\"machines\"") "}"
+
+static const char *crews[] = {
+  "{\"id\":\"w\",\"machines\":" MACHINES "}",
+  "{\"machines\":" MACHINES ",\"id\":\"w\",\"more\":[{\"machines\":{}}]}",
+  "{\"id\":\"w\",\"machines\":{}}",
+  "{\"id\":\"w\"}",
+  NULL
+};
+
+static const char *messages[] = {
+  "{\"double\":3}",
+  "{\"double\":\"x\"}",
+  "{\"double\":4,\"to\":\"q\\\"uote\"}",
+  "{\"double\":5,\"to\":[\"m1\",\"back\\\\slash\",\"\\u00e9t\\u00e9\",\"machines\"]}",
+  "{\"double\":6,\"to\":\"nobody\"}",
+  NULL
+};
+
+char * quietProvider(void *this, const char *specname, const char *cached) {
+  char file_name[4096];
+  snprintf(file_name, sizeof(file_name), "specs/%s.js", specname);
+  return readFile(file_name);
+}
+
+/* canon is ECMAScript that writes a value as JSON with sorted
+   keys. */
+static const char *canon_js =
+  "function canon(x) {\n"
+  "  if (Array.isArray(x)) return '[' + x.map(canon).join(',') + ']';\n"
+  "  if (x && typeof x == 'object') {\n"
+  "    return '{' + Object.keys(x).sort().map(function(k) {\n"
+  "      return JSON.stringify(k) + ':' + canon(x[k]);\n"
+  "    }).join(',') + '}';\n"
+  "  }\n"
+  "  return JSON.stringify(x);\n"
+  "}";
+
+/* decode_canon replaces the JSON or CBOR (if *udata) at the top of
+   the stack with canon's string for it. */
+static duk_ret_t decode_canon(duk_context *d, void *udata) {
+  if (*(int *)udata) {
+    duk_cbor_decode(d, -1, 0);
+  } else {
+    duk_json_decode(d, -1);
+  }
+  duk_get_global_string(d, "canon");
+  duk_swap_top(d, -2);
+  duk_call(d, 1);
+  return 1;
+}
+
+/* canonical returns canon's string for the steppeds in b (or NULL
+   if they don't decode).  Free it. */
+static char *canonical(duk_context *d, const mach_buf *b, int binary) {
+  char *s = NULL;
+  if (binary) {
+    memcpy(duk_push_fixed_buffer(d, b->len), b->data, b->len);
+  } else {
+    duk_push_lstring(d, b->data, b->len);
+  }
+  if (duk_safe_call(d, decode_canon, &binary, 1, 1) == DUK_EXEC_SUCCESS) {
+    s = strdup(duk_get_string(d, -1));
+  }
+  duk_pop(d);
+  return s;
+}
+
+/* encode_cbor replaces the JSON at the top of the stack with its
+   CBOR encoding. */
+static duk_ret_t encode_cbor(duk_context *d, void *udata) {
+  duk_json_decode(d, -1);
+  duk_cbor_encode(d, -1, 0);
+  return 1;
+}
+
+/* wire sets b to the JSON s or its CBOR encoding. */
+static void wire(duk_context *d, const char *s, int binary, mach_buf *b) {
+  if (!binary) {
+    mach_buf_set(b, s, strlen(s));
+    return;
+  }
+  duk_push_string(d, s);
+  if (duk_safe_call(d, encode_cbor, NULL, 1, 1) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "workers_test: couldn't encode %s\n", s);
+    exit(1);
+  }
+  duk_size_t n;
+  const char *cbor = duk_get_buffer_data(d, -1, &n);
+  mach_buf_set(b, cbor, n);
+  duk_pop(d);
+}
+
+/* The messages that the emit handler got for the current message,
+   each as "MID MESSAGE". */
+static char *emitted[1024];
+static int nemitted;
+
+static void emit(void *arg, const char *mid, const char *message, size_t n) {
+  if (nemitted == sizeof(emitted) / sizeof(emitted[0])) {
+    fprintf(stderr, "workers_test: too many emitted messages\n");
+    exit(1);
+  }
+  char *s = malloc(strlen(mid) + n + 2);
+  sprintf(s, "%s %.*s", mid, (int)n, message);
+  emitted[nemitted++] = s;
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* with_emitted appends the sorted emitted messages to the steppeds
+   s (and frees s and the messages). */
+static char *with_emitted(char *s) {
+  size_t n = strlen(s) + 1;
+  int i;
+  qsort(emitted, nemitted, sizeof(char *), compare_strings);
+  for (i = 0; i < nemitted; i++) {
+    n += strlen(emitted[i]) + 1;
+  }
+  char *acc = malloc(n);
+  strcpy(acc, s);
+  for (i = 0; i < nemitted; i++) {
+    strcat(acc, "\n");
+    strcat(acc, emitted[i]);
+    free(emitted[i]);
+  }
+  nemitted = 0;
+  free(s);
+  return acc;
+}
+
+static int count(const char **xs) {
+  int n = 0;
+  while (xs[n] != NULL) {
+    n++;
+  }
+  return n;
+}
+
+/* steppeds processes each message for each crew with the given
+   number of workers and returns the canonical steppeds (in order),
+   followed by the emitted messages, which are NULL where processing
+   failed. */
+static char **steppeds(duk_context *d, int workers, int binary) {
+  int ncrews = count(crews), nmessages = count(messages), i, j;
+  char **acc = calloc(ncrews * nmessages, sizeof(char *));
+  mach_buf crew = MACH_BUF_INIT, message = MACH_BUF_INIT, dst = MACH_BUF_INIT;
+
+  if (mach_set_workers(workers) != MACH_OKAY) {
+    fprintf(stderr, "workers_test: couldn't start %d workers\n", workers);
+    exit(1);
+  }
+  for (i = 0; i < ncrews; i++) {
+    wire(d, crews[i], binary, &crew);
+    for (j = 0; j < nmessages; j++) {
+      wire(d, messages[j], binary, &message);
+      if (mach_crew_process_buf(&crew, &message, &dst) == MACH_OKAY) {
+        char *s = canonical(d, &dst, binary);
+        acc[i * nmessages + j] = s ? with_emitted(s) : NULL;
+      }
+      while (0 < nemitted) {
+        free(emitted[--nemitted]);
+      }
+    }
+  }
+
+  mach_buf_free(&crew);
+  mach_buf_free(&message);
+  mach_buf_free(&dst);
+  return acc;
+}
+
+int main(int argc, char **argv) {
+  int binary, mode, i, j, failures = 0;
+  int nmessages = count(messages);
+
+  mach_set_ctx(mach_make_ctx());
+  if (mach_open() != MACH_OKAY) {
+    fprintf(stderr, "workers_test: mach_open failed\n");
+    exit(1);
+  }
+  mach_set_spec_provider(NULL, quietProvider, MACH_FREE_FOR_PROVIDER);
+  if (mach_set_emit_handler(NULL, emit) != MACH_OKAY) {
+    fprintf(stderr, "workers_test: couldn't set the emit handler\n");
+    exit(1);
+  }
+
+  /* This heap decodes, encodes, and compares. */
+  duk_context *d = duk_create_heap_default();
+  if (duk_peval_string(d, canon_js) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "workers_test: %s\n", duk_safe_to_string(d, -1));
+    exit(1);
+  }
+  duk_pop(d);
+
+  for (binary = 0; binary <= 1; binary++) {
+    for (mode = MACH_STEPPEDS_FULL; mode <= MACH_STEPPEDS_CHANGED; mode++) {
+      mach_set_format(binary ? MACH_FORMAT_CBOR : MACH_FORMAT_JSON);
+      mach_set_steppeds_mode(mode);
+      char **want = steppeds(d, 1, binary);
+      char **got = steppeds(d, WORKERS, binary);
+      for (i = 0; crews[i] != NULL; i++) {
+        for (j = 0; messages[j] != NULL; j++) {
+          int k = i * nmessages + j;
+          /* A crew without machines can't take a message with "to"
+             either way. */
+          if ((want[k] == NULL) != (got[k] == NULL) ||
+              (want[k] != NULL && strcmp(want[k], got[k]) != 0)) {
+            fprintf(stderr, "workers_test: %s, %s steppeds: crew %d, message %s: wanted %s, got %s\n",
+                    binary ? "CBOR" : "JSON", mode == MACH_STEPPEDS_FULL ? "full" : "changed",
+                    i, messages[j], want[k] ? want[k] : "an error", got[k] ? got[k] : "an error");
+            failures++;
+          }
+          free(want[k]);
+          free(got[k]);
+        }
+      }
+      free(want);
+      free(got);
+    }
+  }
+
+  mach_set_workers(0);
+  duk_destroy_heap(d);
+  mach_close();
+  free(mach_get_ctx());
+  return failures == 0 ? 0 : 1;
+}